@@ -0,0 +1,251 @@
+#include "gabgfx.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Headless benchmark over fixed scenes, camera paths and seeds. Writes one CSV row per scene:
+//   gabgfx_bench [--frames N] [--warmup N] [--width W] [--height H] [--device sel] [--out file.csv]
+// Run from the repo root so src/*.cl and res/ resolve. Only CSV rows go to stdout;
+// renderer and raylib diagnostics go to stderr.
+
+static const char* textures[] = {
+  "res/greystone.png",
+  "res/wood.png",
+  "res/mossy.png",
+  "res/purplestone.png",
+  "res/redbrick.png",
+  "res/colorstone.png",
+  "res/bluestone.png",
+  "res/eagle.png",
+};
+
+static const char* sprites[] = {
+  "res/barrel.png",
+  "res/pillar.png",
+  "res/greenlight.png",
+  "res/demon.png",
+  "res/bullet.png",
+  "res/enemy1.png",
+  "res/enemy2.png",
+  "res/enemy3.png",
+  "res/enemy4.png",
+  "res/shotgun1.png",
+  "res/shotgun2.png",
+  "res/shotgun3.png",
+  "res/shotgun4.png",
+  "res/shotgun5.png",
+  "res/shotgun6.png",
+  "res/shotgun7.png",
+  "res/shotgun8.png",
+};
+
+#define ARR_SIZE(x) (sizeof x / sizeof x[0])
+
+#define BENCH_SEED 0x9E3779B9u
+
+typedef struct {
+  const char* name;
+  RenderMode mode;
+  const char* model;
+  const char* texture;
+  float scale;
+  int grid; // instances per side, laid out on the xz plane
+  int spheres;
+  float orbitRadius, orbitHeight;
+  RasterMode raster;
+} Scene;
+
+static const Scene scenes[] = {
+  { "raster_bunny",  RASTERIZER, "res/bunny.obj",        NULL,             10.0f, 1,   0, 3.0f,  1.0f },
+  { "raster_bunny_forest", RASTERIZER, "res/bunny.obj",  NULL,             10.0f, 100, 0, 40.0f, 8.0f },
+  { "raster_rayman", RASTERIZER, "res/rayman_2_mdl.obj", "res/Rayman.png", 0.1f,  1,   0, 3.0f,  1.0f },
+  { "raster_rayman_tri", RASTERIZER, "res/rayman_2_mdl.obj", "res/Rayman.png", 0.1f, 1, 0, 3.0f, 1.0f, TRIANGLE_PARALLEL },
+  { "raster_bunny_forest_tri", RASTERIZER, "res/bunny.obj", NULL,          10.0f, 100, 0, 40.0f, 8.0f, TRIANGLE_PARALLEL },
+  { "raycast_level", RAYCASTER,  NULL,                   NULL,             1.0f,  1,   0, 0.0f,  0.0f },
+  { "trace_spheres_16",   RAYTRACER, NULL, NULL, 1.0f, 1, 16,   8.0f, 2.0f },
+  { "trace_spheres_128",  RAYTRACER, NULL, NULL, 1.0f, 1, 128,  8.0f, 2.0f },
+  { "trace_spheres_1024", RAYTRACER, NULL, NULL, 1.0f, 1, 1024, 8.0f, 2.0f },
+};
+
+// raylib logs image loads to stdout by default, which would land between CSV rows
+static void log_to_stderr(int logLevel, const char* text, va_list args)
+{
+  (void)logLevel;
+  vfprintf(stderr, text, args);
+  fputc('\n', stderr);
+}
+
+static uint32_t s_rng;
+
+static float rand01(void)
+{
+  s_rng ^= s_rng << 13;
+  s_rng ^= s_rng >> 17;
+  s_rng ^= s_rng << 5;
+  return (s_rng & 0xFFFFFF) / (float)0x1000000;
+}
+
+static void add_random_spheres(int count)
+{
+  s_rng = BENCH_SEED;
+  for(int i = 0; i < count; i++)
+  {
+    Sphere sphere = {
+      .pos = (Vec3){ rand01() * 12.0f - 6.0f, rand01() * 2.0f, rand01() * 12.0f - 6.0f },
+      .radius = 0.1f + rand01() * 0.3f,
+      .material = {
+        .Albedo = (Vec3){ rand01(), rand01(), rand01() },
+        .Roughness = rand01(),
+        .Metallic = rand01() < 0.3f ? 1.0f : 0.0f,
+        .EmissionPower = rand01() < 0.05f ? 4.0f : 0.0f,
+        .Translucent = 0.0f,
+        .IOR = 0.0f
+      }
+    };
+    gfx_add_sphere(sphere);
+  }
+}
+
+// Cell i of the scene's grid, 2 units apart and centred on the origin
+static Mat4 grid_transform(const Scene* scene, int i)
+{
+  float half = (scene->grid - 1) * 1.0f;
+  Vec3 pos = { (i % scene->grid) * 2.0f - half, 0.0f, (i / scene->grid) * 2.0f - half };
+  return MatTransform(pos, (Vec3){ 0.0f, 0.0f, 0.0f }, (Vec3){ scene->scale, scene->scale, scene->scale });
+}
+
+static void load_scene(const Scene* scene)
+{
+  if(scene->mode == RAYCASTER)
+  {
+    gfx_load_assets(textures, ARR_SIZE(textures), sprites, ARR_SIZE(sprites));
+    gfx_load_level("res/level_1.txt");
+  }
+  else if(scene->model)
+  {
+    // every grid cell shares one mesh
+    int model = gfx_load_model(scene->model, scene->texture, grid_transform(scene, 0));
+    for(int i = 1; model >= 0 && i < scene->grid * scene->grid; i++)
+      gfx_add_instance(model, grid_transform(scene, i));
+    gfx_upload_models_data();
+  }
+
+  if(scene->spheres > 0) add_random_spheres(scene->spheres);
+}
+
+// One full orbit over the measured frames; the raycaster turns in place
+static void place_camera(const Scene* scene, int frame, int frames)
+{
+  float angle = 360.0f * frame / frames;
+
+  if(scene->mode == RAYCASTER)
+  {
+    gfx_set_camera((Vec3){ 5.5f, 5.5f, 0.0f }, 180.0f + angle, 0.0f);
+    return;
+  }
+
+  float rad = DegToRad(angle);
+  Vec3 pos = { -sinf(rad) * scene->orbitRadius, scene->orbitHeight, cosf(rad) * scene->orbitRadius };
+  gfx_set_camera(pos, angle - 90.0f, -10.0f);
+}
+
+static double now_ms(void)
+{
+  struct timespec ts;
+  timespec_get(&ts, TIME_UTC);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+static void run_scene(const Scene* scene, int width, int height, int warmup, int frames, FILE* csv)
+{
+  gfx_set_raster_mode(scene->raster);
+  gfx_init_headless(scene->mode, width, height);
+
+  // a _tri row timed on the tile-parallel fallback would be mislabelled; stderr keeps CSV on stdout clean
+  if(scene->mode == RASTERIZER && gfx_raster_mode() != scene->raster)
+  {
+    fprintf(stderr, "Skipping %s: triangle-parallel rasterization needs cl_khr_int64_extended_atomics\n", scene->name);
+    gfx_close();
+    return;
+  }
+
+  load_scene(scene);
+
+  for(int i = 0; i < warmup; i++)
+  {
+    place_camera(scene, i, frames);
+    gfx_draw();
+  }
+
+  double start = now_ms();
+  for(int i = 0; i < frames; i++)
+  {
+    place_camera(scene, i, frames);
+    gfx_draw();
+  }
+  double msPerFrame = (now_ms() - start) / frames;
+
+  // Primary rays only: one per pixel for the path tracer, one per column for the raycaster
+  double raysPerFrame = 0.0;
+  if(scene->mode == RAYTRACER) raysPerFrame = (double)width * height;
+  else if(scene->mode == RAYCASTER) raysPerFrame = width;
+
+  size_t triangles = gfx_triangle_count();
+  double mrays = raysPerFrame / (msPerFrame * 1e3);
+  double trisPerSec = triangles / (msPerFrame * 1e-3);
+
+  fprintf(csv, "%s,%s,%d,%d,%d,%zu,%zu,%.4f,%.3f,%.0f\n",
+          scene->name, gfx_device_info().name, width, height, frames,
+          triangles, gfx_sphere_count(), msPerFrame, mrays, trisPerSec);
+  fflush(csv);
+
+  gfx_close();
+}
+
+int main(int argc, char** argv)
+{
+  SetTraceLogCallback(log_to_stderr);
+
+  int frames = 120, warmup = 10;
+  int width = 800, height = 600;
+  const char* out = NULL;
+  const char* only = NULL;
+
+  for(int i = 1; i < argc; i++)
+  {
+    const char* arg = argv[i];
+    bool hasValue = i + 1 < argc;
+
+    if(strcmp(arg, "--frames") == 0 && hasValue) frames = atoi(argv[++i]);
+    else if(strcmp(arg, "--warmup") == 0 && hasValue) warmup = atoi(argv[++i]);
+    else if(strcmp(arg, "--width") == 0 && hasValue) width = atoi(argv[++i]);
+    else if(strcmp(arg, "--height") == 0 && hasValue) height = atoi(argv[++i]);
+    else if(strcmp(arg, "--device") == 0 && hasValue) gfx_select_device(argv[++i]);
+    else if(strcmp(arg, "--scene") == 0 && hasValue) only = argv[++i];
+    else if(strcmp(arg, "--out") == 0 && hasValue) out = argv[++i];
+    else fprintf(stderr, "Unknown argument: %s\n", arg);
+  }
+
+  if(frames < 1) frames = 1;
+
+  FILE* csv = out ? fopen(out, "w") : stdout;
+  if(!csv)
+  {
+    fprintf(stderr, "Cannot open output file: %s\n", out);
+    return 1;
+  }
+
+  fprintf(csv, "scene,device,width,height,frames,triangles,spheres,ms_per_frame,mrays_per_s,triangles_per_s\n");
+
+  for(size_t i = 0; i < ARR_SIZE(scenes); i++)
+  {
+    if(only && strcmp(only, scenes[i].name) != 0) continue;
+    run_scene(&scenes[i], width, height, warmup, frames, csv);
+  }
+
+  if(csv != stdout) fclose(csv);
+  return 0;
+}
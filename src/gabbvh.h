@@ -0,0 +1,213 @@
+#ifndef GABBVH_H
+#define GABBVH_H
+
+#include "gabmath.h"
+
+#define BVH_BINS 12
+#define BVH_TRAVERSAL_COST 1.0f // relative to one primitive intersection
+#define BVH_MAX_DEPTH 48 // keeps kernel traversal stacks bounded
+
+typedef struct AABB { Vec3 min, max; } AABB;
+
+// GPU layout, 32 bytes. count == 0 -> interior node whose children are
+// leftFirst and leftFirst + 1, otherwise a leaf over indices[leftFirst .. leftFirst + count)
+typedef struct BVHNode {
+  Vec3 min; int leftFirst;
+  Vec3 max; int count;
+} BVHNode;
+
+AABB AABBEmpty(void);
+AABB AABBGrow(AABB box, Vec3 p);
+AABB AABBUnion(AABB a, AABB b);
+float AABBArea(AABB box);
+
+// Builds a binned-SAH BVH over primitive bounds. nodes must hold 2*count-1
+// entries (at least 1), indices must hold count entries. Returns node count.
+int BVHBuild(const AABB* bounds, int count, BVHNode* nodes, int* indices);
+
+#endif // GABBVH_H
+
+#ifdef GABBVH_IMPLEMENTATION
+
+#include <float.h>
+#include <stdlib.h>
+
+AABB AABBEmpty(void)
+{
+  return (AABB){ { FLT_MAX, FLT_MAX, FLT_MAX }, { -FLT_MAX, -FLT_MAX, -FLT_MAX } };
+}
+AABB AABBGrow(AABB box, Vec3 p)
+{
+  box.min = (Vec3){ fminf(box.min.x, p.x), fminf(box.min.y, p.y), fminf(box.min.z, p.z) };
+  box.max = (Vec3){ fmaxf(box.max.x, p.x), fmaxf(box.max.y, p.y), fmaxf(box.max.z, p.z) };
+  return box;
+}
+AABB AABBUnion(AABB a, AABB b)
+{
+  a.min = (Vec3){ fminf(a.min.x, b.min.x), fminf(a.min.y, b.min.y), fminf(a.min.z, b.min.z) };
+  a.max = (Vec3){ fmaxf(a.max.x, b.max.x), fmaxf(a.max.y, b.max.y), fmaxf(a.max.z, b.max.z) };
+  return a;
+}
+float AABBArea(AABB box)
+{
+  float ex = box.max.x - box.min.x;
+  float ey = box.max.y - box.min.y;
+  float ez = box.max.z - box.min.z;
+  if (ex < 0.0f || ey < 0.0f || ez < 0.0f) return 0.0f;
+  return ex * ey + ey * ez + ez * ex;
+}
+
+static inline float BVHAxis(Vec3 v, int axis)
+{
+  return axis == 0 ? v.x : (axis == 1 ? v.y : v.z);
+}
+
+typedef struct {
+  const AABB* bounds;
+  Vec3* centroids;
+  BVHNode* nodes;
+  int* indices;
+  int used;
+} BVHBuilder;
+
+static void BVHSetBounds(BVHBuilder* b, BVHNode* node)
+{
+  AABB box = AABBEmpty();
+  for (int i = 0; i < node->count; i++)
+    box = AABBUnion(box, b->bounds[b->indices[node->leftFirst + i]]);
+  node->min = box.min;
+  node->max = box.max;
+}
+
+static void BVHSubdivide(BVHBuilder* b, int nodeIdx, int depth)
+{
+  BVHNode* node = &b->nodes[nodeIdx];
+  if (node->count <= 1 || depth >= BVH_MAX_DEPTH) return;
+
+  AABB centroidBox = AABBEmpty();
+  for (int i = 0; i < node->count; i++)
+    centroidBox = AABBGrow(centroidBox, b->centroids[b->indices[node->leftFirst + i]]);
+
+  int bestAxis = -1, bestSplit = 0;
+  float bestCost = FLT_MAX;
+
+  for (int axis = 0; axis < 3; axis++)
+  {
+    float cmin = BVHAxis(centroidBox.min, axis);
+    float cmax = BVHAxis(centroidBox.max, axis);
+    if (cmax <= cmin) continue;
+
+    AABB binBox[BVH_BINS];
+    int binCount[BVH_BINS] = {0};
+    for (int k = 0; k < BVH_BINS; k++) binBox[k] = AABBEmpty();
+
+    float scale = BVH_BINS / (cmax - cmin);
+    for (int i = 0; i < node->count; i++)
+    {
+      int prim = b->indices[node->leftFirst + i];
+      int k = (int)((BVHAxis(b->centroids[prim], axis) - cmin) * scale);
+      if (k > BVH_BINS - 1) k = BVH_BINS - 1;
+      binCount[k]++;
+      binBox[k] = AABBUnion(binBox[k], b->bounds[prim]);
+    }
+
+    // Sweep from both sides so every split plane is scored in O(bins)
+    float leftArea[BVH_BINS - 1], rightArea[BVH_BINS - 1];
+    int leftCount[BVH_BINS - 1], rightCount[BVH_BINS - 1];
+    AABB leftBox = AABBEmpty(), rightBox = AABBEmpty();
+    int leftSum = 0, rightSum = 0;
+    for (int k = 0; k < BVH_BINS - 1; k++)
+    {
+      leftSum += binCount[k];
+      leftBox = AABBUnion(leftBox, binBox[k]);
+      leftCount[k] = leftSum;
+      leftArea[k] = AABBArea(leftBox);
+
+      rightSum += binCount[BVH_BINS - 1 - k];
+      rightBox = AABBUnion(rightBox, binBox[BVH_BINS - 1 - k]);
+      rightCount[BVH_BINS - 2 - k] = rightSum;
+      rightArea[BVH_BINS - 2 - k] = AABBArea(rightBox);
+    }
+
+    for (int k = 0; k < BVH_BINS - 1; k++)
+    {
+      if (leftCount[k] == 0 || rightCount[k] == 0) continue;
+      float cost = leftCount[k] * leftArea[k] + rightCount[k] * rightArea[k];
+      if (cost < bestCost)
+      {
+        bestCost = cost;
+        bestAxis = axis;
+        bestSplit = k;
+      }
+    }
+  }
+
+  AABB nodeBox = { node->min, node->max };
+  float nodeArea = AABBArea(nodeBox);
+  if (bestAxis < 0 || bestCost + BVH_TRAVERSAL_COST * nodeArea >= node->count * nodeArea) return;
+
+  float cmin = BVHAxis(centroidBox.min, bestAxis);
+  float scale = BVH_BINS / (BVHAxis(centroidBox.max, bestAxis) - cmin);
+
+  int i = node->leftFirst;
+  int j = i + node->count - 1;
+  while (i <= j)
+  {
+    int k = (int)((BVHAxis(b->centroids[b->indices[i]], bestAxis) - cmin) * scale);
+    if (k > BVH_BINS - 1) k = BVH_BINS - 1;
+    if (k <= bestSplit) i++;
+    else
+    {
+      int tmp = b->indices[i];
+      b->indices[i] = b->indices[j];
+      b->indices[j--] = tmp;
+    }
+  }
+
+  int leftCountFinal = i - node->leftFirst;
+  if (leftCountFinal == 0 || leftCountFinal == node->count) return;
+
+  int left = b->used++;
+  int right = b->used++;
+
+  b->nodes[left].leftFirst = node->leftFirst;
+  b->nodes[left].count = leftCountFinal;
+  b->nodes[right].leftFirst = i;
+  b->nodes[right].count = node->count - leftCountFinal;
+  BVHSetBounds(b, &b->nodes[left]);
+  BVHSetBounds(b, &b->nodes[right]);
+
+  node->leftFirst = left;
+  node->count = 0;
+
+  BVHSubdivide(b, left, depth + 1);
+  BVHSubdivide(b, right, depth + 1);
+}
+
+int BVHBuild(const AABB* bounds, int count, BVHNode* nodes, int* indices)
+{
+  if (count <= 0)
+  {
+    AABB empty = AABBEmpty();
+    nodes[0] = (BVHNode){ empty.min, 0, empty.max, 0 };
+    return 1;
+  }
+
+  BVHBuilder b = { bounds, (Vec3*)malloc(sizeof(Vec3) * count), nodes, indices, 1 };
+
+  for (int i = 0; i < count; i++)
+  {
+    indices[i] = i;
+    b.centroids[i] = Vec3MulS(Vec3Add(bounds[i].min, bounds[i].max), 0.5f);
+  }
+
+  nodes[0].leftFirst = 0;
+  nodes[0].count = count;
+  BVHSetBounds(&b, &nodes[0]);
+  BVHSubdivide(&b, 0, 0);
+
+  free(b.centroids);
+  return b.used;
+}
+
+#endif // GABBVH_IMPLEMENTATION
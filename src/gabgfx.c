@@ -1,6 +1,8 @@
 #include "gabgfx.h"
 #include "raylib.h"
 
+#define GABBVH_IMPLEMENTATION
+#include "gabbvh.h"
 #define GABMATH_IMPLEMENTATION
 #include "gabmath.h"
 #define STB_DS_IMPLEMENTATION
@@ -10,9 +12,18 @@
 #include <assimp/postprocess.h>
 
 #include <stdlib.h>
+#include <ctype.h>
 #include <time.h>
 #include <stdbool.h>
 
+#ifdef _WIN32
+  #include <direct.h>
+  #define MKDIR(path) _mkdir(path)
+#else
+  #include <sys/stat.h>
+  #define MKDIR(path) mkdir(path, 0755)
+#endif
+
 #define RAYGUI_IMPLEMENTATION
 #include "raygui.h"
 
@@ -94,48 +105,17 @@ switch(error){
     }
 }
 
+// Builds filename for device, going through the on-disk binary cache (see build_program)
 #define CL_CHECK_PROGRAM(context, filename, program, device) do { \
-    FILE* file = fopen(filename, "rb"); \
-    if (!file) { \
-        printf("Cannot open kernel file: %s\n", filename); \
-        program = NULL; \
-        exit(1); \
-    } \
-    fseek(file, 0, SEEK_END); \
-    size_t size = ftell(file); \
-    rewind(file); \
-    char* src = (char*)malloc(size + 1); \
-    fread(src, 1, size, file); \
-    src[size] = '\0'; \
-    fclose(file); \
-    program = clCreateProgramWithSource(context, 1, (const char**)&src, NULL, &s_err); \
-    free(src); \
-    if (s_err != CL_SUCCESS) { \
-        printf("clCreateProgramWithSource failed: %d at %s:%d\n", s_err, __FILE__, __LINE__); \
-        printf("OpenCL error :%s\n",getErrorString(s_err)); \
-        program = NULL; \
-        exit(1); \
-    } \
-    s_err = clBuildProgram(program, 1, &device, NULL, NULL, NULL); \
-    if (s_err != CL_SUCCESS) { \
-        size_t log_size; \
-        clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, 0, NULL, &log_size); \
-        char* log = (char*)malloc(log_size); \
-        clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, log_size, log, NULL); \
-        printf("OpenCL build error in %s:\n%s\n", filename, log); \
-        free(log); \
-        clReleaseProgram(program); \
-        program = NULL; \
-        exit(1); \
-    } \
+    program = build_program(context, filename, device); \
 } while(0)
 
 #define CL_CHECK_KERNEL(var, name) do { \
     var = clCreateKernel(s_program, name, &s_err); \
     if (s_err != CL_SUCCESS) { \
-        printf("Failed to create kernel '%s': at %s:%d\n", \
+        fprintf(stderr, "Failed to create kernel '%s': at %s:%d\n", \
                #name, __FILE__, __LINE__); \
-        printf("OpenCL error :%s\n",getErrorString(s_err)); \
+        fprintf(stderr, "OpenCL error :%s\n",getErrorString(s_err)); \
         exit(1); \
     } \
 } while (0)
@@ -143,9 +123,9 @@ switch(error){
 #define CL_CHECK_BUFFER(buffer, cl_enum, buffer_size, host_ptr) do { \
     buffer = clCreateBuffer(s_context, cl_enum, buffer_size, host_ptr, &s_err); \
     if (s_err != CL_SUCCESS) { \
-        printf("Failed to create buffer '%s': at %s:%d\n", \
+        fprintf(stderr, "Failed to create buffer '%s': at %s:%d\n", \
                #buffer, __FILE__, __LINE__); \
-        printf("OpenCL error :%s\n",getErrorString(s_err)); \
+        fprintf(stderr, "OpenCL error :%s\n",getErrorString(s_err)); \
         exit(1); \
     } \
 } while (0)
@@ -153,9 +133,9 @@ switch(error){
 #define CL_CHECK_SET_KERNEL_ARG(kernel, arg_index, arg_size, arg) do { \
     s_err = clSetKernelArg(kernel, arg_index, arg_size, &arg); \
     if (s_err != CL_SUCCESS) { \
-        printf("Failed to set arg '%s': at %s:%d\n", \
+        fprintf(stderr, "Failed to set arg '%s': at %s:%d\n", \
                #arg, __FILE__, __LINE__); \
-        printf("OpenCL error :%s\n",getErrorString(s_err)); \
+        fprintf(stderr, "OpenCL error :%s\n",getErrorString(s_err)); \
         exit(1); \
     } \
 } while (0)
@@ -166,26 +146,62 @@ switch(error){
         0, NULL, NULL \
     ); \
     if (s_err != CL_SUCCESS) { \
-        printf("Failed to write buffer '%s': %s:%d\n", \
+        fprintf(stderr, "Failed to write buffer '%s': %s:%d\n", \
                #arg, __FILE__, __LINE__); \
-        printf("OpenCL error: %s\n", getErrorString(s_err)); \
+        fprintf(stderr, "OpenCL error: %s\n", getErrorString(s_err)); \
         exit(1); \
     } \
 } while(0)
 
+// Releases an OpenCL object once and clears the handle; NULL handles are skipped
+#define CL_RELEASE(release, handle) do { \
+    if (handle) release(handle); \
+    handle = NULL; \
+} while (0)
+
 #define CL_CHECK(func) do { \
   s_err = func; \
   if (s_err != CL_SUCCESS) { \
-      printf("Failed at %s:%d\n", __FILE__, __LINE__); \
-      printf("OpenCL error :%s\n",getErrorString(s_err)); \
+      fprintf(stderr, "Failed at %s:%d\n", __FILE__, __LINE__); \
+      fprintf(stderr, "OpenCL error :%s\n",getErrorString(s_err)); \
       exit(1); \
   } \
 } while(0)
 
+// Rasterizer screen tiles; TILE_SIZE and HIZ_BLOCK must match rasterizer.cl
+#define TILE_SIZE 16
+#define TILE_CAPACITY 2048
+#define HIZ_BLOCK 4 // tiles per side of a level 1 Hi-Z entry
+#define RASTER_GROUP 64 // triangles per work-group in triangle_kernel
+#define RASTER_BATCH_VERTS (1 << 20) // expanded stream vertices per batch, clip corners included
+
+// Raycaster sprite sort; must match raycaster.cl
+#define SPRITE_SORT_GROUP 128
+#define SPRITE_TILE_WIDTH 64 // screen columns per sprites_kernel work-group
+#define VISIBLE_SPRITE_SIZE 32
+#define SPRITE_SIM_STEP (1.0f / 60.0f) // seconds per headless frame
+#define WALL_COLUMN_SIZE 28 // sizeof WallColumn in raycaster.cl
+#define OCCUPANCY_MAX_LEVELS 16 // covers LEVEL_MAX_SIZE cells per side
+
+// Wavefront path tracer; sizes of PathState / PathHit in raytracer.cl
+#define PATH_STATE_SIZE 64
+#define PATH_HIT_SIZE 32
+#define SURFACE_HIT_SIZE 48
+#define MATERIAL_CLASSES 3 // glass, mirror, surface; matches raytracer.cl
+#define WAVEFRONT_GROUP_SIZE 64
+#define MAX_BOUNCES 32 // gfx_set_max_bounces clamps to this
+
 static RenderMode s_mode;
+static RasterMode s_rasterMode = TILE_PARALLEL;
+static bool s_headless = false;
 
 static cl_platform_id s_platform;
 static cl_device_id s_device;
+static const char* s_deviceSelector = NULL;
+static const char* s_buildOptions = "";
+static bool s_imagesRequested = true;
+static bool s_useImages = false; // textures as an image2d_t atlas, see create_texture_image
+static GfxDeviceInfo s_deviceInfo = {0};
 static cl_program s_program;
 static cl_context s_context;
 static cl_command_queue s_queue;
@@ -194,13 +210,33 @@ static cl_int s_err;
 static cl_kernel s_clearKernel;
 static cl_kernel s_vertexKernel;
 static cl_kernel s_fragmentKernel;
-
+static cl_kernel s_binKernel;
+static cl_kernel s_clipKernel;
+static cl_kernel s_hiZKernel;
+static cl_kernel s_triangleKernel;
+static cl_kernel s_resolveKernel;
+static cl_kernel s_generateKernel;
+static cl_kernel s_extendKernel;
+static cl_kernel s_classifyKernel;
+static cl_kernel s_shadeKernels[MATERIAL_CLASSES];
+static cl_kernel s_accumulateKernel;
+
+static cl_kernel s_wallColumnsKernel;
 static cl_kernel s_surfaceKernel;
 static cl_kernel s_spritesKernel;
+static cl_kernel s_simulateSpritesKernel;
+static cl_kernel s_projectSpritesKernel;
+static cl_kernel s_sortSpritesLocalKernel;
+static cl_kernel s_sortSpritesStepKernel;
+static cl_kernel s_compactSpritesKernel;
 
 static cl_mem s_frameBuffer;
 static cl_mem s_depthBuffer;
 static cl_mem s_projectedVertsBuffer;
+static cl_mem s_clipVertsBuffer;
+static cl_mem s_visibleIndicesBuffer;
+static cl_mem s_clipCountsBuffer;
+static cl_mem s_visibleInstancesBuffer;
 static cl_mem s_fragPosBuffer;
 static cl_mem s_projectionBuffer;
 static cl_mem s_inverseProjectionBuffer;
@@ -208,17 +244,50 @@ static cl_mem s_viewBuffer;
 static cl_mem s_inverseViewBuffer;
 static cl_mem s_cameraPosBuffer;
 static cl_mem s_trianglesBuffer;
+static cl_mem s_positionsBuffer;
+static cl_mem s_normalsBuffer;
+static cl_mem s_uvsBuffer;
+static cl_mem s_instanceTransformsBuffer;
+static cl_mem s_visibleNormalsBuffer;
+static cl_mem s_visibleUVsBuffer;
+static cl_mem s_visibleModelIdxBuffer;
+static cl_mem s_indicesBuffer;
 static cl_mem s_pixelsBuffer;
 static cl_mem s_modelsBuffer;
 static cl_mem s_spheresBuffer;
+static cl_mem s_bvhNodesBuffer;
+static cl_mem s_bvhIndicesBuffer;
+static cl_mem s_blasNodesBuffer;
+static cl_mem s_blasIndicesBuffer;
+static cl_mem s_tlasNodesBuffer;
+static cl_mem s_tlasIndicesBuffer;
+static cl_mem s_instancesBuffer;
 static cl_mem s_accumulationBuffer;
+static cl_mem s_tileCountsBuffer;
+static cl_mem s_tileTrisBuffer;
+static cl_mem s_hiZBuffer;
+static cl_mem s_depthColorBuffer; // TRIANGLE_PARALLEL, depth key << 32 | color
+static cl_mem s_pathBuffers[2];
+static cl_mem s_hitBuffer;
+static cl_mem s_surfaceHitBuffer;
+static cl_mem s_materialQueuesBuffer;
+static cl_mem s_queueCountsBuffer;
+static cl_mem s_radianceBuffer;
 
 static cl_mem s_playerBuffer;
 static cl_mem s_spritesBuffer;
 static cl_mem s_textureBuffer;
-static cl_mem s_spritesDataBuffer;
+static cl_mem s_spritesDataBuffers[2]; // previous and next simulation state, see enqueue_sprite_simulation
+static int s_spriteState = 0;            // index of the latest state
 static cl_mem s_mapBuffer;
-static cl_mem s_spriteOrderBuffer;
+static cl_mem s_wallColumnsBuffer;
+static cl_mem s_occupancyBuffer;
+static cl_mem s_occupancyLayoutBuffer;
+static cl_mem s_projectedSpritesBuffer;
+static cl_mem s_spriteKeysBuffer;
+static cl_mem s_visibleSpritesBuffer;
+static cl_mem s_visibleSpriteCountBuffer;
+static size_t s_spriteSortSize = 0; // sprites padded to a power of two, at least SPRITE_SORT_GROUP
 static cl_mem s_spriteDistanceBuffer;
 
 typedef struct {
@@ -235,23 +304,51 @@ typedef struct {
 
 static CustomCamera s_camera = {0};
 
+// Must match Triangle in raytracer.cl; padded to 112 bytes so every record starts 16-byte aligned
 typedef struct {
-  Vec3 vertex[3]; 
+  Vec3 vertex[3];
   Vec3 normal[3];
   Vec2 uv[3];
   int modelIdx;
+  int pad[3];
 } Triangle;
+_Static_assert(sizeof(Triangle) == 112, "Triangle layout must match raytracer.cl");
 
 typedef struct {
   int triangleOffset, triangleCount;
   int vertexOffset, vertexCount;
   int pixelOffset, texWidth, texHeight;
-  Mat4 transform;
+  Vec3 boundsMin, boundsMax; // local space
+  Vec3 sphereCenter;
+  float sphereRadius;
+  int mipLevels; // levels stored back to back from pixelOffset
+  int atlasX, atlasY; // level 0 in the texture image, image path only
 } CustomModel;
 
-typedef struct { int offset, width, height; } Sprite;
+// Rasterizer frustum cull output, rebuilt every frame; starts are prefix sums
+// into the per-frame vertex and triangle streams
+typedef struct {
+  int instance, model;
+  int vertexStart, triangleStart;
+} VisibleInstance;
+
+// A run of visible instances whose expanded streams fit RASTER_BATCH_VERTS; the
+// instances' starts are relative to the batch
+typedef struct {
+  int first, count;
+  size_t verts, triangles;
+} RasterBatch;
+
+// Path tracer view of a CustomModel; models loaded from the same file share one BLAS
+typedef struct {
+  Mat4 transform;
+  Mat4 inverse;
+  int blasRoot;
+  int pixelOffset, texWidth, texHeight;
+  CustomMaterial material;
+} MeshInstance;
 
-typedef struct { float dist; int index; } SpriteSort;
+typedef struct { int offset, width, height, mipLevels, atlasX, atlasY; } Sprite;
 
 typedef struct {
   float x, y;
@@ -260,22 +357,19 @@ typedef struct {
   float moveSpeed, rotSpeed;
 } Player;
 
-typedef struct {
-  Vec3 Albedo;
-  float Roughness;
-  float Metallic;
-  float EmissionPower;
-  float Translucent;
-  float IOR;
-} CustomMaterial;
-
-typedef struct {
-  Vec3 pos;
-  float radius;
-  CustomMaterial material;
-} Sphere;
-
 static Sphere* s_Spheres = NULL;
+static BVHNode* s_bvhNodes = NULL;
+static int* s_bvhIndices = NULL;
+static AABB* s_sphereBounds = NULL;
+static size_t s_sphereCapacity = 0;
+static bool s_spheresDirty = false;
+static bool s_resetAccumulation = true;
+
+static BVHNode* s_blasNodes = NULL;
+static int* s_blasIndices = NULL;
+static BVHNode* s_tlasNodes = NULL;
+static int* s_tlasIndices = NULL;
+static MeshInstance* s_Instances = NULL;
 
 static uint32_t s_frameIndex = 1;
 
@@ -284,15 +378,86 @@ static size_t s_screenSize[2];
 static uint32_t s_width;
 static uint32_t s_height;
 static uint32_t s_screenResolution;
-static Color* s_pixelBuffer = NULL;
+static size_t s_tileCount;
+static size_t s_hiZCount; // tiles plus HIZ_BLOCK x HIZ_BLOCK blocks
+static size_t s_rasterSize[2];
+static size_t s_tileLocalSize[2] = { TILE_SIZE, TILE_SIZE };
+static size_t s_pathGlobalSize;
+static size_t s_pathLocalSize = WAVEFRONT_GROUP_SIZE;
+static size_t s_spriteColumnsSize; // screen width rounded up to SPRITE_TILE_WIDTH
+static size_t s_spriteTileSize = SPRITE_TILE_WIDTH;
+static uint32_t s_maxBounces = 5;
+static Color* s_pixelBuffer = NULL; // latest completed frame, points into a readback slot
+
+// Readback ring: the device renders frame N into slot N % FRAMES_IN_FLIGHT while
+// the host presents slot (N - 1) from pinned, persistently mapped memory
+#define FRAMES_IN_FLIGHT 2
+static cl_mem s_readbackBuffers[FRAMES_IN_FLIGHT];
+static Color* s_readbackPixels[FRAMES_IN_FLIGHT];
+static cl_event s_readbackEvents[FRAMES_IN_FLIGHT];
+static int s_frameSlot = 0;
+static bool s_framePending = false;
+
+// Per-stage device timings from CL_QUEUE_PROFILING_ENABLE events, collected when a slot's readback lands
+typedef enum {
+  PROF_CLEAR, PROF_TILE_RESET, PROF_VERTEX, PROF_CLIP, PROF_HIZ, PROF_BIN, PROF_FRAGMENT,
+  PROF_TRIANGLE, PROF_RESOLVE,
+  PROF_SPRITE_SIMULATE, PROF_SPRITE_PROJECT, PROF_SPRITE_SORT, PROF_WALL_COLUMNS, PROF_SURFACE, PROF_SPRITES, PROF_ACCUM_CLEAR,
+  PROF_GENERATE, PROF_EXTEND, PROF_CLASSIFY, PROF_SHADE_GLASS, PROF_SHADE_MIRROR, PROF_SHADE_SURFACE, PROF_ACCUMULATE,
+  PROF_READBACK, PROF_COUNT
+} ProfileStage;
+
+static const char* s_profStageNames[PROF_COUNT] = {
+  "clear_buffers", "tile_reset", "vertex_kernel", "clip_kernel", "hiz_kernel", "bin_kernel", "fragment_kernel",
+  "triangle_kernel", "resolve_kernel",
+  "simulate_sprites_kernel", "project_sprites_kernel", "sprite_sort", "wall_columns_kernel", "surface_kernel", "sprites_kernel", "accum_clear",
+  "generate_kernel", "extend_kernel", "classify_kernel", "shade_glass_kernel", "shade_mirror_kernel", "shade_surface_kernel", "accumulate_kernel",
+  "readback"
+};
+
+#define PROFILE_WINDOW 128
+#define PROFILE_MAX_TRACE 65536
+
+typedef struct {
+  float samples[PROFILE_WINDOW]; // ms, ring
+  int count, next;
+} ProfileHistory;
+
+typedef struct {
+  int stage;
+  cl_ulong start, end; // ns, device clock
+} TraceEvent;
+
+static bool s_profiling = false;
+typedef struct { ProfileStage stage; cl_event event; } ProfileEvent;
+
+// Grows per frame: wavefront stages enqueue once per bounce, raster stages once per batch
+static ProfileEvent* s_profEvents[FRAMES_IN_FLIGHT];
+static ProfileHistory s_profHistory[PROF_COUNT];
+static TraceEvent* s_traceEvents = NULL;
 static Texture2D s_outputTexture;
 
-static Triangle* s_allTriangles = NULL;
+static Triangle* s_allTriangles = NULL; // path tracer
+// Rasterizer vertices, unique per model, as parallel streams (16 bytes per vertex):
+// position, octahedral normal (2x snorm16), uv (2x half)
+static Vec3* s_vertexPositions = NULL;
+static uint32_t* s_vertexNormals = NULL;
+static uint32_t* s_vertexUVs = NULL;
+static uint32_t* s_allIndices = NULL;   // rasterizer, 3 absolute vertex indices per triangle
 static Color* s_allTexturePixels = NULL;
-static CustomModel* s_Models = NULL;
+static CustomModel* s_Models = NULL;        // one per distinct mesh
+static Mat4* s_instanceTransforms = NULL;   // one per placement, 64 bytes on the device
+static int* s_instanceModels = NULL;
+static VisibleInstance* s_visibleInstances = NULL;
+static size_t s_visibleVerts = 0;
+static size_t s_visibleTriangles = 0;
+static RasterBatch* s_rasterBatches = NULL;
+static size_t s_visibleVertCapacity = 0;
+static char** s_modelKeys = NULL;
 
 static size_t s_totalTriangles = 0;
 static size_t s_totalVerts = 0;
+static size_t s_visibleCapacity = 0; // clip_kernel output triangles, 2 per visible source triangle
 static size_t s_totalTexturePixels = 0;
 static size_t s_triOffset = 0;
 static size_t s_pixOffset = 0;
@@ -302,9 +467,11 @@ static Player s_Player;
 static Sprite* s_Sprites = NULL;
 static Color* texture_atlas = NULL;
 
-static size_t s_numSprites;
-static int s_spriteOrder[120];
-static SpriteData s_spritesData[120]; 
+// Current raycaster level, see gfx_load_level
+static unsigned char* s_map = NULL; // row-major, s_mapWidth x s_mapHeight cells
+static int s_mapWidth = 0;
+static int s_mapHeight = 0;
+static SpriteData* s_spritesData = NULL;
 
 static int s_ui_first_frame = 17;
 static int s_ui_last_frame  = 23;
@@ -316,67 +483,480 @@ static float s_ui_anim_fps   = 6.0f;
 
 static Vec4 zero = { 0.0f, 0.0f, 0.0f, 0.0f };
 
-unsigned char map[11][11] = {
-    {1,1,1,1,1,1,1,1,1,1,1},
-    {1,0,0,0,0,0,0,0,0,0,1},
-    {1,0,5,5,0,0,0,4,4,0,1},
-    {1,0,5,0,0,0,0,0,4,0,1},
-    {1,0,0,0,0,0,0,0,0,0,1},
-    {1,0,0,0,0,0,0,0,0,0,1},
-    {1,0,0,0,0,0,0,0,0,0,1},
-    {1,0,2,0,0,0,0,0,3,0,1},
-    {1,0,2,2,0,0,0,3,3,0,1},
-    {1,0,0,0,0,0,0,0,0,0,1},
-    {1,1,1,1,1,1,1,1,1,1,1}
-};
+// Cells outside the map count as walls
+static inline int map_cell(float x, float y)
+{
+  if(x < 0.0f || y < 0.0f || x >= s_mapWidth || y >= s_mapHeight) return 1;
+  return s_map[(int)y * s_mapWidth + (int)x];
+}
 
-static inline int sprite_cmp(const void* a, const void* b)
+static void set_mesh_args(uint32_t instanceCount)
 {
-    float d = ((SpriteSort*)b)->dist - ((SpriteSort*)a)->dist;
-    return (d > 0) - (d < 0); // malejąco
+  CL_CHECK_SET_KERNEL_ARG(s_extendKernel, 8, sizeof(cl_mem), s_trianglesBuffer);
+  CL_CHECK_SET_KERNEL_ARG(s_extendKernel, 9, sizeof(cl_mem), s_blasNodesBuffer);
+  CL_CHECK_SET_KERNEL_ARG(s_extendKernel, 10, sizeof(cl_mem), s_blasIndicesBuffer);
+  CL_CHECK_SET_KERNEL_ARG(s_extendKernel, 11, sizeof(cl_mem), s_tlasNodesBuffer);
+  CL_CHECK_SET_KERNEL_ARG(s_extendKernel, 12, sizeof(cl_mem), s_tlasIndicesBuffer);
+  CL_CHECK_SET_KERNEL_ARG(s_extendKernel, 13, sizeof(cl_mem), s_instancesBuffer);
+  CL_CHECK_SET_KERNEL_ARG(s_extendKernel, 14, sizeof(uint32_t), instanceCount);
+
+  CL_CHECK_SET_KERNEL_ARG(s_classifyKernel, 11, sizeof(cl_mem), s_trianglesBuffer);
+  CL_CHECK_SET_KERNEL_ARG(s_classifyKernel, 12, sizeof(cl_mem), s_instancesBuffer);
+  CL_CHECK_SET_KERNEL_ARG(s_classifyKernel, 13, sizeof(cl_mem), s_pixelsBuffer);
 }
 
-static inline void sortSprites(
-    Player* p,
-    SpriteData* sprites,
-    int num,
-    int* spriteOrder)
+// Rebuilds the sphere BVH and uploads it, growing the device buffers when
+// spheres were added past their capacity.
+static void upload_spheres(void)
 {
-  SpriteSort tmp[120];
+  size_t count = arrlen(s_Spheres);
+
+  if(count > s_sphereCapacity || !s_spheresBuffer)
+  {
+    s_sphereCapacity = s_sphereCapacity ? s_sphereCapacity : 8;
+    while(s_sphereCapacity < count) s_sphereCapacity *= 2;
+
+    if(s_spheresBuffer) clReleaseMemObject(s_spheresBuffer);
+    if(s_bvhNodesBuffer) clReleaseMemObject(s_bvhNodesBuffer);
+    if(s_bvhIndicesBuffer) clReleaseMemObject(s_bvhIndicesBuffer);
+
+    CL_CHECK_BUFFER(s_spheresBuffer, CL_MEM_READ_ONLY, sizeof(Sphere) * s_sphereCapacity, NULL);
+    CL_CHECK_BUFFER(s_bvhNodesBuffer, CL_MEM_READ_ONLY, sizeof(BVHNode) * (2 * s_sphereCapacity - 1), NULL);
+    CL_CHECK_BUFFER(s_bvhIndicesBuffer, CL_MEM_READ_ONLY, sizeof(int) * s_sphereCapacity, NULL);
+
+    CL_CHECK_SET_KERNEL_ARG(s_extendKernel, 4, sizeof(cl_mem), s_spheresBuffer);
+    CL_CHECK_SET_KERNEL_ARG(s_extendKernel, 6, sizeof(cl_mem), s_bvhNodesBuffer);
+    CL_CHECK_SET_KERNEL_ARG(s_extendKernel, 7, sizeof(cl_mem), s_bvhIndicesBuffer);
+    CL_CHECK_SET_KERNEL_ARG(s_classifyKernel, 10, sizeof(cl_mem), s_spheresBuffer);
+  }
+
+  arrsetlen(s_sphereBounds, count);
+  arrsetlen(s_bvhNodes, 2 * s_sphereCapacity - 1);
+  arrsetlen(s_bvhIndices, s_sphereCapacity);
+
+  for(size_t i = 0; i < count; i++)
+  {
+    float r = fabsf(s_Spheres[i].radius);
+    Vec3 c = s_Spheres[i].pos;
+    s_sphereBounds[i] = (AABB){ { c.x - r, c.y - r, c.z - r }, { c.x + r, c.y + r, c.z + r } };
+  }
 
-  for (int i = 0; i < num; i++) {
-      float dx = p->x - sprites[i].x;
-      float dy = p->y - sprites[i].y;
-      tmp[i].dist = dx*dx + dy*dy;
-      tmp[i].index = i;
+  int nodeCount = BVHBuild(s_sphereBounds, count, s_bvhNodes, s_bvhIndices);
+
+  if(count > 0)
+  {
+    // Blocking: the GUI edits s_Spheres while this frame is still in flight
+    CL_CHECK_WRITE_BUFFER(s_spheresBuffer, CL_TRUE, 0, sizeof(Sphere) * count, s_Spheres);
+    CL_CHECK_WRITE_BUFFER(s_bvhIndicesBuffer, CL_TRUE, 0, sizeof(int) * count, s_bvhIndices);
   }
+  CL_CHECK_WRITE_BUFFER(s_bvhNodesBuffer, CL_TRUE, 0, sizeof(BVHNode) * nodeCount, s_bvhNodes);
 
-  qsort(tmp, num, sizeof(SpriteSort), sprite_cmp);
+  uint32_t size = count;
+  CL_CHECK_SET_KERNEL_ARG(s_extendKernel, 5, sizeof(uint32_t), size);
 
-  for (int i = 0; i < num; i++)
-      spriteOrder[i] = tmp[i].index;
+  s_spheresDirty = false;
 }
 
-void gfx_init(RenderMode mode)
+typedef struct {
+  cl_platform_id platform;
+  cl_device_id device;
+  cl_device_type type;
+  char name[128];
+} DeviceEntry;
+
+// Every device of every platform, flattened in enumeration order
+static DeviceEntry* enumerate_devices(void)
 {
-  InitWindow(800, 600, "GABGFX");
-  SetTargetFPS(60);
+  DeviceEntry* entries = NULL;
 
-  if(!IsWindowReady())
+  cl_uint platformCount = 0;
+  if(clGetPlatformIDs(0, NULL, &platformCount) != CL_SUCCESS || platformCount == 0) return NULL;
+
+  cl_platform_id* platforms = malloc(sizeof(cl_platform_id) * platformCount);
+  clGetPlatformIDs(platformCount, platforms, NULL);
+
+  for(cl_uint p = 0; p < platformCount; p++)
+  {
+    cl_uint deviceCount = 0;
+    if(clGetDeviceIDs(platforms[p], CL_DEVICE_TYPE_ALL, 0, NULL, &deviceCount) != CL_SUCCESS) continue;
+
+    cl_device_id* devices = malloc(sizeof(cl_device_id) * deviceCount);
+    clGetDeviceIDs(platforms[p], CL_DEVICE_TYPE_ALL, deviceCount, devices, NULL);
+
+    for(cl_uint d = 0; d < deviceCount; d++)
+    {
+      DeviceEntry entry = { platforms[p], devices[d], 0, {0} };
+      clGetDeviceInfo(devices[d], CL_DEVICE_TYPE, sizeof(entry.type), &entry.type, NULL);
+      clGetDeviceInfo(devices[d], CL_DEVICE_NAME, sizeof(entry.name), entry.name, NULL);
+      arrpush(entries, entry);
+    }
+    free(devices);
+  }
+  free(platforms);
+
+  return entries;
+}
+
+static int find_device_by_type(DeviceEntry* entries, cl_device_type type)
+{
+  for(int i = 0; i < arrlen(entries); i++)
+    if(entries[i].type & type) return i;
+  return -1;
+}
+
+static bool str_contains_nocase(const char* haystack, const char* needle)
+{
+  size_t n = strlen(needle);
+  for(; *haystack; haystack++)
+  {
+    size_t i = 0;
+    while(i < n && haystack[i] && tolower((unsigned char)haystack[i]) == tolower((unsigned char)needle[i])) i++;
+    if(i == n) return true;
+  }
+  return false;
+}
+
+// selector: "gpu" | "cpu" | "accelerator" | "<index>" | "<platform>:<device>" | name substring
+static int match_device(DeviceEntry* entries, const char* selector)
+{
+  if(strcmp(selector, "gpu") == 0) return find_device_by_type(entries, CL_DEVICE_TYPE_GPU);
+  if(strcmp(selector, "cpu") == 0) return find_device_by_type(entries, CL_DEVICE_TYPE_CPU);
+  if(strcmp(selector, "accelerator") == 0) return find_device_by_type(entries, CL_DEVICE_TYPE_ACCELERATOR);
+
+  int platformIdx, deviceIdx;
+  char tail;
+  if(sscanf(selector, "%d:%d%c", &platformIdx, &deviceIdx, &tail) == 2)
+  {
+    int p = -1;
+    for(int i = 0; i < arrlen(entries); i++)
+    {
+      if(i == 0 || entries[i].platform != entries[i - 1].platform) p++;
+      if(p == platformIdx)
+      {
+        if(deviceIdx == 0) return i;
+        deviceIdx--;
+      }
+    }
+    return -1;
+  }
+
+  if(sscanf(selector, "%d%c", &deviceIdx, &tail) == 1)
+    return (deviceIdx >= 0 && deviceIdx < arrlen(entries)) ? deviceIdx : -1;
+
+  for(int i = 0; i < arrlen(entries); i++)
+    if(str_contains_nocase(entries[i].name, selector)) return i;
+
+  return -1;
+}
+
+static void query_device_info(void)
+{
+  GfxDeviceInfo* info = &s_deviceInfo;
+  clGetPlatformInfo(s_platform, CL_PLATFORM_NAME, sizeof(info->platform), info->platform, NULL);
+  clGetDeviceInfo(s_device, CL_DEVICE_NAME, sizeof(info->name), info->name, NULL);
+  clGetDeviceInfo(s_device, CL_DEVICE_VENDOR, sizeof(info->vendor), info->vendor, NULL);
+  clGetDeviceInfo(s_device, CL_DEVICE_VERSION, sizeof(info->version), info->version, NULL);
+  clGetDeviceInfo(s_device, CL_DRIVER_VERSION, sizeof(info->driver), info->driver, NULL);
+  clGetDeviceInfo(s_device, CL_DEVICE_TYPE, sizeof(info->type), &info->type, NULL);
+  clGetDeviceInfo(s_device, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(info->computeUnits), &info->computeUnits, NULL);
+  clGetDeviceInfo(s_device, CL_DEVICE_MAX_CLOCK_FREQUENCY, sizeof(info->clockMHz), &info->clockMHz, NULL);
+  clGetDeviceInfo(s_device, CL_DEVICE_GLOBAL_MEM_SIZE, sizeof(info->globalMemSize), &info->globalMemSize, NULL);
+  clGetDeviceInfo(s_device, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(info->localMemSize), &info->localMemSize, NULL);
+  clGetDeviceInfo(s_device, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(info->maxWorkGroupSize), &info->maxWorkGroupSize, NULL);
+  clGetDeviceInfo(s_device, CL_DEVICE_PREFERRED_VECTOR_WIDTH_CHAR, sizeof(info->vectorWidthChar), &info->vectorWidthChar, NULL);
+  clGetDeviceInfo(s_device, CL_DEVICE_PREFERRED_VECTOR_WIDTH_INT, sizeof(info->vectorWidthInt), &info->vectorWidthInt, NULL);
+  clGetDeviceInfo(s_device, CL_DEVICE_PREFERRED_VECTOR_WIDTH_FLOAT, sizeof(info->vectorWidthFloat), &info->vectorWidthFloat, NULL);
+}
+
+static bool device_has_extension(const char* name)
+{
+  size_t size = 0;
+  if(clGetDeviceInfo(s_device, CL_DEVICE_EXTENSIONS, 0, NULL, &size) != CL_SUCCESS || size == 0) return false;
+
+  char* extensions = malloc(size);
+  clGetDeviceInfo(s_device, CL_DEVICE_EXTENSIONS, size, extensions, NULL);
+
+  bool found = false;
+  size_t len = strlen(name);
+  for(const char* at = strstr(extensions, name); at && !found; at = strstr(at + len, name))
+    found = (at == extensions || at[-1] == ' ') && (at[len] == ' ' || at[len] == '\0');
+
+  free(extensions);
+  return found;
+}
+
+// Whether a kernel can be launched with a fixed local size: the device limit and the
+// per-kernel limit (lower for register or local memory heavy kernels) both apply
+static bool kernel_fits_group(cl_kernel kernel, size_t groupSize)
+{
+  size_t kernelMax = 0;
+  if(clGetKernelWorkGroupInfo(kernel, s_device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(kernelMax), &kernelMax, NULL) != CL_SUCCESS) return false;
+  return groupSize <= kernelMax && groupSize <= s_deviceInfo.maxWorkGroupSize;
+}
+
+// Image objects need CL_DEVICE_IMAGE_SUPPORT and clCreateImage (OpenCL 1.2)
+static bool device_supports_images(void)
+{
+  cl_bool imageSupport = CL_FALSE;
+  clGetDeviceInfo(s_device, CL_DEVICE_IMAGE_SUPPORT, sizeof(imageSupport), &imageSupport, NULL);
+
+  int major = 0, minor = 0;
+  sscanf(s_deviceInfo.version, "OpenCL %d.%d", &major, &minor);
+  return imageSupport && (major > 1 || (major == 1 && minor >= 2));
+}
+
+static const char* device_type_name(cl_device_type type)
+{
+  if(type & CL_DEVICE_TYPE_GPU) return "GPU";
+  if(type & CL_DEVICE_TYPE_CPU) return "CPU";
+  if(type & CL_DEVICE_TYPE_ACCELERATOR) return "ACCELERATOR";
+  return "OTHER";
+}
+
+// Explicit selector, then GABGFX_DEVICE, then first GPU, then first CPU, then anything
+static void select_device(void)
+{
+  DeviceEntry* entries = enumerate_devices();
+  if(arrlen(entries) == 0)
   {
-    printf("Initialize window first! - InitWindow()");
+    fprintf(stderr, "No OpenCL devices found\n");
+    exit(1);
+  }
+
+  const char* selector = s_deviceSelector ? s_deviceSelector : getenv("GABGFX_DEVICE");
+  int chosen = -1;
+
+  if(selector && *selector)
+  {
+    chosen = match_device(entries, selector);
+    if(chosen < 0) fprintf(stderr, "No OpenCL device matches '%s', falling back\n", selector);
+  }
+  if(chosen < 0) chosen = find_device_by_type(entries, CL_DEVICE_TYPE_GPU);
+  if(chosen < 0) chosen = find_device_by_type(entries, CL_DEVICE_TYPE_CPU);
+  if(chosen < 0) chosen = 0;
+
+  s_platform = entries[chosen].platform;
+  s_device = entries[chosen].device;
+  arrfree(entries);
+
+  query_device_info();
+
+  GfxDeviceInfo* info = &s_deviceInfo;
+  fprintf(stderr, "OpenCL device: %s (%s, %s)\n", info->name, device_type_name(info->type), info->platform);
+  fprintf(stderr, "  %s, driver %s\n", info->version, info->driver);
+  fprintf(stderr, "  compute units %u @ %u MHz, global %llu MB, local %llu KB, max work-group %zu\n",
+         info->computeUnits, info->clockMHz,
+         (unsigned long long)(info->globalMemSize >> 20), (unsigned long long)(info->localMemSize >> 10),
+         info->maxWorkGroupSize);
+  fprintf(stderr, "  preferred vector width char %u, int %u, float %u\n",
+         info->vectorWidthChar, info->vectorWidthInt, info->vectorWidthFloat);
+}
+
+void gfx_select_device(const char* selector)
+{
+  s_deviceSelector = selector;
+}
+
+void gfx_list_devices(void)
+{
+  DeviceEntry* entries = enumerate_devices();
+  int p = -1, d = 0;
+
+  for(int i = 0; i < arrlen(entries); i++)
+  {
+    if(i == 0 || entries[i].platform != entries[i - 1].platform)
+    {
+      char platformName[128] = {0};
+      clGetPlatformInfo(entries[i].platform, CL_PLATFORM_NAME, sizeof(platformName), platformName, NULL);
+      printf("Platform %d: %s\n", ++p, platformName);
+      d = 0;
+    }
+    printf("  [%d] %d:%d %s (%s)\n", i, p, d++, entries[i].name, device_type_name(entries[i].type));
+  }
+
+  if(arrlen(entries) == 0) printf("No OpenCL devices found\n");
+  arrfree(entries);
+}
+
+GfxDeviceInfo gfx_device_info(void)
+{
+  return s_deviceInfo;
+}
+
+static char* read_file(const char* filePath, size_t* outSize)
+{
+  FILE* file = fopen(filePath, "rb");
+  if(!file) return NULL;
+
+  fseek(file, 0, SEEK_END);
+  size_t size = ftell(file);
+  rewind(file);
+
+  char* data = malloc(size + 1);
+  if(fread(data, 1, size, file) != size)
+  {
+    free(data);
+    fclose(file);
+    return NULL;
+  }
+  data[size] = '\0';
+  fclose(file);
+
+  if(outSize) *outSize = size;
+  return data;
+}
+
+// FNV-1a, chained so several strings hash into one key
+static uint64_t hash_string(uint64_t hash, const char* str)
+{
+  for(; *str; str++)
+  {
+    hash ^= (unsigned char)*str;
+    hash *= 0x100000001b3ULL;
+  }
+  hash ^= 0xff; // separator so "ab"+"c" != "a"+"bc"
+  return hash * 0x100000001b3ULL;
+}
+
+// GABGFX_CL_CACHE overrides the directory, an empty value disables the cache
+static const char* cache_dir(void)
+{
+  const char* dir = getenv("GABGFX_CL_CACHE");
+  return dir ? dir : ".clcache";
+}
+
+static void cache_path(char* out, size_t outSize, const char* filename, uint64_t key)
+{
+  const char* base = strrchr(filename, '/');
+  base = base ? base + 1 : filename;
+  snprintf(out, outSize, "%s/%s-%016llx.bin", cache_dir(), base, (unsigned long long)key);
+}
+
+static cl_program load_cached_program(cl_context context, cl_device_id device, const char* path)
+{
+  size_t size = 0;
+  unsigned char* binary = (unsigned char*)read_file(path, &size);
+  if(!binary) return NULL;
+
+  cl_int binaryStatus;
+  cl_program program = clCreateProgramWithBinary(context, 1, &device, &size, (const unsigned char**)&binary, &binaryStatus, &s_err);
+  free(binary);
+
+  if(s_err != CL_SUCCESS || binaryStatus != CL_SUCCESS)
+  {
+    if(program) clReleaseProgram(program);
+    return NULL;
+  }
+
+  // Binaries still need clBuildProgram; a stale or foreign binary fails here and we rebuild from source
+  if(clBuildProgram(program, 1, &device, s_buildOptions, NULL, NULL) != CL_SUCCESS)
+  {
+    clReleaseProgram(program);
+    return NULL;
+  }
+
+  return program;
+}
+
+static void store_cached_program(cl_program program, const char* path)
+{
+  size_t size = 0;
+  if(clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(size_t), &size, NULL) != CL_SUCCESS || size == 0) return;
+
+  unsigned char* binary = malloc(size);
+  if(clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(unsigned char*), &binary, NULL) != CL_SUCCESS)
+  {
+    free(binary);
+    return;
+  }
+
+  MKDIR(cache_dir());
+
+  // Write then rename so a crashed run never leaves a truncated binary behind
+  char tmpPath[512];
+  snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", path);
+
+  FILE* file = fopen(tmpPath, "wb");
+  if(file)
+  {
+    bool ok = fwrite(binary, 1, size, file) == size;
+    fclose(file);
+    if(!ok || rename(tmpPath, path) != 0) remove(tmpPath);
+  }
+
+  free(binary);
+}
+
+// Loads the program from the binary cache when the key (source, device, driver, options) hits,
+// otherwise builds from source and stores the result. Exits on build errors like the other CL_CHECKs.
+static cl_program build_program(cl_context context, const char* filename, cl_device_id device)
+{
+  char* src = read_file(filename, NULL);
+  if(!src)
+  {
+    fprintf(stderr, "Cannot open kernel file: %s\n", filename);
     exit(1);
   }
-  
-  s_screenSize[0] = GetScreenWidth(); s_screenSize[1] = GetScreenHeight();
 
+  uint64_t key = 0xcbf29ce484222325ULL;
+  key = hash_string(key, src);
+  key = hash_string(key, s_deviceInfo.name);
+  key = hash_string(key, s_deviceInfo.platform);
+  key = hash_string(key, s_deviceInfo.version);
+  key = hash_string(key, s_deviceInfo.driver);
+  key = hash_string(key, s_buildOptions);
+
+  char path[512];
+  bool useCache = cache_dir()[0] != '\0';
+  if(useCache) cache_path(path, sizeof(path), filename, key);
+
+  cl_program program = useCache ? load_cached_program(context, device, path) : NULL;
+  if(program)
+  {
+    free(src);
+    return program;
+  }
+
+  program = clCreateProgramWithSource(context, 1, (const char**)&src, NULL, &s_err);
+  free(src);
+  if (s_err != CL_SUCCESS) {
+    fprintf(stderr, "clCreateProgramWithSource failed: %d at %s:%d\n", s_err, __FILE__, __LINE__);
+    fprintf(stderr, "OpenCL error :%s\n",getErrorString(s_err));
+    exit(1);
+  }
+
+  s_err = clBuildProgram(program, 1, &device, s_buildOptions, NULL, NULL);
+  if (s_err != CL_SUCCESS) {
+    size_t log_size;
+    clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, 0, NULL, &log_size);
+    char* log = (char*)malloc(log_size);
+    clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, log_size, log, NULL);
+    fprintf(stderr, "OpenCL build error in %s:\n%s\n", filename, log);
+    free(log);
+    clReleaseProgram(program);
+    exit(1);
+  }
+
+  if(useCache) store_cached_program(program, path);
+
+  return program;
+}
+
+// Everything below the window: OpenCL context, kernels, buffers and camera
+static void init_pipeline(RenderMode mode)
+{
   s_mode = mode;
 
-  clGetPlatformIDs(1, &s_platform, NULL);
-  clGetDeviceIDs(s_platform, CL_DEVICE_TYPE_GPU, 1, &s_device, NULL);
+  select_device();
+
+  s_context = clCreateContext(NULL, 1, &s_device, NULL, NULL, &s_err);
+  CL_CHECK(s_err);
+  s_queue = clCreateCommandQueue(s_context, s_device, s_profiling ? CL_QUEUE_PROFILING_ENABLE : 0, &s_err);
+  CL_CHECK(s_err);
 
-  s_context = clCreateContext(NULL, 1, &s_device, NULL, NULL, NULL);
-  s_queue = clCreateCommandQueue(s_context, s_device, 0, NULL);
+  s_useImages = s_imagesRequested && device_supports_images();
+  s_buildOptions = s_useImages ? "-D GABGFX_IMAGES" : "";
+  fprintf(stderr, "  textures: %s\n", s_useImages ? "image2d_t atlas" : "global buffer");
   
   if(s_mode == RASTERIZER)
   {
@@ -385,9 +965,64 @@ void gfx_init(RenderMode mode)
     CL_CHECK_KERNEL(s_clearKernel,"clear_buffers");
     CL_CHECK_KERNEL(s_vertexKernel,"vertex_kernel");
     CL_CHECK_KERNEL(s_fragmentKernel,"fragment_kernel");
+    CL_CHECK_KERNEL(s_binKernel,"bin_kernel");
+    CL_CHECK_KERNEL(s_clipKernel,"clip_kernel");
+    CL_CHECK_KERNEL(s_hiZKernel,"hiz_kernel");
+
+    // triangle_kernel is only compiled in when the device has 64-bit atomics
+    bool hasAtomics = device_has_extension("cl_khr_int64_extended_atomics");
+    if(s_rasterMode == TRIANGLE_PARALLEL && !hasAtomics)
+    {
+      fprintf(stderr, "Device lacks cl_khr_int64_extended_atomics, using tile-parallel rasterization\n");
+      s_rasterMode = TILE_PARALLEL;
+    }
+
+    // fragment_kernel runs one TILE_SIZE x TILE_SIZE work-group per tile
+    bool tileFits = kernel_fits_group(s_fragmentKernel, TILE_SIZE * TILE_SIZE);
+    if(s_rasterMode == TILE_PARALLEL && !tileFits)
+    {
+      if(!hasAtomics)
+      {
+        fprintf(stderr, "fragment_kernel needs %d work-items per group, device allows %zu; no rasterization path fits this device\n",
+                TILE_SIZE * TILE_SIZE, s_deviceInfo.maxWorkGroupSize);
+        exit(1);
+      }
+      fprintf(stderr, "fragment_kernel cannot run %d work-items per group, using triangle-parallel rasterization\n", TILE_SIZE * TILE_SIZE);
+      s_rasterMode = TRIANGLE_PARALLEL;
+    }
+    if(s_rasterMode == TRIANGLE_PARALLEL)
+    {
+      CL_CHECK_KERNEL(s_triangleKernel,"triangle_kernel");
+      CL_CHECK_KERNEL(s_resolveKernel,"resolve_kernel");
+
+      if(!kernel_fits_group(s_triangleKernel, RASTER_GROUP))
+      {
+        if(!tileFits)
+        {
+          fprintf(stderr, "Neither fragment_kernel (%d work-items) nor triangle_kernel (%d work-items) fits the device work-group limit of %zu\n",
+                  TILE_SIZE * TILE_SIZE, RASTER_GROUP, s_deviceInfo.maxWorkGroupSize);
+          exit(1);
+        }
+        fprintf(stderr, "triangle_kernel cannot run %d work-items per group, using tile-parallel rasterization\n", RASTER_GROUP);
+        CL_RELEASE(clReleaseKernel, s_triangleKernel);
+        CL_RELEASE(clReleaseKernel, s_resolveKernel);
+        s_rasterMode = TILE_PARALLEL;
+      }
+    }
+
+    size_t tilesX = (s_screenSize[0] + TILE_SIZE - 1) / TILE_SIZE;
+    size_t tilesY = (s_screenSize[1] + TILE_SIZE - 1) / TILE_SIZE;
+    s_tileCount = tilesX * tilesY;
+    s_hiZCount = s_tileCount + ((tilesX + HIZ_BLOCK - 1) / HIZ_BLOCK) * ((tilesY + HIZ_BLOCK - 1) / HIZ_BLOCK);
+    s_rasterSize[0] = tilesX * TILE_SIZE;
+    s_rasterSize[1] = tilesY * TILE_SIZE;
 
     CL_CHECK_BUFFER(s_frameBuffer,CL_MEM_READ_WRITE,sizeof(Color)*s_screenSize[0]*s_screenSize[1],NULL);
-    CL_CHECK_BUFFER(s_depthBuffer,CL_MEM_READ_WRITE,sizeof(uint32_t)*s_screenSize[0]*s_screenSize[1],NULL);
+    CL_CHECK_BUFFER(s_depthBuffer,CL_MEM_READ_WRITE,sizeof(uint32_t)*s_screenSize[0]*s_screenSize[1],NULL); // depth_key() in rasterizer.cl
+    CL_CHECK_BUFFER(s_hiZBuffer,CL_MEM_READ_WRITE,sizeof(uint32_t)*s_hiZCount,NULL);
+    CL_CHECK_BUFFER(s_tileCountsBuffer,CL_MEM_READ_WRITE,sizeof(int)*s_tileCount,NULL);
+    CL_CHECK_BUFFER(s_tileTrisBuffer,CL_MEM_READ_WRITE,sizeof(int)*s_tileCount*TILE_CAPACITY,NULL);
+    CL_CHECK_BUFFER(s_clipCountsBuffer,CL_MEM_READ_WRITE,sizeof(int)*2,NULL);
 
     CL_CHECK_SET_KERNEL_ARG(s_clearKernel, 0, sizeof(cl_mem), s_frameBuffer);
     CL_CHECK_SET_KERNEL_ARG(s_clearKernel, 1, sizeof(cl_mem), s_depthBuffer);
@@ -402,53 +1037,150 @@ void gfx_init(RenderMode mode)
     CL_CHECK_SET_KERNEL_ARG(s_fragmentKernel, 2, sizeof(int), s_screenSize[0]);
     CL_CHECK_SET_KERNEL_ARG(s_fragmentKernel, 3, sizeof(int), s_screenSize[1]);
     CL_CHECK_SET_KERNEL_ARG(s_fragmentKernel, 4, sizeof(cl_mem), s_depthBuffer);
+    CL_CHECK_SET_KERNEL_ARG(s_fragmentKernel, 10, sizeof(cl_mem), s_tileCountsBuffer);
+    CL_CHECK_SET_KERNEL_ARG(s_fragmentKernel, 11, sizeof(cl_mem), s_tileTrisBuffer);
+    int tileCapacity = TILE_CAPACITY;
+    CL_CHECK_SET_KERNEL_ARG(s_fragmentKernel, 12, sizeof(int), tileCapacity);
+
+    CL_CHECK_SET_KERNEL_ARG(s_binKernel, 2, sizeof(int), s_screenSize[0]);
+    CL_CHECK_SET_KERNEL_ARG(s_binKernel, 3, sizeof(int), s_screenSize[1]);
+    CL_CHECK_SET_KERNEL_ARG(s_binKernel, 4, sizeof(cl_mem), s_tileCountsBuffer);
+    CL_CHECK_SET_KERNEL_ARG(s_binKernel, 5, sizeof(cl_mem), s_tileTrisBuffer);
+    CL_CHECK_SET_KERNEL_ARG(s_binKernel, 6, sizeof(int), tileCapacity);
+    CL_CHECK_SET_KERNEL_ARG(s_binKernel, 1, sizeof(cl_mem), s_clipCountsBuffer);
+    CL_CHECK_SET_KERNEL_ARG(s_binKernel, 8, sizeof(cl_mem), s_hiZBuffer);
+    CL_CHECK_SET_KERNEL_ARG(s_fragmentKernel, 8, sizeof(cl_mem), s_clipCountsBuffer);
+
+    CL_CHECK_SET_KERNEL_ARG(s_clipKernel, 7, sizeof(int), s_screenSize[0]);
+    CL_CHECK_SET_KERNEL_ARG(s_clipKernel, 8, sizeof(int), s_screenSize[1]);
+    CL_CHECK_SET_KERNEL_ARG(s_clipKernel, 13, sizeof(cl_mem), s_clipCountsBuffer);
+
+    CL_CHECK_SET_KERNEL_ARG(s_hiZKernel, 1, sizeof(cl_mem), s_clipCountsBuffer);
+    CL_CHECK_SET_KERNEL_ARG(s_hiZKernel, 2, sizeof(int), s_screenSize[0]);
+    CL_CHECK_SET_KERNEL_ARG(s_hiZKernel, 3, sizeof(int), s_screenSize[1]);
+    CL_CHECK_SET_KERNEL_ARG(s_hiZKernel, 4, sizeof(cl_mem), s_hiZBuffer);
+
+    if(s_rasterMode == TRIANGLE_PARALLEL)
+    {
+      CL_CHECK_BUFFER(s_depthColorBuffer,CL_MEM_READ_WRITE,sizeof(uint64_t)*s_screenSize[0]*s_screenSize[1],NULL);
+
+      CL_CHECK_SET_KERNEL_ARG(s_triangleKernel, 0, sizeof(cl_mem), s_depthColorBuffer);
+      CL_CHECK_SET_KERNEL_ARG(s_triangleKernel, 2, sizeof(int), s_screenSize[0]);
+      CL_CHECK_SET_KERNEL_ARG(s_triangleKernel, 3, sizeof(int), s_screenSize[1]);
+      CL_CHECK_SET_KERNEL_ARG(s_triangleKernel, 6, sizeof(cl_mem), s_clipCountsBuffer);
+      CL_CHECK_SET_KERNEL_ARG(s_triangleKernel, 11, sizeof(cl_mem), s_hiZBuffer);
+
+      CL_CHECK_SET_KERNEL_ARG(s_resolveKernel, 0, sizeof(cl_mem), s_depthColorBuffer);
+      CL_CHECK_SET_KERNEL_ARG(s_resolveKernel, 1, sizeof(cl_mem), s_frameBuffer);
+      CL_CHECK_SET_KERNEL_ARG(s_resolveKernel, 2, sizeof(int), s_screenSize[0]);
+      CL_CHECK_SET_KERNEL_ARG(s_resolveKernel, 3, sizeof(int), s_screenSize[1]);
+    }
   }
   else if(s_mode == RAYCASTER)
   {
     CL_CHECK_PROGRAM(s_context, "src/raycaster.cl", s_program, s_device);
 
+    CL_CHECK_KERNEL(s_wallColumnsKernel,"wall_columns_kernel");
     CL_CHECK_KERNEL(s_surfaceKernel,"surface_kernel");
     CL_CHECK_KERNEL(s_spritesKernel,"sprites_kernel");
+    CL_CHECK_KERNEL(s_simulateSpritesKernel,"simulate_sprites_kernel");
+    CL_CHECK_KERNEL(s_projectSpritesKernel,"project_sprites_kernel");
+    CL_CHECK_KERNEL(s_sortSpritesLocalKernel,"sort_sprites_local_kernel");
+    CL_CHECK_KERNEL(s_sortSpritesStepKernel,"sort_sprites_step_kernel");
+    CL_CHECK_KERNEL(s_compactSpritesKernel,"compact_sprites_kernel");
 
     CL_CHECK_BUFFER(s_frameBuffer,CL_MEM_READ_WRITE,sizeof(Color)*s_screenSize[0]*s_screenSize[1],NULL);
     CL_CHECK_BUFFER(s_depthBuffer,CL_MEM_READ_WRITE,sizeof(float)*s_screenSize[0],NULL);
+    CL_CHECK_BUFFER(s_wallColumnsBuffer,CL_MEM_READ_WRITE,WALL_COLUMN_SIZE*s_screenSize[0],NULL);
+    s_Player = (Player){5.5f,5.5f,-1.0f,0.0f,0.0f,0.66f,0.05f,0.03f};
+
     CL_CHECK_BUFFER(s_playerBuffer,CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,sizeof(Player), &s_Player);
-    CL_CHECK_BUFFER(s_mapBuffer,CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,sizeof(map), &map);
+
+    CL_CHECK_SET_KERNEL_ARG(s_wallColumnsKernel, 0, sizeof(cl_mem), s_wallColumnsBuffer);
+    CL_CHECK_SET_KERNEL_ARG(s_wallColumnsKernel, 1, sizeof(cl_mem), s_depthBuffer);
+    CL_CHECK_SET_KERNEL_ARG(s_wallColumnsKernel, 2, sizeof(int), s_screenSize[0]);
+    CL_CHECK_SET_KERNEL_ARG(s_wallColumnsKernel, 3, sizeof(int), s_screenSize[1]);
+    CL_CHECK_SET_KERNEL_ARG(s_wallColumnsKernel, 4, sizeof(cl_mem), s_playerBuffer);
 
     CL_CHECK_SET_KERNEL_ARG(s_surfaceKernel, 0, sizeof(cl_mem), s_frameBuffer);
-    CL_CHECK_SET_KERNEL_ARG(s_surfaceKernel, 1, sizeof(cl_mem), s_depthBuffer);
+    CL_CHECK_SET_KERNEL_ARG(s_surfaceKernel, 1, sizeof(cl_mem), s_wallColumnsBuffer);
     CL_CHECK_SET_KERNEL_ARG(s_surfaceKernel, 2, sizeof(int), s_screenSize[0]);
     CL_CHECK_SET_KERNEL_ARG(s_surfaceKernel, 3, sizeof(int), s_screenSize[1]);
     CL_CHECK_SET_KERNEL_ARG(s_surfaceKernel, 4, sizeof(cl_mem), s_playerBuffer);
-    CL_CHECK_SET_KERNEL_ARG(s_surfaceKernel, 5, sizeof(cl_mem), s_mapBuffer);
-    int map_size = 11;
-    CL_CHECK_SET_KERNEL_ARG(s_surfaceKernel, 6, sizeof(int), map_size);
 
     CL_CHECK_SET_KERNEL_ARG(s_spritesKernel, 0, sizeof(cl_mem), s_frameBuffer);
     CL_CHECK_SET_KERNEL_ARG(s_spritesKernel, 1, sizeof(cl_mem), s_depthBuffer);
     CL_CHECK_SET_KERNEL_ARG(s_spritesKernel, 2, sizeof(int), s_screenSize[0]);
     CL_CHECK_SET_KERNEL_ARG(s_spritesKernel, 3, sizeof(int), s_screenSize[1]);
-    CL_CHECK_SET_KERNEL_ARG(s_spritesKernel, 4, sizeof(cl_mem), s_playerBuffer);
-    CL_CHECK_SET_KERNEL_ARG(s_spritesKernel, 10, sizeof(int), s_ui_first_frame);
+    CL_CHECK_SET_KERNEL_ARG(s_spritesKernel, 8, sizeof(int), s_ui_first_frame);
+    s_spriteColumnsSize = (s_screenSize[0] + SPRITE_TILE_WIDTH - 1) / SPRITE_TILE_WIDTH * SPRITE_TILE_WIDTH;
+
+    CL_CHECK_BUFFER(s_visibleSpriteCountBuffer, CL_MEM_READ_WRITE, sizeof(cl_uint), NULL);
+    CL_CHECK_SET_KERNEL_ARG(s_spritesKernel, 5, sizeof(cl_mem), s_visibleSpriteCountBuffer);
+
+    CL_CHECK_SET_KERNEL_ARG(s_projectSpritesKernel, 0, sizeof(cl_mem), s_playerBuffer);
+    CL_CHECK_SET_KERNEL_ARG(s_projectSpritesKernel, 3, sizeof(int), s_screenSize[0]);
+    CL_CHECK_SET_KERNEL_ARG(s_projectSpritesKernel, 4, sizeof(int), s_screenSize[1]);
+    CL_CHECK_SET_KERNEL_ARG(s_projectSpritesKernel, 7, sizeof(cl_mem), s_visibleSpriteCountBuffer);
+    CL_CHECK_SET_KERNEL_ARG(s_compactSpritesKernel, 3, sizeof(cl_mem), s_visibleSpriteCountBuffer);
 
-    s_Player = (Player){5.5f,5.5f,-1.0f,0.0f,0.0f,0.66f,0.05f,0.03f};
   }
   else if(s_mode == RAYTRACER)
   {
     CL_CHECK_PROGRAM(s_context, "src/raytracer.cl", s_program, s_device);
 
-    /*CL_CHECK_KERNEL(s_clearKernel, "clear_buffers");*/
-    /*CL_CHECK_KERNEL(s_vertexKernel, "vertex_kernel");*/
-    CL_CHECK_KERNEL(s_fragmentKernel, "fragment_kernel");
-
-    CL_CHECK_BUFFER(s_frameBuffer, CL_MEM_WRITE_ONLY, sizeof(Color) * s_screenSize[0] * s_screenSize[1], NULL);
-    CL_CHECK_BUFFER(s_depthBuffer, CL_MEM_READ_WRITE, sizeof(cl_uint) * s_screenSize[0] * s_screenSize[1], NULL);
-    CL_CHECK_BUFFER(s_accumulationBuffer, CL_MEM_READ_WRITE, sizeof(Vec4) * s_screenSize[0] * s_screenSize[1], NULL);
+    CL_CHECK_KERNEL(s_generateKernel, "generate_kernel");
+    CL_CHECK_KERNEL(s_extendKernel, "extend_kernel");
+    CL_CHECK_KERNEL(s_classifyKernel, "classify_kernel");
+    CL_CHECK_KERNEL(s_shadeKernels[0], "shade_glass_kernel");
+    CL_CHECK_KERNEL(s_shadeKernels[1], "shade_mirror_kernel");
+    CL_CHECK_KERNEL(s_shadeKernels[2], "shade_surface_kernel");
+    CL_CHECK_KERNEL(s_accumulateKernel, "accumulate_kernel");
+
+    size_t pixelCount = s_screenSize[0] * s_screenSize[1];
+    s_pathGlobalSize = (pixelCount + WAVEFRONT_GROUP_SIZE - 1) / WAVEFRONT_GROUP_SIZE * WAVEFRONT_GROUP_SIZE;
+
+    CL_CHECK_BUFFER(s_frameBuffer, CL_MEM_WRITE_ONLY, sizeof(Color) * pixelCount, NULL);
+    CL_CHECK_BUFFER(s_accumulationBuffer, CL_MEM_READ_WRITE, sizeof(Vec4) * pixelCount, NULL);
+    CL_CHECK_BUFFER(s_radianceBuffer, CL_MEM_READ_WRITE, sizeof(Vec4) * pixelCount, NULL);
+    CL_CHECK_BUFFER(s_pathBuffers[0], CL_MEM_READ_WRITE, PATH_STATE_SIZE * pixelCount, NULL);
+    CL_CHECK_BUFFER(s_pathBuffers[1], CL_MEM_READ_WRITE, PATH_STATE_SIZE * pixelCount, NULL);
+    CL_CHECK_BUFFER(s_hitBuffer, CL_MEM_READ_WRITE, PATH_HIT_SIZE * pixelCount, NULL);
+    CL_CHECK_BUFFER(s_surfaceHitBuffer, CL_MEM_READ_WRITE, SURFACE_HIT_SIZE * pixelCount, NULL);
+    CL_CHECK_BUFFER(s_materialQueuesBuffer, CL_MEM_READ_WRITE, sizeof(int) * MATERIAL_CLASSES * pixelCount, NULL);
+    // two ping-pong path queues, then one count per material queue
+    CL_CHECK_BUFFER(s_queueCountsBuffer, CL_MEM_READ_WRITE, sizeof(int) * (2 + MATERIAL_CLASSES), NULL);
+
+    CL_CHECK_SET_KERNEL_ARG(s_generateKernel, 0, sizeof(cl_mem), s_pathBuffers[0]);
+    CL_CHECK_SET_KERNEL_ARG(s_generateKernel, 1, sizeof(cl_mem), s_radianceBuffer);
+    CL_CHECK_SET_KERNEL_ARG(s_generateKernel, 2, sizeof(int), s_screenSize[0]);
+    CL_CHECK_SET_KERNEL_ARG(s_generateKernel, 3, sizeof(int), s_screenSize[1]);
+
+    CL_CHECK_SET_KERNEL_ARG(s_extendKernel, 1, sizeof(cl_mem), s_queueCountsBuffer);
+    CL_CHECK_SET_KERNEL_ARG(s_extendKernel, 3, sizeof(cl_mem), s_hitBuffer);
+
+    int queueStride = pixelCount;
+    CL_CHECK_SET_KERNEL_ARG(s_classifyKernel, 1, sizeof(cl_mem), s_hitBuffer);
+    CL_CHECK_SET_KERNEL_ARG(s_classifyKernel, 2, sizeof(cl_mem), s_queueCountsBuffer);
+    CL_CHECK_SET_KERNEL_ARG(s_classifyKernel, 4, sizeof(cl_mem), s_surfaceHitBuffer);
+    CL_CHECK_SET_KERNEL_ARG(s_classifyKernel, 5, sizeof(cl_mem), s_materialQueuesBuffer);
+    CL_CHECK_SET_KERNEL_ARG(s_classifyKernel, 6, sizeof(int), queueStride);
+    CL_CHECK_SET_KERNEL_ARG(s_classifyKernel, 7, sizeof(cl_mem), s_radianceBuffer);
+
+    for(int m = 0; m < MATERIAL_CLASSES; m++)
+    {
+      CL_CHECK_SET_KERNEL_ARG(s_shadeKernels[m], 1, sizeof(cl_mem), s_hitBuffer);
+      CL_CHECK_SET_KERNEL_ARG(s_shadeKernels[m], 2, sizeof(cl_mem), s_surfaceHitBuffer);
+      CL_CHECK_SET_KERNEL_ARG(s_shadeKernels[m], 3, sizeof(cl_mem), s_materialQueuesBuffer);
+      CL_CHECK_SET_KERNEL_ARG(s_shadeKernels[m], 4, sizeof(int), queueStride);
+      CL_CHECK_SET_KERNEL_ARG(s_shadeKernels[m], 5, sizeof(cl_mem), s_queueCountsBuffer);
+    }
 
-    CL_CHECK_SET_KERNEL_ARG(s_fragmentKernel, 0, sizeof(cl_mem), s_frameBuffer);
-    CL_CHECK_SET_KERNEL_ARG(s_fragmentKernel, 1, sizeof(cl_mem), s_depthBuffer);
-    CL_CHECK_SET_KERNEL_ARG(s_fragmentKernel, 2, sizeof(int), s_screenSize[0]);
-    CL_CHECK_SET_KERNEL_ARG(s_fragmentKernel, 3, sizeof(int), s_screenSize[1]);
+    CL_CHECK_SET_KERNEL_ARG(s_accumulateKernel, 0, sizeof(cl_mem), s_radianceBuffer);
+    CL_CHECK_SET_KERNEL_ARG(s_accumulateKernel, 1, sizeof(cl_mem), s_accumulationBuffer);
+    CL_CHECK_SET_KERNEL_ARG(s_accumulateKernel, 2, sizeof(cl_mem), s_frameBuffer);
+    CL_CHECK_SET_KERNEL_ARG(s_accumulateKernel, 3, sizeof(int), s_screenSize[0]);
+    CL_CHECK_SET_KERNEL_ARG(s_accumulateKernel, 4, sizeof(int), s_screenSize[1]);
 
     Sphere sphere1 = {
         .pos = (Vec3){0.0f, -0.5f, -2.0f},
@@ -521,13 +1253,10 @@ void gfx_init(RenderMode mode)
     arrpush(s_Spheres, sphere5);
 
 
-    CL_CHECK_BUFFER(s_spheresBuffer,CL_MEM_READ_ONLY,sizeof(Sphere) * arrlen(s_Spheres),NULL);
-    CL_CHECK_WRITE_BUFFER(s_spheresBuffer, CL_TRUE, 0, sizeof(Sphere) * arrlen(s_Spheres), s_Spheres);
+    upload_spheres();
 
-    CL_CHECK_SET_KERNEL_ARG(s_fragmentKernel, 9, sizeof(cl_mem), s_spheresBuffer);
-    uint32_t size = arrlen(s_Spheres);
-    CL_CHECK_SET_KERNEL_ARG(s_fragmentKernel, 10, sizeof(uint32_t), size);
-    CL_CHECK_SET_KERNEL_ARG(s_fragmentKernel, 12, sizeof(cl_mem), s_accumulationBuffer);
+    // no meshes until gfx_upload_models_data()
+    set_mesh_args(0);
   }
 
   if(s_mode == RASTERIZER || s_mode == RAYTRACER)
@@ -564,25 +1293,70 @@ void gfx_init(RenderMode mode)
     CL_CHECK_BUFFER(s_inverseViewBuffer, CL_MEM_READ_ONLY, sizeof(Mat4), NULL);
     CL_CHECK_BUFFER(s_cameraPosBuffer, CL_MEM_READ_ONLY, sizeof(Vec3), NULL);
 
-    /*CL_CHECK_SET_KERNEL_ARG(s_vertexKernel, 5, sizeof(cl_mem), s_projectionBuffer); */
-    /*CL_CHECK_SET_KERNEL_ARG(s_vertexKernel, 6, sizeof(cl_mem), s_viewBuffer); */
-    /*CL_CHECK_SET_KERNEL_ARG(s_vertexKernel, 7, sizeof(cl_mem), s_cameraPosBuffer);*/
+    if(s_mode == RASTERIZER)
+    {
+      CL_CHECK_SET_KERNEL_ARG(s_vertexKernel, 5, sizeof(cl_mem), s_projectionBuffer);
+      CL_CHECK_SET_KERNEL_ARG(s_vertexKernel, 6, sizeof(cl_mem), s_viewBuffer);
+      CL_CHECK_SET_KERNEL_ARG(s_vertexKernel, 7, sizeof(cl_mem), s_cameraPosBuffer);
+
+      CL_CHECK_SET_KERNEL_ARG(s_fragmentKernel, 5, sizeof(cl_mem), s_cameraPosBuffer);
 
-    CL_CHECK_SET_KERNEL_ARG(s_fragmentKernel, 4, sizeof(cl_mem), s_projectionBuffer);
-    CL_CHECK_SET_KERNEL_ARG(s_fragmentKernel, 5, sizeof(cl_mem), s_inverseProjectionBuffer);
-    CL_CHECK_SET_KERNEL_ARG(s_fragmentKernel, 6, sizeof(cl_mem), s_viewBuffer);
-    CL_CHECK_SET_KERNEL_ARG(s_fragmentKernel, 7, sizeof(cl_mem), s_inverseViewBuffer);
-    CL_CHECK_SET_KERNEL_ARG(s_fragmentKernel, 8, sizeof(cl_mem), s_cameraPosBuffer);
+      CL_CHECK_SET_KERNEL_ARG(s_clipKernel, 6, sizeof(float), s_camera.near_plane);
+    }
+    else
+    {
+      CL_CHECK_SET_KERNEL_ARG(s_generateKernel, 4, sizeof(cl_mem), s_inverseProjectionBuffer);
+      CL_CHECK_SET_KERNEL_ARG(s_generateKernel, 5, sizeof(cl_mem), s_inverseViewBuffer);
+      CL_CHECK_SET_KERNEL_ARG(s_generateKernel, 6, sizeof(cl_mem), s_cameraPosBuffer);
+    }
+
+    s_camera.inverse_view = MatInverse(&s_camera.view);
 
     CL_CHECK_WRITE_BUFFER(s_projectionBuffer, CL_FALSE, 0, sizeof(Mat4), &s_camera.proj);
     CL_CHECK_WRITE_BUFFER(s_inverseProjectionBuffer, CL_FALSE, 0, sizeof(Mat4), &s_camera.inverse_proj);
+    CL_CHECK_WRITE_BUFFER(s_viewBuffer, CL_FALSE, 0, sizeof(Mat4), &s_camera.view);
+    CL_CHECK_WRITE_BUFFER(s_inverseViewBuffer, CL_FALSE, 0, sizeof(Mat4), &s_camera.inverse_view);
+    CL_CHECK_WRITE_BUFFER(s_cameraPosBuffer, CL_FALSE, 0, sizeof(Vec3), &s_camera.pos);
+  }
+
+  size_t frameBytes = sizeof(Color)*s_screenSize[0]*s_screenSize[1];
+  for(int i = 0; i < FRAMES_IN_FLIGHT; i++)
+  {
+    CL_CHECK_BUFFER(s_readbackBuffers[i], CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, frameBytes, NULL);
+    s_readbackPixels[i] = clEnqueueMapBuffer(s_queue, s_readbackBuffers[i], CL_TRUE, CL_MAP_READ | CL_MAP_WRITE, 0, frameBytes, 0, NULL, NULL, &s_err);
+    CL_CHECK(s_err);
+    memset(s_readbackPixels[i], 0, frameBytes);
+    s_readbackEvents[i] = NULL;
+  }
+  s_pixelBuffer = s_readbackPixels[0];
+}
+
+void gfx_init(RenderMode mode)
+{
+  InitWindow(800, 600, "GABGFX");
+  SetTargetFPS(60);
+
+  if(!IsWindowReady())
+  {
+    fprintf(stderr, "Initialize window first! - InitWindow()");
+    exit(1);
   }
+  
+  s_screenSize[0] = GetScreenWidth(); s_screenSize[1] = GetScreenHeight();
+
+  init_pipeline(mode);
 
   Image img = GenImageColor(s_screenSize[0], s_screenSize[1], s_backgroundColor);
   s_outputTexture = LoadTextureFromImage(img);
   UnloadImage(img);
+}
+
+void gfx_init_headless(RenderMode mode, int width, int height)
+{
+  s_headless = true;
+  s_screenSize[0] = width; s_screenSize[1] = height;
 
-  s_pixelBuffer = (Color*)malloc(sizeof(Color)*s_screenSize[0]*s_screenSize[1]);
+  init_pipeline(mode);
 }
 
 static bool cursorDisabled = false;
@@ -596,70 +1370,585 @@ static float panelY = 50;
 static float panelWidth = 300;
 static float panelHeight = 220;
 
-void gfx_draw(void)
+// Event out-param for an enqueue of the given stage, NULL when profiling is off. The
+// pointer is only valid until the next call, which is all the enqueue it feeds needs
+static cl_event* prof_event(int slot, ProfileStage stage)
 {
-  if(IsMouseButtonDown(MOUSE_BUTTON_RIGHT))
-  {
-    if(!cursorDisabled)
-    {
-      DisableCursor();
-      cursorDisabled = true;
+  if(!s_profiling) return NULL;
+
+  arrpush(s_profEvents[slot], ((ProfileEvent){ stage, NULL }));
+  return &arrlast(s_profEvents[slot]).event;
+}
+
+// Adds the event's device time to its stage's frame total, returns false if it has no timestamps
+static bool prof_record(ProfileStage stage, cl_event event, float* frameMs)
+{
+  cl_ulong start = 0, end = 0;
+  if(clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &start, NULL) != CL_SUCCESS) return false;
+  if(clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &end, NULL) != CL_SUCCESS) return false;
+
+  frameMs[stage] += (end - start) * 1e-6f;
+
+  if(arrlen(s_traceEvents) < PROFILE_MAX_TRACE)
+    arrpush(s_traceEvents, ((TraceEvent){ stage, start, end }));
+  return true;
+}
+
+// Only called once the slot's readback completed, so every earlier event in the in-order queue has too
+static void prof_collect(int slot)
+{
+  float frameMs[PROF_COUNT] = {0};
+  bool seen[PROF_COUNT] = {0};
+
+  for(size_t i = 0; i < arrlen(s_profEvents[slot]); i++)
+  {
+    ProfileEvent* e = &s_profEvents[slot][i];
+    if(!e->event) continue;
+
+    seen[e->stage] |= prof_record(e->stage, e->event, frameMs);
+    clReleaseEvent(e->event);
+    e->event = NULL;
+  }
+  arrsetlen(s_profEvents[slot], 0);
+
+  seen[PROF_READBACK] = prof_record(PROF_READBACK, s_readbackEvents[slot], frameMs);
+
+  for(int i = 0; i < PROF_COUNT; i++)
+  {
+    if(!seen[i]) continue;
+
+    ProfileHistory* h = &s_profHistory[i];
+    h->samples[h->next] = frameMs[i];
+    h->next = (h->next + 1) % PROFILE_WINDOW;
+    if(h->count < PROFILE_WINDOW) h->count++;
+  }
+}
+
+static int float_cmp(const void* a, const void* b)
+{
+  float fa = *(const float*)a, fb = *(const float*)b;
+  return (fa > fb) - (fa < fb);
+}
+
+static bool prof_stats(ProfileStage stage, float* outMin, float* outAvg, float* outP99)
+{
+  ProfileHistory* h = &s_profHistory[stage];
+  if(h->count == 0) return false;
+
+  float sorted[PROFILE_WINDOW];
+  float sum = 0.0f;
+  for(int i = 0; i < h->count; i++)
+  {
+    sorted[i] = h->samples[i];
+    sum += sorted[i];
+  }
+  qsort(sorted, h->count, sizeof(float), float_cmp);
+
+  int p99 = (int)ceilf(0.99f * h->count) - 1;
+  *outMin = sorted[0];
+  *outAvg = sum / h->count;
+  *outP99 = sorted[p99 < 0 ? 0 : p99];
+  return true;
+}
+
+static void draw_profiler(void)
+{
+  Rectangle panel = {360, 50, 300, 40 + 20 * PROF_COUNT};
+  GuiGroupBox(panel, "GPU Timings (ms) min / avg / p99");
+
+  float total = 0.0f;
+  int row = 0;
+  for(int i = 0; i < PROF_COUNT; i++)
+  {
+    float mn, avg, p99;
+    if(!prof_stats(i, &mn, &avg, &p99)) continue;
+    total += avg;
+
+    GuiLabel((Rectangle){panel.x + 10, panel.y + 15 + 20 * row, 120, 20}, s_profStageNames[i]);
+    GuiLabel((Rectangle){panel.x + 130, panel.y + 15 + 20 * row, 170, 20}, TextFormat("%6.3f %6.3f %6.3f", mn, avg, p99));
+    row++;
+  }
+  GuiLabel((Rectangle){panel.x + 10, panel.y + 15 + 20 * row, 280, 20}, TextFormat("total avg %.3f ms", total));
+}
+
+void gfx_set_texture_images(bool enabled)
+{
+  s_imagesRequested = enabled;
+}
+
+void gfx_set_raster_mode(RasterMode mode)
+{
+  s_rasterMode = mode;
+}
+
+RasterMode gfx_raster_mode(void)
+{
+  return s_rasterMode;
+}
+
+void gfx_set_profiling(bool enabled)
+{
+  s_profiling = enabled;
+}
+
+void gfx_print_profile(void)
+{
+  if(!s_profiling) return;
+
+  printf("%-16s %9s %9s %9s\n", "stage", "min ms", "avg ms", "p99 ms");
+  for(int i = 0; i < PROF_COUNT; i++)
+  {
+    float mn, avg, p99;
+    if(prof_stats(i, &mn, &avg, &p99))
+      printf("%-16s %9.3f %9.3f %9.3f\n", s_profStageNames[i], mn, avg, p99);
+  }
+}
+
+// Chrome trace format (chrome://tracing, Perfetto): one complete event per enqueue
+bool gfx_export_trace(const char* filePath)
+{
+  FILE* file = fopen(filePath, "w");
+  if(!file)
+  {
+    fprintf(stderr, "Cannot open trace file: %s\n", filePath);
+    return false;
+  }
+
+  cl_ulong origin = arrlen(s_traceEvents) > 0 ? s_traceEvents[0].start : 0;
+  for(int i = 0; i < arrlen(s_traceEvents); i++)
+    if(s_traceEvents[i].start < origin) origin = s_traceEvents[i].start;
+
+  fprintf(file, "{\"traceEvents\":[\n");
+  for(int i = 0; i < arrlen(s_traceEvents); i++)
+  {
+    TraceEvent* e = &s_traceEvents[i];
+    fprintf(file, "%s{\"name\":\"%s\",\"cat\":\"gpu\",\"ph\":\"X\",\"pid\":0,\"tid\":0,\"ts\":%.3f,\"dur\":%.3f}",
+            i ? ",\n" : "", s_profStageNames[e->stage], (e->start - origin) * 1e-3, (e->end - e->start) * 1e-3);
+  }
+  fprintf(file, "\n],\"displayTimeUnit\":\"ms\",\"otherData\":{\"device\":\"%s\"}}\n", s_deviceInfo.name);
+
+  fclose(file);
+  return true;
+}
+
+// Blocks until the frame in the given slot has landed in host memory and makes it current
+static void wait_readback(int slot)
+{
+  if(!s_readbackEvents[slot]) return;
+
+  CL_CHECK(clWaitForEvents(1, &s_readbackEvents[slot]));
+  if(s_profiling) prof_collect(slot);
+  clReleaseEvent(s_readbackEvents[slot]);
+  s_readbackEvents[slot] = NULL;
+  s_pixelBuffer = s_readbackPixels[slot];
+}
+
+// Clip-space planes of m as (a,b,c,d) with inside >= 0. Visible points have w < 0
+// under MatPerspective here, so the frustum is w <= x <= -w, same for y, and -w >= near.
+static void frustum_planes(const Mat4* m, float near, float planes[5][4])
+{
+  for(int i = 0; i < 4; i++)
+  {
+    planes[0][i] =  m->f[0][i] - m->f[3][i];
+    planes[1][i] = -m->f[0][i] - m->f[3][i];
+    planes[2][i] =  m->f[1][i] - m->f[3][i];
+    planes[3][i] = -m->f[1][i] - m->f[3][i];
+    planes[4][i] = -m->f[3][i];
+  }
+  planes[4][3] -= near;
+}
+
+// Sphere against the world-space frustum first; models straddling a plane get
+// their local AABB tested against the frustum in model space
+static bool instance_visible(const CustomModel* model, const Mat4* t, const Mat4* viewProj, float world[5][4])
+{
+  Vec4 c = MatMulVec4(t, (Vec4){ model->sphereCenter.x, model->sphereCenter.y, model->sphereCenter.z, 1.0f });
+
+  float scale = 0.0f;
+  for(int j = 0; j < 3; j++)
+    scale = fmaxf(scale, Vec3Len((Vec3){ t->f[0][j], t->f[1][j], t->f[2][j] }));
+  float radius = model->sphereRadius * scale;
+
+  bool straddles = false;
+  for(int p = 0; p < 5; p++)
+  {
+    float len = Vec3Len((Vec3){ world[p][0], world[p][1], world[p][2] });
+    float dist = (world[p][0] * c.x + world[p][1] * c.y + world[p][2] * c.z + world[p][3]) / len;
+    if(dist < -radius) return false;
+    if(dist < radius) straddles = true;
+  }
+  if(!straddles) return true;
+
+  Mat4 clip = MatMul(*viewProj, *t);
+  float local[5][4];
+  frustum_planes(&clip, s_camera.near_plane, local);
+
+  for(int p = 0; p < 5; p++)
+  {
+    Vec3 v = {
+      local[p][0] >= 0.0f ? model->boundsMax.x : model->boundsMin.x,
+      local[p][1] >= 0.0f ? model->boundsMax.y : model->boundsMin.y,
+      local[p][2] >= 0.0f ? model->boundsMax.z : model->boundsMin.z
+    };
+    if(local[p][0] * v.x + local[p][1] * v.y + local[p][2] * v.z + local[p][3] < 0.0f) return false;
+  }
+  return true;
+}
+
+// Per-batch rasterizer streams, sized for the largest batch on screen rather than for
+// every instance; vertices include room for two clip corners per visible triangle.
+// Growth headroom never takes them past the batch budget.
+static void reserve_visible_streams(size_t verts, size_t triangles)
+{
+  if(verts > s_visibleVertCapacity)
+  {
+    size_t limit = verts > RASTER_BATCH_VERTS ? verts : RASTER_BATCH_VERTS;
+    s_visibleVertCapacity = verts + verts / 2 < limit ? verts + verts / 2 : limit;
+
+    CL_RELEASE(clReleaseMemObject, s_projectedVertsBuffer);
+    CL_RELEASE(clReleaseMemObject, s_clipVertsBuffer);
+    CL_RELEASE(clReleaseMemObject, s_visibleNormalsBuffer);
+    CL_RELEASE(clReleaseMemObject, s_visibleUVsBuffer);
+    CL_RELEASE(clReleaseMemObject, s_visibleModelIdxBuffer);
+    CL_CHECK_BUFFER(s_projectedVertsBuffer, CL_MEM_READ_WRITE, s_visibleVertCapacity * sizeof(Vec4), NULL);
+    CL_CHECK_BUFFER(s_clipVertsBuffer, CL_MEM_READ_WRITE, s_visibleVertCapacity * sizeof(Vec4), NULL);
+    CL_CHECK_BUFFER(s_visibleNormalsBuffer, CL_MEM_READ_WRITE, s_visibleVertCapacity * sizeof(uint32_t), NULL);
+    CL_CHECK_BUFFER(s_visibleUVsBuffer, CL_MEM_READ_WRITE, s_visibleVertCapacity * sizeof(uint32_t), NULL);
+    CL_CHECK_BUFFER(s_visibleModelIdxBuffer, CL_MEM_READ_WRITE, s_visibleVertCapacity * sizeof(int), NULL);
+
+    CL_CHECK_SET_KERNEL_ARG(s_vertexKernel, 4, sizeof(cl_mem), s_projectedVertsBuffer);
+    CL_CHECK_SET_KERNEL_ARG(s_vertexKernel, 11, sizeof(cl_mem), s_clipVertsBuffer);
+    CL_CHECK_SET_KERNEL_ARG(s_vertexKernel, 15, sizeof(cl_mem), s_visibleNormalsBuffer);
+    CL_CHECK_SET_KERNEL_ARG(s_vertexKernel, 16, sizeof(cl_mem), s_visibleUVsBuffer);
+    CL_CHECK_SET_KERNEL_ARG(s_vertexKernel, 17, sizeof(cl_mem), s_visibleModelIdxBuffer);
+
+    CL_CHECK_SET_KERNEL_ARG(s_clipKernel, 1, sizeof(cl_mem), s_clipVertsBuffer);
+    CL_CHECK_SET_KERNEL_ARG(s_clipKernel, 2, sizeof(cl_mem), s_projectedVertsBuffer);
+    CL_CHECK_SET_KERNEL_ARG(s_clipKernel, 9, sizeof(cl_mem), s_visibleNormalsBuffer);
+    CL_CHECK_SET_KERNEL_ARG(s_clipKernel, 10, sizeof(cl_mem), s_visibleUVsBuffer);
+    CL_CHECK_SET_KERNEL_ARG(s_clipKernel, 11, sizeof(cl_mem), s_visibleModelIdxBuffer);
+
+    CL_CHECK_SET_KERNEL_ARG(s_binKernel, 0, sizeof(cl_mem), s_projectedVertsBuffer);
+    CL_CHECK_SET_KERNEL_ARG(s_hiZKernel, 0, sizeof(cl_mem), s_projectedVertsBuffer);
+
+    CL_CHECK_SET_KERNEL_ARG(s_fragmentKernel, 1, sizeof(cl_mem), s_projectedVertsBuffer);
+    CL_CHECK_SET_KERNEL_ARG(s_fragmentKernel, 6, sizeof(cl_mem), s_visibleNormalsBuffer);
+    CL_CHECK_SET_KERNEL_ARG(s_fragmentKernel, 14, sizeof(cl_mem), s_visibleUVsBuffer);
+    CL_CHECK_SET_KERNEL_ARG(s_fragmentKernel, 15, sizeof(cl_mem), s_visibleModelIdxBuffer);
+
+    if(s_rasterMode == TRIANGLE_PARALLEL)
+    {
+      CL_CHECK_SET_KERNEL_ARG(s_triangleKernel, 1, sizeof(cl_mem), s_projectedVertsBuffer);
+      CL_CHECK_SET_KERNEL_ARG(s_triangleKernel, 4, sizeof(cl_mem), s_visibleNormalsBuffer);
+      CL_CHECK_SET_KERNEL_ARG(s_triangleKernel, 9, sizeof(cl_mem), s_visibleUVsBuffer);
+      CL_CHECK_SET_KERNEL_ARG(s_triangleKernel, 10, sizeof(cl_mem), s_visibleModelIdxBuffer);
     }
-    s_camera.hasMoved = true;
+  }
 
-    if(IsKeyDown(KEY_W)) gfx_move_camera(FORWARD);
-    if(IsKeyDown(KEY_S)) gfx_move_camera(BACKWARD);
-    if(IsKeyDown(KEY_A)) gfx_move_camera(LEFT);
-    if(IsKeyDown(KEY_D)) gfx_move_camera(RIGHT);
-    gfx_update_camera();
+  if(triangles > s_visibleCapacity)
+  {
+    size_t limit = triangles > RASTER_BATCH_VERTS ? triangles : RASTER_BATCH_VERTS;
+    s_visibleCapacity = triangles + triangles / 2 < limit ? triangles + triangles / 2 : limit;
+
+    CL_RELEASE(clReleaseMemObject, s_visibleIndicesBuffer);
+    CL_CHECK_BUFFER(s_visibleIndicesBuffer, CL_MEM_READ_WRITE, s_visibleCapacity * 3 * sizeof(uint32_t), NULL);
+
+    CL_CHECK_SET_KERNEL_ARG(s_clipKernel, 12, sizeof(cl_mem), s_visibleIndicesBuffer);
+    CL_CHECK_SET_KERNEL_ARG(s_binKernel, 7, sizeof(cl_mem), s_visibleIndicesBuffer);
+    CL_CHECK_SET_KERNEL_ARG(s_hiZKernel, 5, sizeof(cl_mem), s_visibleIndicesBuffer);
+    if(s_rasterMode == TRIANGLE_PARALLEL)
+      CL_CHECK_SET_KERNEL_ARG(s_triangleKernel, 8, sizeof(cl_mem), s_visibleIndicesBuffer);
+    CL_CHECK_SET_KERNEL_ARG(s_fragmentKernel, 13, sizeof(cl_mem), s_visibleIndicesBuffer);
+  }
+}
+
+// Rebuilds the visible instance list, split into batches so the per-frame streams
+// stay bounded however many instances are on screen
+static void cull_instances(void)
+{
+  Mat4 viewProj = MatMul(s_camera.proj, s_camera.view);
+  float world[5][4];
+  frustum_planes(&viewProj, s_camera.near_plane, world);
+
+  arrsetlen(s_visibleInstances, 0);
+  arrsetlen(s_rasterBatches, 0);
+  s_visibleVerts = 0;
+  s_visibleTriangles = 0;
+
+  RasterBatch batch = {0};
+  size_t maxVerts = 0, maxTriangles = 0;
+
+  for(size_t i = 0; i <= arrlen(s_instanceTransforms); i++)
+  {
+    const CustomModel* model = NULL;
+    if(i < arrlen(s_instanceTransforms))
+    {
+      model = &s_Models[s_instanceModels[i]];
+      if(model->triangleCount == 0 || !instance_visible(model, &s_instanceTransforms[i], &viewProj, world)) continue;
+    }
+
+    // close the batch at the end, or when this instance would take it past the budget
+    size_t cost = model ? model->vertexCount + model->triangleCount * 2 : 0;
+    if(batch.count > 0 && (!model || batch.verts + batch.triangles * 2 + cost > RASTER_BATCH_VERTS))
+    {
+      arrpush(s_rasterBatches, batch);
+      if(batch.verts + batch.triangles * 2 > maxVerts) maxVerts = batch.verts + batch.triangles * 2;
+      if(batch.triangles * 2 > maxTriangles) maxTriangles = batch.triangles * 2;
+      batch = (RasterBatch){ (int)arrlen(s_visibleInstances), 0, 0, 0 };
+    }
+    if(!model) break;
+
+    VisibleInstance visible = { (int)i, s_instanceModels[i], (int)batch.verts, (int)batch.triangles };
+    arrpush(s_visibleInstances, visible);
+    batch.count++;
+    batch.verts += model->vertexCount;
+    batch.triangles += model->triangleCount;
+    s_visibleVerts += model->vertexCount;
+    s_visibleTriangles += model->triangleCount;
+  }
+
+  if(arrlen(s_rasterBatches) > 0) reserve_visible_streams(maxVerts, maxTriangles);
+}
+
+// Expands, clips and rasterizes one batch. Depth and color carry over between batches,
+// so only the clip and tile counters restart
+static void enqueue_raster_batch(int slot, const RasterBatch* batch, bool triangleParallel)
+{
+  int numVisible = batch->count;
+  int verts = (int)batch->verts;
+  int triangles = (int)batch->triangles;
+  size_t vertSize = batch->verts;
+  size_t triangleSize = batch->triangles;
+  size_t binSize = batch->triangles * 2;
+
+  CL_CHECK_WRITE_BUFFER(s_visibleInstancesBuffer, CL_FALSE, 0, numVisible * sizeof(VisibleInstance), &s_visibleInstances[batch->first]);
+
+  CL_CHECK_SET_KERNEL_ARG(s_vertexKernel, 2, sizeof(int), numVisible);
+  CL_CHECK_SET_KERNEL_ARG(s_vertexKernel, 3, sizeof(int), verts);
+  CL_CHECK_SET_KERNEL_ARG(s_clipKernel, 4, sizeof(int), triangles);
+  CL_CHECK_SET_KERNEL_ARG(s_clipKernel, 5, sizeof(int), verts);
+  CL_CHECK_SET_KERNEL_ARG(s_clipKernel, 15, sizeof(int), numVisible);
+
+  clEnqueueFillBuffer(s_queue, s_clipCountsBuffer, &(int){0}, sizeof(int), 0, sizeof(int) * 2, 0, NULL, NULL);
+  if(!triangleParallel)
+    clEnqueueFillBuffer(s_queue, s_tileCountsBuffer, &(int){0}, sizeof(int), 0, sizeof(int) * s_tileCount, 0, NULL, prof_event(slot, PROF_TILE_RESET));
+
+  clEnqueueNDRangeKernel(s_queue, s_vertexKernel, 1, NULL, &vertSize, NULL, 0, NULL, prof_event(slot, PROF_VERTEX));
+  clEnqueueNDRangeKernel(s_queue, s_clipKernel, 1, NULL, &triangleSize, NULL, 0, NULL, prof_event(slot, PROF_CLIP));
+  clEnqueueNDRangeKernel(s_queue, s_hiZKernel, 1, NULL, &binSize, NULL, 0, NULL, prof_event(slot, PROF_HIZ));
+  if(triangleParallel)
+  {
+    size_t groupSize = RASTER_GROUP;
+    size_t groupedSize = (binSize + RASTER_GROUP - 1) / RASTER_GROUP * RASTER_GROUP;
+    clEnqueueNDRangeKernel(s_queue, s_triangleKernel, 1, NULL, &groupedSize, &groupSize, 0, NULL, prof_event(slot, PROF_TRIANGLE));
   }
   else
   {
-    s_camera.hasMoved = false;
-    if(cursorDisabled)
+    clEnqueueNDRangeKernel(s_queue, s_binKernel, 1, NULL, &binSize, NULL, 0, NULL, prof_event(slot, PROF_BIN));
+    clEnqueueNDRangeKernel(s_queue, s_fragmentKernel, 2, NULL, s_rasterSize, s_tileLocalSize, 0, NULL, prof_event(slot, PROF_FRAGMENT));
+  }
+}
+
+// Steps every sprite by one frame on the device, from the latest state into the other
+// buffer, which then becomes the state projected and drawn this frame
+static void enqueue_sprite_simulation(int slot)
+{
+  size_t numSprites = arrlen(s_spritesData);
+  int next = 1 - s_spriteState;
+
+  CL_CHECK_SET_KERNEL_ARG(s_simulateSpritesKernel, 0, sizeof(cl_mem), s_spritesDataBuffers[s_spriteState]);
+  CL_CHECK_SET_KERNEL_ARG(s_simulateSpritesKernel, 1, sizeof(cl_mem), s_spritesDataBuffers[next]);
+  // fixed step headless so runs are reproducible
+  float dt = s_headless ? SPRITE_SIM_STEP : GetFrameTime();
+  CL_CHECK_SET_KERNEL_ARG(s_simulateSpritesKernel, 6, sizeof(float), dt);
+  clEnqueueNDRangeKernel(s_queue, s_simulateSpritesKernel, 1, NULL, &numSprites, NULL, 0, NULL, prof_event(slot, PROF_SPRITE_SIMULATE));
+
+  s_spriteState = next;
+  CL_CHECK_SET_KERNEL_ARG(s_projectSpritesKernel, 1, sizeof(cl_mem), s_spritesDataBuffers[s_spriteState]);
+}
+
+// Projects and culls the level's sprites, bitonic sorts them far to near and gathers
+// the visible ones into s_visibleSpritesBuffer. Blocks of SPRITE_SORT_GROUP keys sort
+// in local memory; each wider merge runs its long steps globally, then finishes locally.
+static void enqueue_sprite_sort(int slot)
+{
+  size_t sortSize = s_spriteSortSize;
+  size_t groupSize = SPRITE_SORT_GROUP;
+  size_t numSprites = arrlen(s_spritesData);
+
+  clEnqueueNDRangeKernel(s_queue, s_projectSpritesKernel, 1, NULL, &sortSize, NULL, 0, NULL, prof_event(slot, PROF_SPRITE_PROJECT));
+
+  int fullSort = 0;
+  CL_CHECK_SET_KERNEL_ARG(s_sortSpritesLocalKernel, 1, sizeof(int), fullSort);
+  clEnqueueNDRangeKernel(s_queue, s_sortSpritesLocalKernel, 1, NULL, &sortSize, &groupSize, 0, NULL, prof_event(slot, PROF_SPRITE_SORT));
+
+  for(int k = SPRITE_SORT_GROUP * 2; k <= (int)sortSize; k <<= 1)
+  {
+    for(int j = k / 2; j >= SPRITE_SORT_GROUP; j >>= 1)
     {
-      EnableCursor();
-      cursorDisabled = false;
+      CL_CHECK_SET_KERNEL_ARG(s_sortSpritesStepKernel, 1, sizeof(int), j);
+      CL_CHECK_SET_KERNEL_ARG(s_sortSpritesStepKernel, 2, sizeof(int), k);
+      clEnqueueNDRangeKernel(s_queue, s_sortSpritesStepKernel, 1, NULL, &sortSize, NULL, 0, NULL, prof_event(slot, PROF_SPRITE_SORT));
     }
+    CL_CHECK_SET_KERNEL_ARG(s_sortSpritesLocalKernel, 1, sizeof(int), k);
+    clEnqueueNDRangeKernel(s_queue, s_sortSpritesLocalKernel, 1, NULL, &sortSize, &groupSize, 0, NULL, prof_event(slot, PROF_SPRITE_SORT));
   }
 
-  if(IsKeyPressed(KEY_F)) hideGUI = !hideGUI;
+  clEnqueueNDRangeKernel(s_queue, s_compactSpritesKernel, 1, NULL, &numSprites, NULL, 0, NULL, prof_event(slot, PROF_SPRITE_SORT));
+}
+
+// Enqueues the current mode's kernels plus an async readback into the next ring slot.
+// Nothing here blocks; wait_readback(slot) picks the result up.
+static int render_frame(void)
+{
+  int slot = s_frameSlot;
+  s_frameSlot = (s_frameSlot + 1) % FRAMES_IN_FLIGHT;
 
   if(s_mode == RASTERIZER)
   {
-    clEnqueueNDRangeKernel(s_queue, s_clearKernel, 2, NULL, s_screenSize, NULL, 0, NULL, NULL);
-    clEnqueueNDRangeKernel(s_queue, s_vertexKernel, 1, NULL, &s_totalVerts, NULL, 0, NULL, NULL);
-    clEnqueueNDRangeKernel(s_queue, s_fragmentKernel, 2, NULL, s_screenSize, NULL, 0, NULL, NULL);
+    bool triangleParallel = s_rasterMode == TRIANGLE_PARALLEL;
+
+    if(triangleParallel)
+    {
+      uint64_t clearValue = (uint64_t)0xFFFFFFFFu << 32 | 0xFF000000u; // DEPTH_FAR, opaque black
+      clEnqueueFillBuffer(s_queue, s_depthColorBuffer, &clearValue, sizeof(uint64_t), 0, sizeof(uint64_t) * s_screenSize[0] * s_screenSize[1], 0, NULL, prof_event(slot, PROF_CLEAR));
+    }
+    else
+    {
+      clEnqueueNDRangeKernel(s_queue, s_clearKernel, 2, NULL, s_screenSize, NULL, 0, NULL, prof_event(slot, PROF_CLEAR));
+    }
+    // Hi-Z keeps the occluders of earlier batches, so later batches cull against them too
+    clEnqueueFillBuffer(s_queue, s_hiZBuffer, &(uint32_t){0xFFFFFFFFu}, sizeof(uint32_t), 0, sizeof(uint32_t) * s_hiZCount, 0, NULL, NULL);
+
+    cull_instances();
+    for(size_t b = 0; b < arrlen(s_rasterBatches); b++)
+      enqueue_raster_batch(slot, &s_rasterBatches[b], triangleParallel);
+
+    if(triangleParallel)
+      clEnqueueNDRangeKernel(s_queue, s_resolveKernel, 2, NULL, s_screenSize, NULL, 0, NULL, prof_event(slot, PROF_RESOLVE));
   }
   else if(s_mode == RAYCASTER)
   {
-    sortSprites(&s_Player, s_spritesData, s_numSprites, s_spriteOrder);
-  
-    CL_CHECK_WRITE_BUFFER(s_spriteOrderBuffer, CL_FALSE, 0, s_numSprites * sizeof(int), s_spriteOrder);
-    clEnqueueNDRangeKernel(s_queue, s_surfaceKernel, 1, NULL, &s_screenSize[0], NULL, 0, NULL, NULL);
-    clEnqueueNDRangeKernel(s_queue, s_spritesKernel, 1, NULL, &s_screenSize[0], NULL, 0, NULL, NULL);
+    clEnqueueFillBuffer(s_queue, s_visibleSpriteCountBuffer, &(cl_uint){0}, sizeof(cl_uint), 0, sizeof(cl_uint), 0, NULL, NULL);
+    if(arrlen(s_spritesData) > 0)
+    {
+      enqueue_sprite_simulation(slot);
+      enqueue_sprite_sort(slot);
+    }
+    clEnqueueNDRangeKernel(s_queue, s_wallColumnsKernel, 1, NULL, &s_screenSize[0], NULL, 0, NULL, prof_event(slot, PROF_WALL_COLUMNS));
+    clEnqueueNDRangeKernel(s_queue, s_surfaceKernel, 2, NULL, s_screenSize, NULL, 0, NULL, prof_event(slot, PROF_SURFACE));
+    clEnqueueNDRangeKernel(s_queue, s_spritesKernel, 1, NULL, &s_spriteColumnsSize, &s_spriteTileSize, 0, NULL, prof_event(slot, PROF_SPRITES));
   }
   else if(s_mode == RAYTRACER)
   {
-    if(s_camera.hasMoved)
+    bool sceneChanged = s_spheresDirty;
+    if(s_spheresDirty) upload_spheres();
+
+    if(s_camera.hasMoved || sceneChanged || s_resetAccumulation)
     {
+      s_resetAccumulation = false;
       s_frameIndex = 1;
-      clEnqueueFillBuffer(s_queue, s_accumulationBuffer, &zero, sizeof(Vec4),0,sizeof(Vec4) * s_screenSize[0] * s_screenSize[1],0, NULL, NULL);
+      clEnqueueFillBuffer(s_queue, s_accumulationBuffer, &zero, sizeof(Vec4),0,sizeof(Vec4) * s_screenSize[0] * s_screenSize[1],0, NULL, prof_event(slot, PROF_ACCUM_CLEAR));
     }
     else s_frameIndex++;
 
-    CL_CHECK_SET_KERNEL_ARG(s_fragmentKernel, 11, sizeof(uint32_t), s_frameIndex);
-    clEnqueueNDRangeKernel(s_queue, s_fragmentKernel, 2, NULL, s_screenSize, NULL, 0, NULL, NULL);
+    CL_CHECK_SET_KERNEL_ARG(s_generateKernel, 7, sizeof(uint32_t), s_frameIndex);
+    CL_CHECK_SET_KERNEL_ARG(s_accumulateKernel, 5, sizeof(uint32_t), s_frameIndex);
+
+    int pathCount = s_screenSize[0] * s_screenSize[1];
+    clEnqueueFillBuffer(s_queue, s_queueCountsBuffer, &pathCount, sizeof(int), 0, sizeof(int), 0, NULL, NULL);
+    clEnqueueNDRangeKernel(s_queue, s_generateKernel, 2, NULL, s_screenSize, NULL, 0, NULL, prof_event(slot, PROF_GENERATE));
+
+    // Queue counts stay on the device; groups past the live count exit immediately
+    for(uint32_t bounce = 0; bounce < s_maxBounces; bounce++)
+    {
+      int in = bounce & 1;
+      int out = 1 - in;
+
+      clEnqueueFillBuffer(s_queue, s_queueCountsBuffer, &(int){0}, sizeof(int), sizeof(int) * out, sizeof(int), 0, NULL, NULL);
+      clEnqueueFillBuffer(s_queue, s_queueCountsBuffer, &(int){0}, sizeof(int), sizeof(int) * 2, sizeof(int) * MATERIAL_CLASSES, 0, NULL, NULL);
+
+      CL_CHECK_SET_KERNEL_ARG(s_extendKernel, 0, sizeof(cl_mem), s_pathBuffers[in]);
+      CL_CHECK_SET_KERNEL_ARG(s_extendKernel, 2, sizeof(int), in);
+      clEnqueueNDRangeKernel(s_queue, s_extendKernel, 1, NULL, &s_pathGlobalSize, &s_pathLocalSize, 0, NULL, prof_event(slot, PROF_EXTEND));
+
+      CL_CHECK_SET_KERNEL_ARG(s_classifyKernel, 0, sizeof(cl_mem), s_pathBuffers[in]);
+      CL_CHECK_SET_KERNEL_ARG(s_classifyKernel, 3, sizeof(int), in);
+      CL_CHECK_SET_KERNEL_ARG(s_classifyKernel, 8, sizeof(uint32_t), bounce);
+      CL_CHECK_SET_KERNEL_ARG(s_classifyKernel, 9, sizeof(uint32_t), s_maxBounces);
+      clEnqueueNDRangeKernel(s_queue, s_classifyKernel, 1, NULL, &s_pathGlobalSize, &s_pathLocalSize, 0, NULL, prof_event(slot, PROF_CLASSIFY));
+
+      // one BSDF per launch; each appends its survivors to the out queue
+      for(int m = 0; m < MATERIAL_CLASSES; m++)
+      {
+        CL_CHECK_SET_KERNEL_ARG(s_shadeKernels[m], 0, sizeof(cl_mem), s_pathBuffers[in]);
+        CL_CHECK_SET_KERNEL_ARG(s_shadeKernels[m], 6, sizeof(int), in);
+        CL_CHECK_SET_KERNEL_ARG(s_shadeKernels[m], 7, sizeof(cl_mem), s_pathBuffers[out]);
+        CL_CHECK_SET_KERNEL_ARG(s_shadeKernels[m], 8, sizeof(uint32_t), bounce);
+        clEnqueueNDRangeKernel(s_queue, s_shadeKernels[m], 1, NULL, &s_pathGlobalSize, &s_pathLocalSize, 0, NULL, prof_event(slot, PROF_SHADE_GLASS + m));
+      }
+    }
+
+    clEnqueueNDRangeKernel(s_queue, s_accumulateKernel, 2, NULL, s_screenSize, NULL, 0, NULL, prof_event(slot, PROF_ACCUMULATE));
   }
 
-  CL_CHECK(clEnqueueReadBuffer(s_queue, s_frameBuffer, CL_FALSE, 0, sizeof(Color)*s_screenSize[0]*s_screenSize[1], s_pixelBuffer, 0, NULL, NULL));
-  clFinish(s_queue);
+  CL_CHECK(clEnqueueReadBuffer(s_queue, s_frameBuffer, CL_FALSE, 0, sizeof(Color)*s_screenSize[0]*s_screenSize[1], s_readbackPixels[slot], 0, NULL, &s_readbackEvents[slot]));
+  clFlush(s_queue);
+
+  return slot;
+}
+
+void gfx_draw(void)
+{
+  if(s_headless)
+  {
+    wait_readback(render_frame());
+    s_camera.hasMoved = false;
+    return;
+  }
 
+  // Everything from the previous frame must be done before host-side state
+  // (camera, player) is rewritten for this one
+  int presentSlot = (s_frameSlot + FRAMES_IN_FLIGHT - 1) % FRAMES_IN_FLIGHT;
+  if(s_framePending) wait_readback(presentSlot);
+
+  if(IsMouseButtonDown(MOUSE_BUTTON_RIGHT))
+  {
+    if(!cursorDisabled)
+    {
+      DisableCursor();
+      cursorDisabled = true;
+    }
+    s_camera.hasMoved = true;
+
+    if(IsKeyDown(KEY_W)) gfx_move_camera(FORWARD);
+    if(IsKeyDown(KEY_S)) gfx_move_camera(BACKWARD);
+    if(IsKeyDown(KEY_A)) gfx_move_camera(LEFT);
+    if(IsKeyDown(KEY_D)) gfx_move_camera(RIGHT);
+    gfx_update_camera();
+  }
+  else
+  {
+    s_camera.hasMoved = false;
+    if(cursorDisabled)
+    {
+      EnableCursor();
+      cursorDisabled = false;
+    }
+  }
+
+  if(IsKeyPressed(KEY_F)) hideGUI = !hideGUI;
+
+  int renderSlot = render_frame();
+  if(!s_framePending) wait_readback(renderSlot); // first frame has nothing older to show
+  s_framePending = true;
+
+  // The device works on renderSlot while the previous frame is presented
   UpdateTexture(s_outputTexture, s_pixelBuffer);
   BeginDrawing();
   DrawTexture(s_outputTexture, 0, 0, WHITE);
 
-  if(!hideGUI)
+  if(!hideGUI && s_mode == RAYTRACER)
   {
     Rectangle panel = {50, 50, 300, 400};
     GuiGroupBox(panel, "Selected Sphere Spec");
@@ -668,6 +1957,7 @@ void gfx_draw(void)
 
     GuiSpinner((Rectangle){panel.x + 120, panel.y, 100, 20}, NULL, &selectedSphere, 0, arrlen(s_Spheres)-1,false);
     int idx = (int)selectedSphere;
+    Sphere before = s_Spheres[idx];
 
     float x = s_Spheres[idx].pos.x;
     float y = s_Spheres[idx].pos.y;
@@ -693,84 +1983,533 @@ void gfx_draw(void)
     GuiSlider((Rectangle){panel.x + 20, panel.y + 180, 260, 20}, "G", NULL, &g, 0, 255);
     GuiSlider((Rectangle){panel.x + 20, panel.y + 210, 260, 20}, "B", NULL, &b, 0, 255);
 
-    s_Spheres[idx].material.Albedo.x = r / 255.0f;
-    s_Spheres[idx].material.Albedo.y = g / 255.0f;
-    s_Spheres[idx].material.Albedo.z = b / 255.0f;
+    s_Spheres[idx].material.Albedo.x = r / 255.0f;
+    s_Spheres[idx].material.Albedo.y = g / 255.0f;
+    s_Spheres[idx].material.Albedo.z = b / 255.0f;
+
+    GuiSlider((Rectangle){panel.x + 20, panel.y + 240, 260, 20}, "Roughness", NULL, &s_Spheres[idx].material.Roughness, 0.0f, 1.0f);
+    GuiSlider((Rectangle){panel.x + 20, panel.y + 270, 260, 20}, "Metallic", NULL, &s_Spheres[idx].material.Metallic, 0.0f, 1.0f);
+
+    float power = s_Spheres[idx].material.EmissionPower;
+    GuiSlider((Rectangle){panel.x + 20, panel.y + 300, 260, 20}, "Emission", NULL, &power, 0.0f, 50.0f);
+    s_Spheres[idx].material.EmissionPower = power;
+
+    float translucent = s_Spheres[idx].material.Translucent;
+    GuiSlider((Rectangle){panel.x + 20, panel.y + 330, 260, 20}, "Translucent", NULL, &translucent, 0.0f, 1.0f);
+    s_Spheres[idx].material.Translucent = translucent;
+
+    float ior = s_Spheres[idx].material.IOR;
+    GuiSlider((Rectangle){panel.x + 20, panel.y + 360, 260, 20}, "IOR", NULL, &ior, 0.0f, 1.0f);
+    s_Spheres[idx].material.IOR = ior;
+
+
+    Color preview = (Color){
+        (unsigned char)(s_Spheres[idx].material.Albedo.x*255.0f),
+        (unsigned char)(s_Spheres[idx].material.Albedo.y*255.0f),
+        (unsigned char)(s_Spheres[idx].material.Albedo.z*255.0f),
+        255
+    };
+    DrawRectangle(panel.x + 220, panel.y, 60, 60, preview);
+
+    if(memcmp(&before, &s_Spheres[idx], sizeof(Sphere)) != 0) s_spheresDirty = true;
+  }
+
+  if(!hideGUI && s_profiling) draw_profiler();
+
+  EndDrawing();
+}
+
+size_t gfx_triangle_count(void)
+{
+  size_t count = 0;
+  for(size_t i = 0; i < arrlen(s_instanceModels); i++)
+    count += s_Models[s_instanceModels[i]].triangleCount;
+  return count;
+}
+
+size_t gfx_sphere_count(void)
+{
+  return arrlen(s_Spheres);
+}
+
+void gfx_set_max_bounces(int bounces)
+{
+  if(bounces > MAX_BOUNCES) fprintf(stderr, "%d bounces requested, using the maximum of %d\n", bounces, MAX_BOUNCES);
+  s_maxBounces = bounces < 1 ? 1 : bounces > MAX_BOUNCES ? MAX_BOUNCES : bounces;
+  s_resetAccumulation = true;
+}
+
+void gfx_add_sphere(Sphere sphere)
+{
+  arrpush(s_Spheres, sphere);
+  s_spheresDirty = true;
+}
+
+bool gfx_save_frame(const char* filePath)
+{
+  const char* ext = strrchr(filePath, '.');
+  size_t pixelCount = s_screenSize[0] * s_screenSize[1];
+
+  if(ext && (strcmp(ext, ".ppm") == 0 || strcmp(ext, ".rgba") == 0))
+  {
+    FILE* file = fopen(filePath, "wb");
+    if(!file)
+    {
+      fprintf(stderr, "Cannot open output file: %s\n", filePath);
+      return false;
+    }
+
+    if(strcmp(ext, ".ppm") == 0)
+    {
+      fprintf(file, "P6\n%zu %zu\n255\n", s_screenSize[0], s_screenSize[1]);
+      for(size_t i = 0; i < pixelCount; i++)
+        fwrite(&s_pixelBuffer[i], 1, 3, file);
+    }
+    else
+    {
+      fwrite(s_pixelBuffer, sizeof(Color), pixelCount, file);
+    }
+
+    fclose(file);
+    return true;
+  }
+
+  // anything else goes through raylib's CPU-side image exporter (png, bmp, ...)
+  Image img = {
+    .data = s_pixelBuffer,
+    .width = s_screenSize[0],
+    .height = s_screenSize[1],
+    .mipmaps = 1,
+    .format = PIXELFORMAT_UNCOMPRESSED_R8G8B8A8
+  };
+  return ExportImage(img, filePath);
+}
+
+void gfx_close(void)
+{
+  clFinish(s_queue);
+  arrfree(s_traceEvents);
+  for(int i = 0; i < FRAMES_IN_FLIGHT; i++)
+  {
+    if(s_readbackEvents[i]) clReleaseEvent(s_readbackEvents[i]);
+    s_readbackEvents[i] = NULL;
+    for(size_t j = 0; j < arrlen(s_profEvents[i]); j++)
+      if(s_profEvents[i][j].event) clReleaseEvent(s_profEvents[i][j].event);
+    arrfree(s_profEvents[i]);
+    if(s_readbackBuffers[i]) clEnqueueUnmapMemObject(s_queue, s_readbackBuffers[i], s_readbackPixels[i], 0, NULL, NULL);
+    CL_RELEASE(clReleaseMemObject, s_readbackBuffers[i]);
+    s_readbackPixels[i] = NULL;
+  }
+  clFinish(s_queue);
+  memset(s_profHistory, 0, sizeof(s_profHistory));
+  s_frameSlot = 0;
+  s_framePending = false;
+
+  // Every handle is cleared so the next gfx_init, in any mode, starts from NULL
+  CL_RELEASE(clReleaseKernel, s_clearKernel);
+  CL_RELEASE(clReleaseKernel, s_vertexKernel);
+  CL_RELEASE(clReleaseKernel, s_fragmentKernel);
+  CL_RELEASE(clReleaseKernel, s_binKernel);
+  CL_RELEASE(clReleaseKernel, s_clipKernel);
+  CL_RELEASE(clReleaseKernel, s_hiZKernel);
+  CL_RELEASE(clReleaseKernel, s_triangleKernel);
+  CL_RELEASE(clReleaseKernel, s_resolveKernel);
+  CL_RELEASE(clReleaseKernel, s_generateKernel);
+  CL_RELEASE(clReleaseKernel, s_extendKernel);
+  CL_RELEASE(clReleaseKernel, s_classifyKernel);
+  for(int m = 0; m < MATERIAL_CLASSES; m++) CL_RELEASE(clReleaseKernel, s_shadeKernels[m]);
+  CL_RELEASE(clReleaseKernel, s_accumulateKernel);
+  CL_RELEASE(clReleaseKernel, s_wallColumnsKernel);
+  CL_RELEASE(clReleaseKernel, s_surfaceKernel);
+  CL_RELEASE(clReleaseKernel, s_spritesKernel);
+  CL_RELEASE(clReleaseKernel, s_simulateSpritesKernel);
+  CL_RELEASE(clReleaseKernel, s_projectSpritesKernel);
+  CL_RELEASE(clReleaseKernel, s_sortSpritesLocalKernel);
+  CL_RELEASE(clReleaseKernel, s_sortSpritesStepKernel);
+  CL_RELEASE(clReleaseKernel, s_compactSpritesKernel);
+
+  CL_RELEASE(clReleaseMemObject, s_frameBuffer);
+  CL_RELEASE(clReleaseMemObject, s_depthBuffer);
+  CL_RELEASE(clReleaseMemObject, s_projectedVertsBuffer);
+  CL_RELEASE(clReleaseMemObject, s_clipVertsBuffer);
+  CL_RELEASE(clReleaseMemObject, s_visibleIndicesBuffer);
+  CL_RELEASE(clReleaseMemObject, s_clipCountsBuffer);
+  CL_RELEASE(clReleaseMemObject, s_visibleInstancesBuffer);
+  CL_RELEASE(clReleaseMemObject, s_projectionBuffer);
+  CL_RELEASE(clReleaseMemObject, s_inverseProjectionBuffer);
+  CL_RELEASE(clReleaseMemObject, s_viewBuffer);
+  CL_RELEASE(clReleaseMemObject, s_inverseViewBuffer);
+  CL_RELEASE(clReleaseMemObject, s_cameraPosBuffer);
+  CL_RELEASE(clReleaseMemObject, s_trianglesBuffer);
+  CL_RELEASE(clReleaseMemObject, s_positionsBuffer);
+  CL_RELEASE(clReleaseMemObject, s_normalsBuffer);
+  CL_RELEASE(clReleaseMemObject, s_uvsBuffer);
+  CL_RELEASE(clReleaseMemObject, s_instanceTransformsBuffer);
+  CL_RELEASE(clReleaseMemObject, s_visibleNormalsBuffer);
+  CL_RELEASE(clReleaseMemObject, s_visibleUVsBuffer);
+  CL_RELEASE(clReleaseMemObject, s_visibleModelIdxBuffer);
+  CL_RELEASE(clReleaseMemObject, s_indicesBuffer);
+  CL_RELEASE(clReleaseMemObject, s_pixelsBuffer);
+  CL_RELEASE(clReleaseMemObject, s_modelsBuffer);
+  CL_RELEASE(clReleaseMemObject, s_spheresBuffer);
+  CL_RELEASE(clReleaseMemObject, s_bvhNodesBuffer);
+  CL_RELEASE(clReleaseMemObject, s_bvhIndicesBuffer);
+  CL_RELEASE(clReleaseMemObject, s_blasNodesBuffer);
+  CL_RELEASE(clReleaseMemObject, s_blasIndicesBuffer);
+  CL_RELEASE(clReleaseMemObject, s_tlasNodesBuffer);
+  CL_RELEASE(clReleaseMemObject, s_tlasIndicesBuffer);
+  CL_RELEASE(clReleaseMemObject, s_instancesBuffer);
+  CL_RELEASE(clReleaseMemObject, s_tileCountsBuffer);
+  CL_RELEASE(clReleaseMemObject, s_tileTrisBuffer);
+  CL_RELEASE(clReleaseMemObject, s_hiZBuffer);
+  CL_RELEASE(clReleaseMemObject, s_depthColorBuffer);
+  CL_RELEASE(clReleaseMemObject, s_pathBuffers[0]);
+  CL_RELEASE(clReleaseMemObject, s_pathBuffers[1]);
+  CL_RELEASE(clReleaseMemObject, s_hitBuffer);
+  CL_RELEASE(clReleaseMemObject, s_surfaceHitBuffer);
+  CL_RELEASE(clReleaseMemObject, s_materialQueuesBuffer);
+  CL_RELEASE(clReleaseMemObject, s_queueCountsBuffer);
+  CL_RELEASE(clReleaseMemObject, s_radianceBuffer);
+  CL_RELEASE(clReleaseMemObject, s_accumulationBuffer);
+  CL_RELEASE(clReleaseMemObject, s_playerBuffer);
+  CL_RELEASE(clReleaseMemObject, s_mapBuffer);
+  CL_RELEASE(clReleaseMemObject, s_spritesBuffer);
+  CL_RELEASE(clReleaseMemObject, s_textureBuffer);
+  CL_RELEASE(clReleaseMemObject, s_spritesDataBuffers[0]);
+  CL_RELEASE(clReleaseMemObject, s_spritesDataBuffers[1]);
+  CL_RELEASE(clReleaseMemObject, s_wallColumnsBuffer);
+  CL_RELEASE(clReleaseMemObject, s_occupancyBuffer);
+  CL_RELEASE(clReleaseMemObject, s_occupancyLayoutBuffer);
+  CL_RELEASE(clReleaseMemObject, s_projectedSpritesBuffer);
+  CL_RELEASE(clReleaseMemObject, s_spriteKeysBuffer);
+  CL_RELEASE(clReleaseMemObject, s_visibleSpritesBuffer);
+  CL_RELEASE(clReleaseMemObject, s_visibleSpriteCountBuffer);
+
+  CL_RELEASE(clReleaseProgram, s_program);
+  CL_RELEASE(clReleaseCommandQueue, s_queue);
+  CL_RELEASE(clReleaseContext, s_context);
+  CL_RELEASE(clReleaseDevice, s_device);
+
+  arrfree(s_allTriangles);
+  arrfree(s_vertexPositions);
+  arrfree(s_vertexNormals);
+  arrfree(s_vertexUVs);
+  arrfree(s_allIndices);
+  arrfree(s_visibleInstances);
+  arrfree(s_rasterBatches);
+  arrfree(s_instanceTransforms);
+  arrfree(s_instanceModels);
+  arrfree(s_allTexturePixels);
+  arrfree(s_Models);
+  arrfree(s_Spheres);
+  arrfree(s_bvhNodes);
+  arrfree(s_bvhIndices);
+  arrfree(s_sphereBounds);
+  arrfree(s_blasNodes);
+  arrfree(s_blasIndices);
+  arrfree(s_tlasNodes);
+  arrfree(s_tlasIndices);
+  arrfree(s_Instances);
+  for (size_t i = 0; i < arrlen(s_modelKeys); i++) free(s_modelKeys[i]);
+  arrfree(s_modelKeys);
+  s_sphereCapacity = 0;
+  s_triOffset = 0;
+  s_pixOffset = 0;
+  s_totalTriangles = 0;
+  s_totalTexturePixels = 0;
+  s_totalVerts = 0;
+  s_visibleCapacity = 0;
+  s_visibleVertCapacity = 0;
+  s_visibleVerts = 0;
+  s_visibleTriangles = 0;
+  s_frameIndex = 1;
+  s_spheresDirty = false;
+  s_resetAccumulation = true;
+  arrfree(texture_atlas);
+  arrfree(s_Sprites);
+  arrfree(s_map);
+  arrfree(s_spritesData);
+  s_spriteSortSize = 0;
+  s_spriteState = 0;
+  s_mapWidth = 0;
+  s_mapHeight = 0;
+
+  if(!s_headless)
+  {
+    UnloadTexture(s_outputTexture);
+    CloseWindow();
+  }
+}
+
+int gfx_add_instance(int model, Mat4 transform)
+{
+  if (model < 0 || model >= arrlen(s_Models)) {
+      fprintf(stderr, "gfx_add_instance: invalid model handle %d\n", model);
+      return -1;
+  }
+
+  arrpush(s_instanceTransforms, transform);
+  arrpush(s_instanceModels, model);
+  return (int)arrlen(s_instanceTransforms) - 1;
+}
+
+// Appends a texture and its 2x2 box-filtered mip chain (down to 1x1) to *atlas,
+// each level right after the previous one. Returns the level count.
+static int append_mip_chain(Color** atlas, const Color* pixels, int width, int height)
+{
+  size_t offset = arrlen(*atlas);
+  arraddn(*atlas, width * height);
+  memcpy(*atlas + offset, pixels, width * height * sizeof(Color));
+
+  int levels = 1;
+  while(width > 1 || height > 1)
+  {
+    int w = width > 1 ? width / 2 : 1;
+    int h = height > 1 ? height / 2 : 1;
+
+    size_t next = arrlen(*atlas);
+    arraddn(*atlas, w * h);
+    const Color* src = *atlas + offset; // arraddn may have moved the array
+    Color* dst = *atlas + next;
+
+    for(int y = 0; y < h; y++)
+    {
+      int y0 = y * 2, y1 = y * 2 + 1 < height ? y * 2 + 1 : y * 2;
+      for(int x = 0; x < w; x++)
+      {
+        int x0 = x * 2, x1 = x * 2 + 1 < width ? x * 2 + 1 : x * 2;
+        Color c[4] = { src[y0 * width + x0], src[y0 * width + x1], src[y1 * width + x0], src[y1 * width + x1] };
+        dst[y * w + x] = (Color){
+          (c[0].r + c[1].r + c[2].r + c[3].r + 2) / 4,
+          (c[0].g + c[1].g + c[2].g + c[3].g + 2) / 4,
+          (c[0].b + c[1].b + c[2].b + c[3].b + 2) / 4,
+          (c[0].a + c[1].a + c[2].a + c[3].a + 2) / 4
+        };
+      }
+    }
+
+    offset = next;
+    width = w;
+    height = h;
+    levels++;
+  }
+  return levels;
+}
+
+static int mip_tail_height(const Sprite* t)
+{
+  int height = 0;
+  for(int level = 1, h = t->height; level < t->mipLevels; level++)
+  {
+    h = h > 1 ? h / 2 : 1;
+    height += h;
+  }
+  return height;
+}
+
+// Skyline bottom-left packing: each rect goes where its top edge ends lowest,
+// tallest first. Returns false when they do not fit in a size x size square.
+typedef struct { int x, y, width; } SkylineSegment;
+
+static int skyline_fit(const SkylineSegment* sky, int i, int width, int size)
+{
+  if(sky[i].x + width > size) return -1;
+
+  int y = 0;
+  for(int j = i, covered = 0; covered < width; j++)
+  {
+    if(j >= arrlen(sky)) return -1;
+    if(sky[j].y > y) y = sky[j].y;
+    covered += sky[j].width;
+  }
+  return y;
+}
+
+static bool pack_skyline(const int* widths, const int* heights, const int* order, int count, int size, int* outX, int* outY)
+{
+  SkylineSegment* sky = NULL;
+  arrput(sky, ((SkylineSegment){ 0, 0, size }));
+
+  for(int n = 0; n < count; n++)
+  {
+    int r = order[n];
+    int best = -1, bestX = 0, bestY = size;
+    for(int i = 0; i < arrlen(sky); i++)
+    {
+      int y = skyline_fit(sky, i, widths[r], size);
+      if(y >= 0 && y + heights[r] <= size && (y < bestY || (y == bestY && sky[i].x < bestX)))
+      {
+        best = i;
+        bestX = sky[i].x;
+        bestY = y;
+      }
+    }
+    if(best < 0)
+    {
+      arrfree(sky);
+      return false;
+    }
+
+    outX[r] = bestX;
+    outY[r] = bestY;
+
+    // Raise the skyline under the rect, trimming the segments it now covers
+    arrins(sky, best, ((SkylineSegment){ bestX, bestY + heights[r], widths[r] }));
+    int end = bestX + widths[r];
+    while(best + 1 < arrlen(sky) && sky[best + 1].x < end)
+    {
+      SkylineSegment* next = &sky[best + 1];
+      int overlap = end - next->x;
+      if(overlap < next->width)
+      {
+        next->x += overlap;
+        next->width -= overlap;
+        break;
+      }
+      arrdel(sky, best + 1);
+    }
+
+    for(int i = 0; i + 1 < arrlen(sky); i++)
+    {
+      if(sky[i].y != sky[i + 1].y) continue;
+      sky[i].width += sky[i + 1].width;
+      arrdel(sky, i + 1);
+      i--;
+    }
+  }
+
+  arrfree(sky);
+  return true;
+}
+
+#define ATLAS_PADDING 2 // empty texels between packed rects
 
-    GuiSlider((Rectangle){panel.x + 20, panel.y + 240, 260, 20}, "Roughness", NULL, &s_Spheres[idx].material.Roughness, 0.0f, 1.0f);
-    GuiSlider((Rectangle){panel.x + 20, panel.y + 270, 260, 20}, "Metallic", NULL, &s_Spheres[idx].material.Metallic, 0.0f, 1.0f);
+// Packs every texture's linear mip chain from pixels into one square, power of two,
+// row-major atlas: level 0 at the texture's atlas origin, the smaller levels stacked
+// down its right-hand side, so every level is a rect a sampler can filter inside.
+// Fills atlasX/atlasY; returns NULL when the atlas would exceed maxSize per side.
+static Color* pack_texture_atlas(const Color* pixels, Sprite* textures, int count, int maxSize, int* outSize)
+{
+  int* widths = malloc(sizeof(int) * (count + 1));
+  int* heights = malloc(sizeof(int) * (count + 1));
+  int* order = malloc(sizeof(int) * (count + 1));
+  int* xs = malloc(sizeof(int) * (count + 1));
+  int* ys = malloc(sizeof(int) * (count + 1));
+
+  long long area = 0;
+  int packed = 0;
+  for(int i = 0; i < count; i++)
+  {
+    const Sprite* t = &textures[i];
+    if(t->width <= 0 || t->height <= 0) continue;
 
-    float power = s_Spheres[idx].material.EmissionPower;
-    GuiSlider((Rectangle){panel.x + 20, panel.y + 300, 260, 20}, "Emission", NULL, &power, 0.0f, 50.0f);
-    s_Spheres[idx].material.EmissionPower = power;
+    int tailHeight = mip_tail_height(t);
+    widths[i] = t->width + (t->mipLevels > 1 ? (t->width > 1 ? t->width / 2 : 1) : 0) + ATLAS_PADDING;
+    heights[i] = (t->height > tailHeight ? t->height : tailHeight) + ATLAS_PADDING;
+    area += (long long)widths[i] * heights[i];
 
-    float translucent = s_Spheres[idx].material.Translucent;
-    GuiSlider((Rectangle){panel.x + 20, panel.y + 330, 260, 20}, "Translucent", NULL, &translucent, 0.0f, 1.0f);
-    s_Spheres[idx].material.Translucent = translucent;
+    // insertion sort, tallest first; counts are small and this keeps ties stable
+    int n = packed++;
+    while(n > 0 && heights[order[n - 1]] < heights[i])
+    {
+      order[n] = order[n - 1];
+      n--;
+    }
+    order[n] = i;
+  }
 
-    float ior = s_Spheres[idx].material.IOR;
-    GuiSlider((Rectangle){panel.x + 20, panel.y + 360, 260, 20}, "IOR", NULL, &ior, 0.0f, 1.0f);
-    s_Spheres[idx].material.IOR = ior;
+  int size = 64;
+  while((long long)size * size < area) size *= 2;
+  while(size <= maxSize && !pack_skyline(widths, heights, order, packed, size, xs, ys)) size *= 2;
 
+  Color* atlas = NULL;
+  if(size <= maxSize)
+  {
+    atlas = calloc((size_t)size * size, sizeof(Color));
+    for(int n = 0; n < packed; n++)
+    {
+      Sprite* t = &textures[order[n]];
+      t->atlasX = xs[order[n]];
+      t->atlasY = ys[order[n]];
 
-    Color preview = (Color){
-        (unsigned char)(s_Spheres[idx].material.Albedo.x*255.0f),
-        (unsigned char)(s_Spheres[idx].material.Albedo.y*255.0f),
-        (unsigned char)(s_Spheres[idx].material.Albedo.z*255.0f),
-        255
-    };
-    DrawRectangle(panel.x + 220, panel.y, 60, 60, preview);
+      int offset = t->offset, w = t->width, h = t->height;
+      int ox = t->atlasX, oy = t->atlasY;
+      for(int level = 0; level < t->mipLevels; level++)
+      {
+        for(int row = 0; row < h; row++)
+          memcpy(atlas + (size_t)(oy + row) * size + ox, pixels + offset + row * w, w * sizeof(Color));
+
+        if(level == 0) ox += w;
+        else oy += h;
+        offset += w * h;
+        w = w > 1 ? w / 2 : 1;
+        h = h > 1 ? h / 2 : 1;
+      }
+    }
+    *outSize = size;
   }
 
-  CL_CHECK_WRITE_BUFFER(s_spheresBuffer, CL_FALSE, 0, sizeof(Sphere) * arrlen(s_Spheres), s_Spheres);
-
-  EndDrawing();
+  free(widths);
+  free(heights);
+  free(order);
+  free(xs);
+  free(ys);
+  return atlas;
 }
 
-void gfx_close(void)
+// Largest square atlas side the texture storage of the current path can hold
+static int max_atlas_size(void)
 {
-  free(s_pixelBuffer);
-
-  clReleaseDevice(s_device);
-  clReleaseProgram(s_program);
-  clReleaseCommandQueue(s_queue);
-  clReleaseContext(s_context);
-
-  clReleaseKernel(s_clearKernel);
-  clReleaseKernel(s_vertexKernel);
-  clReleaseKernel(s_fragmentKernel);
-  clReleaseKernel(s_surfaceKernel);
-
-  clReleaseMemObject(s_frameBuffer);
-  clReleaseMemObject(s_depthBuffer);
-  clReleaseMemObject(s_projectedVertsBuffer);
-  clReleaseMemObject(s_projectionBuffer);
-  clReleaseMemObject(s_viewBuffer);
-  clReleaseMemObject(s_cameraPosBuffer);
-  clReleaseMemObject(s_trianglesBuffer);
-  clReleaseMemObject(s_pixelsBuffer);
-  clReleaseMemObject(s_modelsBuffer);
-
-  clReleaseMemObject(s_playerBuffer);
-  clReleaseMemObject(s_mapBuffer);
-  clReleaseMemObject(s_spritesBuffer);
-  clReleaseMemObject(s_textureBuffer);
-  clReleaseMemObject(s_spritesDataBuffer);
+  if(s_useImages)
+  {
+    size_t maxWidth = 0, maxHeight = 0;
+    clGetDeviceInfo(s_device, CL_DEVICE_IMAGE2D_MAX_WIDTH, sizeof(maxWidth), &maxWidth, NULL);
+    clGetDeviceInfo(s_device, CL_DEVICE_IMAGE2D_MAX_HEIGHT, sizeof(maxHeight), &maxHeight, NULL);
+    return (int)(maxWidth < maxHeight ? maxWidth : maxHeight);
+  }
 
-  arrfree(s_allTriangles);
-  arrfree(s_allTexturePixels);
-  arrfree(s_Models);
-  s_triOffset = 0;
-  s_pixOffset = 0;
-  s_totalTriangles = 0;
-  s_totalTexturePixels = 0;
+  cl_ulong maxAlloc = 0;
+  clGetDeviceInfo(s_device, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(maxAlloc), &maxAlloc, NULL);
+  int size = 1;
+  while((cl_ulong)(size * 2) * (size * 2) * sizeof(Color) <= maxAlloc && size < (1 << 15)) size *= 2;
+  return size;
+}
+
+// Packs textures with pack_texture_atlas and exits when they do not fit the device
+static Color* pack_texture_atlas_or_exit(const Color* pixels, Sprite* textures, int count, int* outSize)
+{
+  int maxSize = max_atlas_size();
+  Color* atlas = pack_texture_atlas(pixels, textures, count, maxSize, outSize);
+  if(!atlas)
+  {
+    fprintf(stderr, "Texture atlas exceeds the device limit of %dx%d\n", maxSize, maxSize);
+    exit(1);
+  }
+  return atlas;
+}
 
-  UnloadTexture(s_outputTexture);
-  CloseWindow();
+static cl_mem create_texture_image(const Color* atlas, int size)
+{
+  cl_image_format format = { CL_RGBA, CL_UNORM_INT8 };
+  cl_image_desc desc = { .image_type = CL_MEM_OBJECT_IMAGE2D, .image_width = size, .image_height = size };
+  cl_mem image = clCreateImage(s_context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, &format, &desc, (void*)atlas, &s_err);
+  CL_CHECK(s_err);
+  return image;
 }
 
-void gfx_load_model(const char* filePath, const char* texturePath, Mat4 transform)
+int gfx_load_model(const char* filePath, const char* texturePath, Mat4 transform)
 {
+  char key[1024];
+  snprintf(key, sizeof(key), "%s|%s", filePath, texturePath ? texturePath : "");
+
+  // a repeated file only adds an instance of the mesh already loaded
+  for (size_t i = 0; i < arrlen(s_modelKeys); i++) {
+      if (strcmp(s_modelKeys[i], key) == 0) {
+          gfx_add_instance((int)i, transform);
+          return (int)i;
+      }
+  }
+
   const struct aiScene* scene = aiImportFile(
       filePath,
       aiProcess_Triangulate |
@@ -783,18 +2522,49 @@ void gfx_load_model(const char* filePath, const char* texturePath, Mat4 transfor
   if (!scene || scene->mNumMeshes == 0) {
       fprintf(stderr, "Failed to load model: %s\n", filePath);
       aiReleaseImport(scene);
-      return;
+      return -1;
   }
 
   Triangle* triangles = NULL;
   size_t numTriangles = 0;
   size_t numVertices = 0;
+  size_t vertexOffset = arrlen(s_vertexPositions);
 
   int modelIndex = arrlen(s_Models);
 
   for (unsigned int m = 0; m < scene->mNumMeshes; m++) {
       const struct aiMesh* mesh = scene->mMeshes[m];
 
+      if (s_mode == RASTERIZER) {
+          // keep assimp's joined vertices and indices instead of expanding faces
+          uint32_t base = arrlen(s_vertexPositions);
+
+          for (unsigned int v = 0; v < mesh->mNumVertices; v++) {
+              Vec3 normal = {0};
+              uint32_t uv = 0;
+              if (mesh->mNormals)
+                  normal = (Vec3){ mesh->mNormals[v].x, mesh->mNormals[v].y, mesh->mNormals[v].z };
+              if (mesh->mTextureCoords[0])
+                  uv = FloatToHalf(mesh->mTextureCoords[0][v].x) | ((uint32_t)FloatToHalf(mesh->mTextureCoords[0][v].y) << 16);
+
+              arrpush(s_vertexPositions, ((Vec3){ mesh->mVertices[v].x, mesh->mVertices[v].y, mesh->mVertices[v].z }));
+              arrpush(s_vertexNormals, Vec3OctEncode(normal));
+              arrpush(s_vertexUVs, uv);
+          }
+          numVertices += mesh->mNumVertices;
+
+          for (unsigned int f = 0; f < mesh->mNumFaces; f++) {
+              const struct aiFace* face = &mesh->mFaces[f];
+              if (face->mNumIndices != 3) continue;
+
+              arrpush(s_allIndices, base + face->mIndices[0]);
+              arrpush(s_allIndices, base + face->mIndices[1]);
+              arrpush(s_allIndices, base + face->mIndices[2]);
+              numTriangles++;
+          }
+          continue;
+      }
+
       for (unsigned int f = 0; f < mesh->mNumFaces; f++) {
           const struct aiFace* face = &mesh->mFaces[f];
           if (face->mNumIndices != 3) continue; // skip non-triangles
@@ -827,82 +2597,274 @@ void gfx_load_model(const char* filePath, const char* texturePath, Mat4 transfor
       }
   }
 
+  AABB bounds = AABBEmpty();
+  for (unsigned int i = 0; i < scene->mNumMeshes; i++) {
+      const struct aiMesh* mesh = scene->mMeshes[i];
+      for (unsigned int v = 0; v < mesh->mNumVertices; v++)
+          bounds = AABBGrow(bounds, (Vec3){ mesh->mVertices[v].x, mesh->mVertices[v].y, mesh->mVertices[v].z });
+  }
+
+  Vec3 center = Vec3MulS(Vec3Add(bounds.min, bounds.max), 0.5f);
+  float radius = 0.0f;
+  for (unsigned int i = 0; i < scene->mNumMeshes; i++) {
+      const struct aiMesh* mesh = scene->mMeshes[i];
+      for (unsigned int v = 0; v < mesh->mNumVertices; v++)
+          radius = fmaxf(radius, Vec3Len(Vec3Sub(center, (Vec3){ mesh->mVertices[v].x, mesh->mVertices[v].y, mesh->mVertices[v].z })));
+  }
+
   aiReleaseImport(scene);
 
-  int texWidth = 0, texHeight = 0;
-  Color* pixels = NULL;
+  int texWidth = 0, texHeight = 0, mipLevels = 0;
+  size_t texturePixels = 0;
 
   if (texturePath) {
       Image img = LoadImage(texturePath);
+      ImageFormat(&img, PIXELFORMAT_UNCOMPRESSED_R8G8B8A8);
       texWidth = img.width;
       texHeight = img.height;
 
       if (texWidth > 0 && texHeight > 0) {
-          pixels = (Color*)malloc(texWidth * texHeight * sizeof(Color));
-          memcpy(pixels, img.data, texWidth * texHeight * sizeof(Color));
+          size_t start = arrlen(s_allTexturePixels);
+          mipLevels = append_mip_chain(&s_allTexturePixels, img.data, texWidth, texHeight);
+          texturePixels = arrlen(s_allTexturePixels) - start;
       }
 
       UnloadImage(img);
   }
 
-  for (size_t t = 0; t < numTriangles; t++)
+  for (size_t t = 0; t < arrlen(triangles); t++)
       arrpush(s_allTriangles, triangles[t]);
 
-  if (pixels) {
-      size_t numPixels = texWidth * texHeight;
-      for (size_t p = 0; p < numPixels; p++)
-          arrpush(s_allTexturePixels, pixels[p]);
-      free(pixels);
-  }
-
   CustomModel m;
   m.triangleOffset = s_triOffset;
   m.triangleCount  = (int)numTriangles;
-  m.vertexOffset   = 0;
+  m.vertexOffset   = (int)vertexOffset;
   m.vertexCount    = (int)numVertices;
   m.pixelOffset    = s_pixOffset;
   m.texWidth       = texWidth;
   m.texHeight      = texHeight;
-  m.transform      = transform;
+  m.boundsMin      = bounds.min;
+  m.boundsMax      = bounds.max;
+  m.sphereCenter   = center;
+  m.sphereRadius   = radius;
+  m.mipLevels      = mipLevels;
   arrpush(s_Models, m);
+  arrpush(s_modelKeys, strdup(key));
 
   s_triOffset += numTriangles;
-  s_pixOffset += texWidth * texHeight;
+  s_pixOffset += texturePixels;
   s_totalTriangles += numTriangles;
-  s_totalTexturePixels += texWidth * texHeight;
+  s_totalTexturePixels += texturePixels;
 
   arrfree(triangles);
+
+  gfx_add_instance(modelIndex, transform);
+  return modelIndex;
 }
 
-void gfx_upload_models_data(void)
-{  
-  int numModels = arrlen(s_Models);
-  s_totalVerts = s_totalTriangles * 3;
+// Builds one BLAS per model (shared by every instance of it) and a TLAS over the
+// instances' world-space bounds.
+static void build_mesh_bvh(void)
+{
+  arrsetlen(s_blasNodes, 0);
+  arrsetlen(s_blasIndices, 0);
+  arrsetlen(s_Instances, 0);
+
+  size_t numModels = arrlen(s_Models);
+  size_t numInstances = arrlen(s_instanceTransforms);
+  int* roots = (int*)malloc(sizeof(int) * (numModels ? numModels : 1));
+  AABB* instanceBounds = (AABB*)malloc(sizeof(AABB) * (numInstances ? numInstances : 1));
+
+  for (size_t m = 0; m < numModels; m++)
+  {
+    CustomModel* model = &s_Models[m];
+
+    int count = model->triangleCount;
+    AABB* bounds = (AABB*)malloc(sizeof(AABB) * (count ? count : 1));
+    BVHNode* nodes = (BVHNode*)malloc(sizeof(BVHNode) * (count ? 2 * count - 1 : 1));
+    int* indices = (int*)malloc(sizeof(int) * (count ? count : 1));
+
+    for (int t = 0; t < count; t++)
+    {
+      const Triangle* tri = &s_allTriangles[model->triangleOffset + t];
+      AABB box = AABBEmpty();
+      for (int v = 0; v < 3; v++) box = AABBGrow(box, tri->vertex[v]);
+      bounds[t] = box;
+    }
+
+    int nodeCount = BVHBuild(bounds, count, nodes, indices);
+
+    // rebase into the shared node/index arrays
+    int nodeBase = arrlen(s_blasNodes);
+    int indexBase = arrlen(s_blasIndices);
+    for (int n = 0; n < nodeCount; n++)
+    {
+      BVHNode node = nodes[n];
+      node.leftFirst += node.count > 0 ? indexBase : nodeBase;
+      arrpush(s_blasNodes, node);
+    }
+    for (int t = 0; t < count; t++)
+      arrpush(s_blasIndices, model->triangleOffset + indices[t]);
+
+    roots[m] = nodeBase;
+
+    free(bounds);
+    free(nodes);
+    free(indices);
+  }
+
+  for (size_t i = 0; i < numInstances; i++)
+  {
+    int m = s_instanceModels[i];
+    const CustomModel* model = &s_Models[m];
+    const Mat4* transform = &s_instanceTransforms[i];
+
+    MeshInstance inst = {0};
+    inst.transform   = *transform;
+    inst.inverse     = MatInverse(transform);
+    inst.blasRoot    = roots[m];
+    inst.pixelOffset = model->pixelOffset;
+    inst.texWidth    = model->texWidth;
+    inst.texHeight   = model->texHeight;
+    inst.material    = (CustomMaterial){
+      .Albedo = model->texWidth > 0 ? (Vec3){1.0f, 1.0f, 1.0f} : (Vec3){0.8f, 0.8f, 0.8f},
+      .Roughness = 0.5f,
+    };
+    arrpush(s_Instances, inst);
+
+    BVHNode root = s_blasNodes[roots[m]];
+    AABB world = AABBEmpty();
+    for (int c = 0; c < 8; c++)
+    {
+      Vec4 corner = {
+        (c & 1) ? root.max.x : root.min.x,
+        (c & 2) ? root.max.y : root.min.y,
+        (c & 4) ? root.max.z : root.min.z,
+        1.0f
+      };
+      Vec4 w = MatMulVec4(transform, corner);
+      world = AABBGrow(world, (Vec3){w.x, w.y, w.z});
+    }
+    instanceBounds[i] = world;
+  }
+
+  arrsetlen(s_tlasNodes, numInstances ? 2 * numInstances - 1 : 1);
+  arrsetlen(s_tlasIndices, numInstances ? numInstances : 1);
+  int tlasCount = BVHBuild(instanceBounds, numInstances, s_tlasNodes, s_tlasIndices);
+  arrsetlen(s_tlasNodes, tlasCount);
+
+  free(roots);
+  free(instanceBounds);
+}
 
-  s_trianglesBuffer = clCreateBuffer(s_context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-        arrlen(s_allTriangles) * sizeof(Triangle), s_allTriangles, &s_err);
+static void upload_raytracer_meshes(void)
+{
+  build_mesh_bvh();
+
+  uint32_t instanceCount = arrlen(s_Instances);
+  if (instanceCount == 0) return;
+
+  // a re-upload replaces the previous scene's buffers
+  if (s_trianglesBuffer) clReleaseMemObject(s_trianglesBuffer);
+  if (s_blasNodesBuffer) clReleaseMemObject(s_blasNodesBuffer);
+  if (s_blasIndicesBuffer) clReleaseMemObject(s_blasIndicesBuffer);
+  if (s_tlasNodesBuffer) clReleaseMemObject(s_tlasNodesBuffer);
+  if (s_tlasIndicesBuffer) clReleaseMemObject(s_tlasIndicesBuffer);
+  if (s_instancesBuffer) clReleaseMemObject(s_instancesBuffer);
+  if (s_pixelsBuffer && arrlen(s_allTexturePixels) > 0) clReleaseMemObject(s_pixelsBuffer);
+
+  CL_CHECK_BUFFER(s_trianglesBuffer, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, arrlen(s_allTriangles) * sizeof(Triangle), s_allTriangles);
+  CL_CHECK_BUFFER(s_blasNodesBuffer, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, arrlen(s_blasNodes) * sizeof(BVHNode), s_blasNodes);
+  CL_CHECK_BUFFER(s_blasIndicesBuffer, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, arrlen(s_blasIndices) * sizeof(int), s_blasIndices);
+  CL_CHECK_BUFFER(s_tlasNodesBuffer, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, arrlen(s_tlasNodes) * sizeof(BVHNode), s_tlasNodes);
+  CL_CHECK_BUFFER(s_tlasIndicesBuffer, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, arrlen(s_tlasIndices) * sizeof(int), s_tlasIndices);
+  CL_CHECK_BUFFER(s_instancesBuffer, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, instanceCount * sizeof(MeshInstance), s_Instances);
 
-  s_pixelsBuffer = clCreateBuffer(s_context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-        arrlen(s_allTexturePixels) * sizeof(Color), s_allTexturePixels, &s_err);
+  if (arrlen(s_allTexturePixels) > 0)
+    CL_CHECK_BUFFER(s_pixelsBuffer, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, arrlen(s_allTexturePixels) * sizeof(Color), s_allTexturePixels);
 
-  s_modelsBuffer = clCreateBuffer(s_context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-        arrlen(s_Models) * sizeof(CustomModel), s_Models, &s_err);
+  set_mesh_args(instanceCount);
+
+  s_resetAccumulation = true;
+}
+
+void gfx_upload_models_data(void)
+{  
+  if (s_mode == RAYTRACER)
+  {
+    upload_raytracer_meshes();
+    return;
+  }
 
-  s_projectedVertsBuffer = clCreateBuffer(s_context, CL_MEM_READ_WRITE,
-                                          sizeof(Vec4) * s_totalVerts, NULL, NULL);
+  size_t numInstances = arrlen(s_instanceTransforms);
+  s_totalVerts = arrlen(s_vertexPositions);
+
+  // nothing to upload; render_frame skips the mesh kernels while no triangle is visible
+  if (arrlen(s_Models) == 0 || numInstances == 0) return;
+
+  // a re-upload replaces the previous scene's buffers
+  CL_RELEASE(clReleaseMemObject, s_positionsBuffer);
+  CL_RELEASE(clReleaseMemObject, s_normalsBuffer);
+  CL_RELEASE(clReleaseMemObject, s_uvsBuffer);
+  CL_RELEASE(clReleaseMemObject, s_instanceTransformsBuffer);
+  CL_RELEASE(clReleaseMemObject, s_visibleInstancesBuffer);
+  CL_RELEASE(clReleaseMemObject, s_indicesBuffer);
+  CL_RELEASE(clReleaseMemObject, s_pixelsBuffer);
+  CL_RELEASE(clReleaseMemObject, s_modelsBuffer);
+
+  CL_CHECK_BUFFER(s_positionsBuffer, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, s_totalVerts * sizeof(Vec3), s_vertexPositions);
+  CL_CHECK_BUFFER(s_normalsBuffer, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, s_totalVerts * sizeof(uint32_t), s_vertexNormals);
+  CL_CHECK_BUFFER(s_uvsBuffer, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, s_totalVerts * sizeof(uint32_t), s_vertexUVs);
+  CL_CHECK_BUFFER(s_instanceTransformsBuffer, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, numInstances * sizeof(Mat4), s_instanceTransforms);
+  CL_CHECK_BUFFER(s_visibleInstancesBuffer, CL_MEM_READ_ONLY, numInstances * sizeof(VisibleInstance), NULL);
+
+  CL_CHECK_BUFFER(s_indicesBuffer, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, arrlen(s_allIndices) * sizeof(uint32_t), s_allIndices);
+
+  // s_pixelsBuffer holds the texture image instead of the buffer on the image path
+  if (s_useImages) {
+      Sprite* textures = NULL;
+      for (size_t m = 0; m < arrlen(s_Models); m++) {
+          Sprite t = { s_Models[m].pixelOffset, s_Models[m].texWidth, s_Models[m].texHeight, s_Models[m].mipLevels, 0, 0 };
+          arrput(textures, t);
+      }
+      int atlasSize = 0;
+      Color* atlas = pack_texture_atlas_or_exit(s_allTexturePixels, textures, arrlen(textures), &atlasSize);
+      s_pixelsBuffer = create_texture_image(atlas, atlasSize);
+      free(atlas);
+      for (size_t m = 0; m < arrlen(s_Models); m++) {
+          s_Models[m].atlasX = textures[m].atlasX;
+          s_Models[m].atlasY = textures[m].atlasY;
+      }
+      arrfree(textures);
+  } else if (arrlen(s_allTexturePixels) > 0) {
+      CL_CHECK_BUFFER(s_pixelsBuffer, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, arrlen(s_allTexturePixels) * sizeof(Color), s_allTexturePixels);
+  } else {
+      // untextured scenes still bind a valid buffer; models with texWidth 0 never read it
+      CL_CHECK_BUFFER(s_pixelsBuffer, CL_MEM_READ_ONLY, sizeof(Color), NULL);
+  }
 
-  CL_CHECK_SET_KERNEL_ARG(s_vertexKernel, 4, sizeof(cl_mem), s_projectedVertsBuffer);
-  CL_CHECK_SET_KERNEL_ARG(s_fragmentKernel, 1, sizeof(cl_mem), s_projectedVertsBuffer);
+  CL_CHECK_BUFFER(s_modelsBuffer, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, arrlen(s_Models) * sizeof(CustomModel), s_Models);
 
-  CL_CHECK_SET_KERNEL_ARG(s_vertexKernel, 0, sizeof(cl_mem), s_trianglesBuffer);
+  // per-frame streams are sized by cull_instances()
+  CL_CHECK_SET_KERNEL_ARG(s_vertexKernel, 0, sizeof(cl_mem), s_positionsBuffer);
   CL_CHECK_SET_KERNEL_ARG(s_vertexKernel, 1, sizeof(cl_mem), s_modelsBuffer);
-  CL_CHECK_SET_KERNEL_ARG(s_vertexKernel, 2, sizeof(int), numModels);
-  CL_CHECK_SET_KERNEL_ARG(s_vertexKernel, 3, sizeof(int), s_totalVerts);
+  CL_CHECK_SET_KERNEL_ARG(s_vertexKernel, 10, sizeof(cl_mem), s_visibleInstancesBuffer);
+  CL_CHECK_SET_KERNEL_ARG(s_vertexKernel, 12, sizeof(cl_mem), s_instanceTransformsBuffer);
+  CL_CHECK_SET_KERNEL_ARG(s_vertexKernel, 13, sizeof(cl_mem), s_normalsBuffer);
+  CL_CHECK_SET_KERNEL_ARG(s_vertexKernel, 14, sizeof(cl_mem), s_uvsBuffer);
+
+  CL_CHECK_SET_KERNEL_ARG(s_clipKernel, 0, sizeof(cl_mem), s_modelsBuffer);
+  CL_CHECK_SET_KERNEL_ARG(s_clipKernel, 3, sizeof(cl_mem), s_indicesBuffer);
+  CL_CHECK_SET_KERNEL_ARG(s_clipKernel, 14, sizeof(cl_mem), s_visibleInstancesBuffer);
 
-  CL_CHECK_SET_KERNEL_ARG(s_fragmentKernel, 6, sizeof(cl_mem), s_trianglesBuffer);
   CL_CHECK_SET_KERNEL_ARG(s_fragmentKernel, 7, sizeof(cl_mem), s_modelsBuffer);
-  CL_CHECK_SET_KERNEL_ARG(s_fragmentKernel, 8, sizeof(int), numModels);
   CL_CHECK_SET_KERNEL_ARG(s_fragmentKernel, 9, sizeof(cl_mem), s_pixelsBuffer);
+
+  if(s_rasterMode == TRIANGLE_PARALLEL)
+  {
+    CL_CHECK_SET_KERNEL_ARG(s_triangleKernel, 5, sizeof(cl_mem), s_modelsBuffer);
+    CL_CHECK_SET_KERNEL_ARG(s_triangleKernel, 7, sizeof(cl_mem), s_pixelsBuffer);
+  }
 }
 
 void gfx_print_model_data(void)
@@ -913,27 +2875,33 @@ void gfx_print_model_data(void)
     printf("Model %zu:\n", m);
     printf("  Triangles: %d\n", model->triangleCount);
     printf("  Texture size: %dx%d\n", model->texWidth, model->texHeight);
-    printf("  Transform matrix:\n");
-    MatPrint(&model->transform); 
+    for (size_t i = 0; i < arrlen(s_instanceTransforms); i++)
+    {
+      if (s_instanceModels[i] != (int)m) continue;
+      printf("  Instance %zu transform:\n", i);
+      MatPrint(&s_instanceTransforms[i]);
+    }
 
     for (int t = 0; t < model->triangleCount; t++)
     {
-      const Triangle* tri = &s_allTriangles[model->triangleOffset + t];
       printf("  Triangle %d:\n", t);
       for (int v = 0; v < 3; v++)
       {
         printf("    Vertex %d:\n", v);
-        printf("      Position: (%f, %f, %f)\n",
-               tri->vertex[v].x,
-               tri->vertex[v].y,
-               tri->vertex[v].z);
-        printf("      UV:       (%f, %f)\n",
-               tri->uv[v].x,
-               tri->uv[v].y);
-        printf("      Normal:   (%f, %f, %f)\n",
-               tri->normal[v].x,
-               tri->normal[v].y,
-               tri->normal[v].z);
+        if (s_mode == RASTERIZER)
+        {
+          uint32_t idx = s_allIndices[(model->triangleOffset + t) * 3 + v];
+          Vec3 pos = s_vertexPositions[idx];
+          printf("      Position: (%f, %f, %f)\n", pos.x, pos.y, pos.z);
+          printf("      UV:       0x%08x (half2)\n", s_vertexUVs[idx]);
+          printf("      Normal:   0x%08x (oct)\n", s_vertexNormals[idx]);
+          continue;
+        }
+
+        const Triangle* tri = &s_allTriangles[model->triangleOffset + t];
+        printf("      Position: (%f, %f, %f)\n", tri->vertex[v].x, tri->vertex[v].y, tri->vertex[v].z);
+        printf("      UV:       (%f, %f)\n", tri->uv[v].x, tri->uv[v].y);
+        printf("      Normal:   (%f, %f, %f)\n", tri->normal[v].x, tri->normal[v].y, tri->normal[v].z);
       }
     }
     printf("\n");
@@ -954,7 +2922,7 @@ void gfx_move_camera(Movement direction)
     {
       float nx = s_Player.x + s_Player.dirX * s_Player.moveSpeed;
       float ny = s_Player.y + s_Player.dirY * s_Player.moveSpeed;
-      if(map[(int)ny][(int)nx]==0) { s_Player.x = nx; s_Player.y = ny; }
+      if(map_cell(nx, ny)==0) { s_Player.x = nx; s_Player.y = ny; }
     }
   }
   if (direction == BACKWARD)
@@ -967,7 +2935,7 @@ void gfx_move_camera(Movement direction)
     {
       float nx = s_Player.x - s_Player.dirX * s_Player.moveSpeed;
       float ny = s_Player.y - s_Player.dirY * s_Player.moveSpeed;
-      if(map[(int)ny][(int)nx]==0) { s_Player.x = nx; s_Player.y = ny; }
+      if(map_cell(nx, ny)==0) { s_Player.x = nx; s_Player.y = ny; }
     }
   }
   if (direction == LEFT)
@@ -980,7 +2948,7 @@ void gfx_move_camera(Movement direction)
     {
       float nx = s_Player.x - s_Player.dirY * s_Player.moveSpeed;
       float ny = s_Player.y + s_Player.dirX * s_Player.moveSpeed;
-      if(map[(int)ny][(int)nx]==0) { s_Player.x = nx; s_Player.y = ny; }
+      if(map_cell(nx, ny)==0) { s_Player.x = nx; s_Player.y = ny; }
     }
   }
   if (direction == RIGHT)
@@ -993,10 +2961,57 @@ void gfx_move_camera(Movement direction)
     {
       float nx = s_Player.x + s_Player.dirY * s_Player.moveSpeed;
       float ny = s_Player.y - s_Player.dirX * s_Player.moveSpeed;
-      if(map[(int)ny][(int)nx]==0) { s_Player.x = nx; s_Player.y = ny; }
+      if(map_cell(nx, ny)==0) { s_Player.x = nx; s_Player.y = ny; }
     }
   }
 }
+// Rebuilds the camera basis and view matrices from pos/yaw/pitch
+static void apply_camera(void)
+{
+  Vec3 front = {0};
+  front.x = cosf(DegToRad(s_camera.yaw)) * cosf(DegToRad(s_camera.pitch));
+  front.y = sinf(DegToRad(s_camera.pitch));
+  front.z = sinf(DegToRad(s_camera.yaw)) * cosf(DegToRad(s_camera.pitch));
+  s_camera.front = Vec3Norm(front);
+
+  s_camera.right = Vec3Norm(Vec3Cross(s_camera.front, s_camera.world_up));
+  s_camera.up    = Vec3Norm(Vec3Cross(s_camera.right, s_camera.front));
+
+  s_camera.view = MatLookAt(s_camera.pos, Vec3Add(s_camera.pos, s_camera.front), s_camera.up);
+
+  s_camera.inverse_view = MatInverse(&s_camera.view);
+
+  if(s_camera.hasMoved)
+  {
+    CL_CHECK_WRITE_BUFFER(s_cameraPosBuffer, CL_FALSE, 0, sizeof(Vec3), &s_camera.pos);
+    CL_CHECK_WRITE_BUFFER(s_viewBuffer, CL_FALSE, 0, sizeof(Mat4), &s_camera.view);
+    CL_CHECK_WRITE_BUFFER(s_inverseViewBuffer, CL_FALSE, 0, sizeof(Mat4), &s_camera.inverse_view);
+  }
+}
+
+void gfx_set_camera(Vec3 pos, float yaw, float pitch)
+{
+  if(s_mode == RASTERIZER || s_mode == RAYTRACER)
+  {
+    s_camera.pos = pos;
+    s_camera.yaw = yaw;
+    s_camera.pitch = pitch;
+    s_camera.hasMoved = true;
+    apply_camera();
+  }
+  else if(s_mode == RAYCASTER)
+  {
+    float rad = DegToRad(yaw);
+    s_Player.x = pos.x;
+    s_Player.y = pos.y;
+    s_Player.dirX = cosf(rad);
+    s_Player.dirY = sinf(rad);
+    s_Player.planeX = s_Player.dirY * 0.66f;
+    s_Player.planeY = -s_Player.dirX * 0.66f;
+    CL_CHECK_WRITE_BUFFER(s_playerBuffer, CL_FALSE, 0, sizeof(Player), &s_Player);
+  }
+}
+
 void gfx_update_camera(void)
 {
   if(s_mode == RASTERIZER || s_mode == RAYTRACER)
@@ -1031,25 +3046,7 @@ void gfx_update_camera(void)
         if (s_camera.pitch < -89.0f) s_camera.pitch = -89.0f;
     }
 
-    Vec3 front = {0};
-    front.x = cosf(DegToRad(s_camera.yaw)) * cosf(DegToRad(s_camera.pitch));
-    front.y = sinf(DegToRad(s_camera.pitch));
-    front.z = sinf(DegToRad(s_camera.yaw)) * cosf(DegToRad(s_camera.pitch));
-    s_camera.front = Vec3Norm(front);
-
-    s_camera.right = Vec3Norm(Vec3Cross(s_camera.front, s_camera.world_up));
-    s_camera.up    = Vec3Norm(Vec3Cross(s_camera.right, s_camera.front));
-
-    s_camera.view = MatLookAt(s_camera.pos, Vec3Add(s_camera.pos, s_camera.front), s_camera.up);
-
-    s_camera.inverse_view = MatInverse(&s_camera.view);
-
-    if(s_camera.hasMoved)
-    {
-      CL_CHECK_WRITE_BUFFER(s_cameraPosBuffer, CL_FALSE, 0, sizeof(Vec3), &s_camera.pos);
-      CL_CHECK_WRITE_BUFFER(s_viewBuffer, CL_FALSE, 0, sizeof(Mat4), &s_camera.view);
-      CL_CHECK_WRITE_BUFFER(s_inverseViewBuffer, CL_FALSE, 0, sizeof(Mat4), &s_camera.inverse_view);
-    }
+    apply_camera();
   }
   else if(s_mode == RAYCASTER)
   {
@@ -1091,101 +3088,358 @@ void gfx_update_camera(void)
         }
     }
 
-    CL_CHECK_SET_KERNEL_ARG(s_spritesKernel,10,sizeof(int),s_ui_current_frame);
+    CL_CHECK_SET_KERNEL_ARG(s_spritesKernel,8,sizeof(int),s_ui_current_frame);
   }
 }
 
 void gfx_load_assets(const char* textures[],size_t textures_count,
-                     const char* sprites[],size_t sprites_count,
-                     SpriteData sprites_data[],size_t sprites_data_count)
+                     const char* sprites[],size_t sprites_count)
 {
-  for (size_t i = 0; i < textures_count; ++i)
-  {
-    Image img = LoadImage(textures[i]);
-    ImageFormat(&img, PIXELFORMAT_UNCOMPRESSED_R8G8B8A8);
-    ImageFlipVertical(&img);
-
-    int pixel_count = img.width * img.height;
-    size_t offset = arrlen(texture_atlas);
-
-    arraddn(texture_atlas, pixel_count);
-    memcpy(texture_atlas + offset,
-           img.data,
-           pixel_count * sizeof(Color));
-
-    Sprite s = {
-        .offset = offset,
-        .width  = img.width,
-        .height = img.height
-    };
-
-    arrput(s_Sprites, s);
-    UnloadImage(img);
-  }
-  
-  for (size_t i = 0; i < sprites_count; ++i)
+  for (size_t i = 0; i < textures_count + sprites_count; ++i)
   {
-    Image img = LoadImage(sprites[i]);
+    Image img = LoadImage(i < textures_count ? textures[i] : sprites[i - textures_count]);
     ImageFormat(&img, PIXELFORMAT_UNCOMPRESSED_R8G8B8A8);
     ImageFlipVertical(&img);
 
-    int pixel_count = img.width * img.height;
-    size_t offset = arrlen(texture_atlas);
-
-    arraddn(texture_atlas, pixel_count);
-    memcpy(texture_atlas + offset,
-           img.data,
-           pixel_count * sizeof(Color));
-
     Sprite s = {
-        .offset = offset,
+        .offset = arrlen(texture_atlas),
         .width  = img.width,
         .height = img.height
     };
+    s.mipLevels = append_mip_chain(&texture_atlas, img.data, img.width, img.height);
 
     arrput(s_Sprites, s);
     UnloadImage(img);
   }
 
-  size_t atlas_size = arrlen(texture_atlas);
+  // Walls, floors and sprites share one packed square atlas; pack_texture_atlas
+  // fills the sprites' atlas rects before they are uploaded
+  int atlasSize = 0;
+  Color* atlas = pack_texture_atlas_or_exit(texture_atlas, s_Sprites, arrlen(s_Sprites), &atlasSize);
 
-  s_textureBuffer = clCreateBuffer(
-      s_context,
-      CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-      atlas_size * sizeof(Color),
-      texture_atlas,
-      NULL);
+  // s_textureBuffer holds the atlas image instead of the buffer on the image path
+  if (s_useImages)
+    s_textureBuffer = create_texture_image(atlas, atlasSize);
+  else
+    s_textureBuffer = clCreateBuffer(
+        s_context,
+        CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+        (size_t)atlasSize * atlasSize * sizeof(Color),
+        atlas,
+        NULL);
+  free(atlas);
   s_spritesBuffer = clCreateBuffer(
       s_context,
       CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
       arrlen(s_Sprites) * sizeof(Sprite),
       s_Sprites,
       NULL);
-  s_spritesDataBuffer = clCreateBuffer(
-      s_context,
-      CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-      sprites_data_count * sizeof(SpriteData),
-      sprites_data,
-      NULL);
-  s_spriteOrderBuffer = clCreateBuffer(
-      s_context,
-      CL_MEM_READ_ONLY,
-      120 * sizeof(int),
-      NULL,
-      NULL);
 
-  s_numSprites = sprites_count;
+  CL_CHECK_SET_KERNEL_ARG(s_wallColumnsKernel, 8, sizeof(cl_mem), s_spritesBuffer);
+  CL_CHECK_SET_KERNEL_ARG(s_surfaceKernel, 5, sizeof(cl_mem), s_textureBuffer);
+  CL_CHECK_SET_KERNEL_ARG(s_surfaceKernel, 6, sizeof(cl_mem), s_spritesBuffer);
+
+  CL_CHECK_SET_KERNEL_ARG(s_spritesKernel, 6, sizeof(cl_mem), s_textureBuffer);
+  CL_CHECK_SET_KERNEL_ARG(s_spritesKernel, 7, sizeof(cl_mem), s_spritesBuffer);
+
+  CL_CHECK_SET_KERNEL_ARG(s_surfaceKernel, 7, sizeof(int), atlasSize);
+  CL_CHECK_SET_KERNEL_ARG(s_spritesKernel, 9, sizeof(int), atlasSize);
+}
+
+// Binary level: this header, width * height map bytes, then spriteCount SpriteData
+typedef struct { char magic[4]; uint32_t version, width, height, spriteCount; } LevelHeader;
+#define LEVEL_MAGIC "GLVL"
+#define LEVEL_VERSION 1
+#define LEVEL_MAX_SIZE 16384 // cells per side
+#define LEVEL_MAX_SPRITES (1 << 20)
+
+// Reads one line of any length into *line (a stb_ds array); false at end of file
+static bool read_line(FILE* f, char** line)
+{
+  arrsetlen(*line, 0);
+  int c;
+  while((c = fgetc(f)) != EOF && c != '\n') arrput(*line, (char)c);
+  arrput(*line, '\0');
+  return c != EOF || arrlen(*line) > 1;
+}
+
+static bool load_level_text(FILE* f, const char* path, unsigned char** map, int* width, int* height, SpriteData** sprites)
+{
+  enum { SECTION_NONE, SECTION_MAP, SECTION_SPRITES } section = SECTION_NONE;
+  char* line = NULL;
+  int lineNumber = 0;
+  bool ok = true;
+
+  while(ok && read_line(f, &line))
+  {
+    lineNumber++;
+    char* p = line;
+    while(isspace((unsigned char)*p)) p++;
+    if(*p == '\0') continue;
+
+    if(*p == '[')
+    {
+      if(strncmp(p, "[MAP_DATA]", 10) == 0) section = SECTION_MAP;
+      else if(strncmp(p, "[SPRITES_DATA]", 14) == 0) section = SECTION_SPRITES;
+      else
+      {
+        fprintf(stderr, "%s:%d: unknown section %s, skipping it\n", path, lineNumber, p);
+        section = SECTION_NONE;
+      }
+      continue;
+    }
+
+    if(section == SECTION_MAP)
+    {
+      int cols = 0;
+      while(*p)
+      {
+        if(*p == ',' || isspace((unsigned char)*p)) { p++; continue; }
+
+        char* end;
+        long cell = strtol(p, &end, 10);
+        if(end == p || cell < 0 || cell > 255)
+        {
+          fprintf(stderr, "%s:%d: bad map cell\n", path, lineNumber);
+          ok = false;
+          break;
+        }
+        arrput(*map, (unsigned char)cell);
+        cols++;
+        p = end;
+      }
+
+      if(ok && *height == 0) *width = cols;
+      else if(ok && cols != *width)
+      {
+        fprintf(stderr, "%s:%d: map row has %d cells, expected %d\n", path, lineNumber, cols, *width);
+        ok = false;
+      }
+      (*height)++;
+    }
+    else if(section == SECTION_SPRITES)
+    {
+      SpriteData sd = {0};
+      if(*p != '{' || sscanf(p + 1, "%f , %f , %f , %f , %f , %f , %d , %d , %d , %d",
+                             &sd.x, &sd.y, &sd.vx, &sd.vy, &sd.dir_x, &sd.dir_y,
+                             &sd.is_projectile, &sd.is_ui, &sd.is_destroyed, &sd.texture) != 10)
+      {
+        fprintf(stderr, "%s:%d: expected {x, y, vx, vy, dir_x, dir_y, is_projectile, is_ui, is_destroyed, texture}\n", path, lineNumber);
+        ok = false;
+      }
+      else arrput(*sprites, sd);
+    }
+  }
+
+  arrfree(line);
+  return ok;
+}
+
+static bool load_level_binary(FILE* f, const char* path, unsigned char** map, int* width, int* height, SpriteData** sprites)
+{
+  LevelHeader header;
+  if(fread(&header, sizeof(header), 1, f) != 1 || header.version != LEVEL_VERSION ||
+     header.width == 0 || header.height == 0 ||
+     header.width > LEVEL_MAX_SIZE || header.height > LEVEL_MAX_SIZE ||
+     header.spriteCount > LEVEL_MAX_SPRITES)
+  {
+    fprintf(stderr, "%s: unsupported level header\n", path);
+    return false;
+  }
+
+  *width = (int)header.width;
+  *height = (int)header.height;
+  arrsetlen(*map, (size_t)header.width * header.height);
+  arrsetlen(*sprites, header.spriteCount);
+
+  if(fread(*map, 1, arrlen(*map), f) != arrlen(*map) ||
+     fread(*sprites, sizeof(SpriteData), header.spriteCount, f) != header.spriteCount)
+  {
+    fprintf(stderr, "%s: truncated level\n", path);
+    return false;
+  }
+  return true;
+}
+
+// Occupancy pyramid for wall_columns_kernel: level L >= 1 holds one byte per 2^L x 2^L
+// block, set when any cell of the block is a wall or falls outside the map, so the DDA
+// never skips across the map edge. Levels go back to back from level 1 until 1x1;
+// layout[L - 1] gets level L's byte offset and width so the kernel indexes it directly.
+static unsigned char* build_occupancy(const unsigned char* map, int width, int height, int* outLevels, cl_int2 layout[OCCUPANCY_MAX_LEVELS])
+{
+  unsigned char* pyramid = NULL;
+  size_t prevOffset = 0;
+  int levels = 0;
+
+  for(int w = width, h = height; w > 1 || h > 1; levels++)
+  {
+    int cw = (w + 1) / 2, ch = (h + 1) / 2;
+    size_t offset = arrlen(pyramid);
+    arrsetlen(pyramid, offset + (size_t)cw * ch);
+    layout[levels] = (cl_int2){ .s = { (cl_int)offset, cw } };
+
+    for(int y = 0; y < ch; y++)
+    {
+      for(int x = 0; x < cw; x++)
+      {
+        unsigned char occupied = 0;
+        for(int i = 0; i < 4; i++)
+        {
+          int cx = x * 2 + (i & 1), cy = y * 2 + (i >> 1);
+          if(cx >= w || cy >= h) occupied = 1;
+          else if(levels == 0) occupied |= map[cy * w + cx] > 0;
+          else occupied |= pyramid[prevOffset + cy * w + cx];
+        }
+        pyramid[offset + y * cw + x] = occupied;
+      }
+    }
+
+    prevOffset = offset;
+    w = cw;
+    h = ch;
+  }
+
+  *outLevels = levels;
+  return pyramid;
+}
+
+bool gfx_load_level(const char* path)
+{
+  FILE* f = fopen(path, "rb");
+  if(!f)
+  {
+    fprintf(stderr, "Failed to open level %s\n", path);
+    return false;
+  }
+
+  unsigned char* map = NULL;
+  SpriteData* sprites = NULL;
+  int width = 0, height = 0;
+
+  char magic[4] = {0};
+  bool binary = fread(magic, 1, 4, f) == 4 && memcmp(magic, LEVEL_MAGIC, 4) == 0;
+  rewind(f);
+
+  bool ok = binary ? load_level_binary(f, path, &map, &width, &height, &sprites)
+                   : load_level_text(f, path, &map, &width, &height, &sprites);
+  fclose(f);
+
+  if(ok && (width <= 0 || height <= 0 || width > LEVEL_MAX_SIZE || height > LEVEL_MAX_SIZE))
+  {
+    fprintf(stderr, "%s: map is %dx%d, expected 1..%d cells per side\n", path, width, height, LEVEL_MAX_SIZE);
+    ok = false;
+  }
+  if(ok && arrlen(sprites) > LEVEL_MAX_SPRITES)
+  {
+    fprintf(stderr, "%s: %d sprites, at most %d are supported\n", path, (int)arrlen(sprites), LEVEL_MAX_SPRITES);
+    ok = false;
+  }
+  for(size_t i = 0; ok && i < arrlen(sprites); i++)
+  {
+    if(sprites[i].texture < 0 || sprites[i].texture >= (int)arrlen(s_Sprites))
+    {
+      fprintf(stderr, "%s: sprite %zu uses texture %d, only %d are loaded\n", path, i, sprites[i].texture, (int)arrlen(s_Sprites));
+      ok = false;
+    }
+  }
+
+  if(!ok)
+  {
+    arrfree(map);
+    arrfree(sprites);
+    return false;
+  }
 
-  memcpy(s_spritesData, sprites_data, sprites_count * sizeof(SpriteData));
+  arrfree(s_map);
+  arrfree(s_spritesData);
+  s_map = map;
+  s_mapWidth = width;
+  s_mapHeight = height;
+  s_spritesData = sprites;
+
+  size_t numSprites = arrlen(s_spritesData);
+  s_spriteSortSize = SPRITE_SORT_GROUP;
+  while(s_spriteSortSize < numSprites) s_spriteSortSize *= 2;
+
+  // device buffers are sized from the level; an empty sprite list still needs a valid buffer
+  size_t spriteCapacity = numSprites > 0 ? numSprites : 1;
+  if(s_mapBuffer) clReleaseMemObject(s_mapBuffer);
+  for(int i = 0; i < 2; i++)
+    if(s_spritesDataBuffers[i]) clReleaseMemObject(s_spritesDataBuffers[i]);
+  if(s_projectedSpritesBuffer) clReleaseMemObject(s_projectedSpritesBuffer);
+  if(s_spriteKeysBuffer) clReleaseMemObject(s_spriteKeysBuffer);
+  if(s_visibleSpritesBuffer) clReleaseMemObject(s_visibleSpritesBuffer);
+  CL_CHECK_BUFFER(s_mapBuffer, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, arrlen(s_map), s_map);
+
+  int occupancyLevels = 0;
+  cl_int2 occupancyLayout[OCCUPANCY_MAX_LEVELS] = {0};
+  unsigned char* occupancy = build_occupancy(s_map, s_mapWidth, s_mapHeight, &occupancyLevels, occupancyLayout);
+  if(s_occupancyBuffer) clReleaseMemObject(s_occupancyBuffer);
+  if(s_occupancyLayoutBuffer) clReleaseMemObject(s_occupancyLayoutBuffer);
+  if(occupancyLevels > 0)
+    CL_CHECK_BUFFER(s_occupancyBuffer, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, arrlen(occupancy), occupancy);
+  else
+    CL_CHECK_BUFFER(s_occupancyBuffer, CL_MEM_READ_ONLY, 1, NULL);
+  arrfree(occupancy);
+  CL_CHECK_BUFFER(s_occupancyLayoutBuffer, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(occupancyLayout), occupancyLayout);
+
+  CL_CHECK_BUFFER(s_spritesDataBuffers[0], CL_MEM_READ_WRITE, spriteCapacity * sizeof(SpriteData), NULL);
+  CL_CHECK_BUFFER(s_spritesDataBuffers[1], CL_MEM_READ_WRITE, spriteCapacity * sizeof(SpriteData), NULL);
+  CL_CHECK_BUFFER(s_projectedSpritesBuffer, CL_MEM_READ_WRITE, spriteCapacity * VISIBLE_SPRITE_SIZE, NULL);
+  CL_CHECK_BUFFER(s_spriteKeysBuffer, CL_MEM_READ_WRITE, s_spriteSortSize * sizeof(cl_uint2), NULL);
+  CL_CHECK_BUFFER(s_visibleSpritesBuffer, CL_MEM_READ_WRITE, spriteCapacity * VISIBLE_SPRITE_SIZE, NULL);
+  if(numSprites > 0)
+    CL_CHECK_WRITE_BUFFER(s_spritesDataBuffers[0], CL_TRUE, 0, numSprites * sizeof(SpriteData), s_spritesData);
+  s_spriteState = 0;
+
+  CL_CHECK_SET_KERNEL_ARG(s_wallColumnsKernel, 5, sizeof(cl_mem), s_mapBuffer);
+  CL_CHECK_SET_KERNEL_ARG(s_wallColumnsKernel, 6, sizeof(int), s_mapWidth);
+  CL_CHECK_SET_KERNEL_ARG(s_wallColumnsKernel, 7, sizeof(int), s_mapHeight);
+  CL_CHECK_SET_KERNEL_ARG(s_wallColumnsKernel, 9, sizeof(cl_mem), s_occupancyBuffer);
+  CL_CHECK_SET_KERNEL_ARG(s_wallColumnsKernel, 10, sizeof(int), occupancyLevels);
+  CL_CHECK_SET_KERNEL_ARG(s_wallColumnsKernel, 11, sizeof(cl_mem), s_occupancyLayoutBuffer);
+
+  int spriteCount = (int)numSprites;
+  CL_CHECK_SET_KERNEL_ARG(s_simulateSpritesKernel, 2, sizeof(int), spriteCount);
+  CL_CHECK_SET_KERNEL_ARG(s_simulateSpritesKernel, 3, sizeof(cl_mem), s_mapBuffer);
+  CL_CHECK_SET_KERNEL_ARG(s_simulateSpritesKernel, 4, sizeof(int), s_mapWidth);
+  CL_CHECK_SET_KERNEL_ARG(s_simulateSpritesKernel, 5, sizeof(int), s_mapHeight);
+  CL_CHECK_SET_KERNEL_ARG(s_projectSpritesKernel, 2, sizeof(int), spriteCount);
+  CL_CHECK_SET_KERNEL_ARG(s_projectSpritesKernel, 5, sizeof(cl_mem), s_projectedSpritesBuffer);
+  CL_CHECK_SET_KERNEL_ARG(s_projectSpritesKernel, 6, sizeof(cl_mem), s_spriteKeysBuffer);
+  CL_CHECK_SET_KERNEL_ARG(s_sortSpritesLocalKernel, 0, sizeof(cl_mem), s_spriteKeysBuffer);
+  CL_CHECK_SET_KERNEL_ARG(s_sortSpritesStepKernel, 0, sizeof(cl_mem), s_spriteKeysBuffer);
+  CL_CHECK_SET_KERNEL_ARG(s_compactSpritesKernel, 0, sizeof(cl_mem), s_spriteKeysBuffer);
+  CL_CHECK_SET_KERNEL_ARG(s_compactSpritesKernel, 1, sizeof(cl_mem), s_projectedSpritesBuffer);
+  CL_CHECK_SET_KERNEL_ARG(s_compactSpritesKernel, 2, sizeof(cl_mem), s_visibleSpritesBuffer);
+  CL_CHECK_SET_KERNEL_ARG(s_spritesKernel, 4, sizeof(cl_mem), s_visibleSpritesBuffer);
+
+  fprintf(stderr, "Level %s: %dx%d map, %d sprites\n", path, s_mapWidth, s_mapHeight, spriteCount);
+  return true;
+}
 
-  CL_CHECK_SET_KERNEL_ARG(s_surfaceKernel, 7, sizeof(cl_mem), s_textureBuffer);
-  CL_CHECK_SET_KERNEL_ARG(s_surfaceKernel, 8, sizeof(cl_mem), s_spritesBuffer);
+bool gfx_save_level(const char* path)
+{
+  FILE* f = fopen(path, "wb");
+  if(!f)
+  {
+    fprintf(stderr, "Failed to write level %s\n", path);
+    return false;
+  }
 
-  CL_CHECK_SET_KERNEL_ARG(s_spritesKernel, 5, sizeof(cl_mem), s_spritesDataBuffer);
-  CL_CHECK_SET_KERNEL_ARG(s_spritesKernel, 6, sizeof(cl_mem), s_spriteOrderBuffer);
-  CL_CHECK_SET_KERNEL_ARG(s_spritesKernel, 7, sizeof(int), sprites_count);
-  CL_CHECK_SET_KERNEL_ARG(s_spritesKernel, 8, sizeof(cl_mem), s_textureBuffer);
-  CL_CHECK_SET_KERNEL_ARG(s_spritesKernel, 9, sizeof(cl_mem), s_spritesBuffer);
+  LevelHeader header = {
+    .version = LEVEL_VERSION,
+    .width = (uint32_t)s_mapWidth,
+    .height = (uint32_t)s_mapHeight,
+    .spriteCount = (uint32_t)arrlen(s_spritesData)
+  };
+  memcpy(header.magic, LEVEL_MAGIC, 4);
+
+  bool ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+            fwrite(s_map, 1, arrlen(s_map), f) == arrlen(s_map) &&
+            fwrite(s_spritesData, sizeof(SpriteData), header.spriteCount, f) == header.spriteCount;
+  fclose(f);
+  return ok;
 }
 
 static int tile_size = 20;
@@ -1194,12 +3448,16 @@ void gfx_draw_map_state(void)
 {
   int y_offset = 0;
 
-  for(size_t row=0;row<11;++row)
+  // only the cells that land on screen, large maps would otherwise cost a DrawText each
+  int rows = s_mapHeight < GetScreenHeight() / tile_size + 1 ? s_mapHeight : GetScreenHeight() / tile_size + 1;
+  int cols = s_mapWidth < GetScreenWidth() / tile_size + 1 ? s_mapWidth : GetScreenWidth() / tile_size + 1;
+
+  for(int row=0;row<rows;++row)
   {
     int x_offset = 0;
-    for(size_t col=0;col<11;++col)
+    for(int col=0;col<cols;++col)
     {
-      int val = map[row][col];
+      int val = s_map[row * s_mapWidth + col];
 
       const char* symbol;
       switch(val)
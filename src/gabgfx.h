@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stdint.h>
+#include <stdbool.h>
 
 #include "gabmath.h"
 #include "raylib.h"
@@ -9,6 +10,8 @@
 
 typedef enum { RASTERIZER, RAYCASTER, RAYTRACER } RenderMode;
 
+typedef enum { TILE_PARALLEL, TRIANGLE_PARALLEL } RasterMode;
+
 typedef enum { FORWARD, BACKWARD, LEFT, RIGHT } Movement;
 
 typedef struct {
@@ -16,19 +19,86 @@ typedef struct {
     int is_projectile, is_ui, is_destroyed, texture;
 } SpriteData;
 
+typedef struct {
+  Vec3 Albedo;
+  float Roughness;
+  float Metallic;
+  float EmissionPower;
+  float Translucent;
+  float IOR;
+} CustomMaterial;
+
+typedef struct {
+  Vec3 pos;
+  float radius;
+  CustomMaterial material;
+} Sphere;
+
+typedef struct {
+  char name[128];
+  char vendor[128];
+  char platform[128];
+  char version[64];
+  char driver[64];
+  cl_device_type type;
+  cl_uint computeUnits;
+  cl_uint clockMHz;
+  cl_ulong globalMemSize;
+  cl_ulong localMemSize;
+  size_t maxWorkGroupSize;
+  cl_uint vectorWidthChar, vectorWidthInt, vectorWidthFloat;
+} GfxDeviceInfo;
+
+// Device selection, call before gfx_init. selector is "gpu", "cpu", "accelerator",
+// a flat index, "<platform>:<device>" or part of the device name. When unset the
+// GABGFX_DEVICE environment variable is used; anything unmatched falls back to GPU, then CPU.
+void gfx_select_device(const char* selector);
+void gfx_list_devices(void);
+GfxDeviceInfo gfx_device_info(void); // valid after gfx_init
+
+// RASTERIZER work split, call before gfx_init. TILE_PARALLEL walks each screen tile's
+// triangle list per pixel; TRIANGLE_PARALLEL walks each triangle's pixels and resolves
+// with 64-bit atomics, falling back to TILE_PARALLEL without cl_khr_int64_extended_atomics
+void gfx_set_raster_mode(RasterMode mode);
+RasterMode gfx_raster_mode(void); // the mode actually used, valid after gfx_init
+
+// Textures as an OpenCL image atlas (hardware filtering and texture cache) when the
+// device supports images, default on; false keeps the global buffer path. Call before gfx_init
+void gfx_set_texture_images(bool enabled);
+
 void gfx_init(RenderMode mode);
+void gfx_init_headless(RenderMode mode, int width, int height); // no window, gfx_draw only renders
 void gfx_draw(void);
 void gfx_close(void);
 
+bool gfx_save_frame(const char* filePath); // .ppm, .rgba (raw) or any raylib image format
+
+// Per-stage GPU timings, call gfx_set_profiling before gfx_init. The overlay shows
+// rolling min/avg/p99; the trace opens in chrome://tracing or Perfetto
+void gfx_set_profiling(bool enabled);
+void gfx_print_profile(void);
+bool gfx_export_trace(const char* filePath);
+
 void gfx_move_camera(Movement direction);
 void gfx_update_camera(void);
+void gfx_set_camera(Vec3 pos, float yaw, float pitch); // RAYCASTER: pos.x/pos.y on the map
+
+void gfx_add_sphere(Sphere sphere);
+void gfx_set_max_bounces(int bounces); // path tracer, default 5, at most 32
+size_t gfx_triangle_count(void);
+size_t gfx_sphere_count(void); // every sphere on the device, built-in scene ones included
 
-void gfx_load_model(const char* filePath,const char* texturePath, Mat4 transform);
+// Returns a model handle; loading the same file/texture pair again only adds an instance
+int gfx_load_model(const char* filePath,const char* texturePath, Mat4 transform);
+int gfx_add_instance(int model, Mat4 transform); // another placement of a loaded model, call before gfx_upload_models_data
 void gfx_upload_models_data(void);
 void gfx_print_model_data(void);
 
 void gfx_load_assets(const char* textures[],size_t textures_count,
-                     const char* sprites[],size_t sprites_count,
-                     SpriteData sprites_data[],size_t sprites_data_count);
+                     const char* sprites[],size_t sprites_count);
+// Raycaster level: text with [MAP_DATA] rows and [SPRITES_DATA] {SpriteData} lines, or the
+// binary format gfx_save_level writes. Call after gfx_load_assets; replaces the current level.
+bool gfx_load_level(const char* path);
+bool gfx_save_level(const char* path);
 void gfx_draw_map_state(void);
 
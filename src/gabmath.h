@@ -33,6 +33,9 @@ Vec3 Vec3Reflect(Vec3 I, Vec3 N);
 float Vec3Dot(Vec3 v1, Vec3 v2);
 float Vec3Len(Vec3 v);
 float Vec3Theta(Vec3 v1, Vec3 v2); // returns angle in radians between vectors (reverse cos)
+uint32_t Vec3OctEncode(Vec3 n); // unit vector -> octahedral, 2x snorm16 (x low, y high)
+
+uint16_t FloatToHalf(float f); // IEEE binary16, round to nearest even
 
 // COLUMN-MAJOR
 typedef struct Mat3 { float f[3][3]; } Mat3;
@@ -51,6 +54,7 @@ Mat4 MatTransform(Vec3 position, Vec3 deg_rotation, Vec3 scale);
 Mat4 MatInverseRT(const Mat4* m);
 Mat4 MatInverse(const Mat4* m);
 Mat4 MatLookAt(Vec3 position, Vec3 target, Vec3 up);
+Vec4 MatMulVec4(const Mat4* m, Vec4 v);
 
 #endif // GABMATH_H
 
@@ -433,4 +437,60 @@ Mat4 MatLookAt(Vec3 position, Vec3 target, Vec3 up)
 
   return mat;
 }
+uint32_t Vec3OctEncode(Vec3 n)
+{
+  float l1 = fabsf(n.x) + fabsf(n.y) + fabsf(n.z);
+  if(l1 <= 0.0f) return 0;
+
+  float px = n.x / l1;
+  float py = n.y / l1;
+  if(n.z < 0.0f)
+  {
+    float ox = (1.0f - fabsf(py)) * (px >= 0.0f ? 1.0f : -1.0f);
+    float oy = (1.0f - fabsf(px)) * (py >= 0.0f ? 1.0f : -1.0f);
+    px = ox; py = oy;
+  }
+
+  int16_t sx = (int16_t)lrintf(fminf(fmaxf(px, -1.0f), 1.0f) * 32767.0f);
+  int16_t sy = (int16_t)lrintf(fminf(fmaxf(py, -1.0f), 1.0f) * 32767.0f);
+  return (uint32_t)(uint16_t)sx | ((uint32_t)(uint16_t)sy << 16);
+}
+uint16_t FloatToHalf(float f)
+{
+  union { float f; uint32_t u; } bits = { f };
+  uint32_t u = bits.u;
+  uint16_t sign = (u >> 16) & 0x8000;
+  int32_t exp = ((u >> 23) & 0xFF) - 127 + 15;
+  uint32_t mant = u & 0x7FFFFF;
+
+  if(((u >> 23) & 0xFF) == 0xFF) // inf / nan
+    return sign | 0x7C00 | (mant ? 0x200 : 0);
+  if(exp >= 31) // overflow -> inf
+    return sign | 0x7C00;
+  if(exp <= 0) // subnormal or zero
+  {
+    if(exp < -10) return sign;
+    mant |= 0x800000;
+    uint32_t shift = 14 - exp;
+    uint32_t half = mant >> shift;
+    uint32_t rest = mant & ((1u << shift) - 1);
+    uint32_t mid = 1u << (shift - 1);
+    if(rest > mid || (rest == mid && (half & 1))) half++;
+    return sign | half;
+  }
+
+  uint32_t half = ((uint32_t)exp << 10) | (mant >> 13);
+  uint32_t rest = mant & 0x1FFF;
+  if(rest > 0x1000 || (rest == 0x1000 && (half & 1))) half++; // may carry into the exponent, which is correct
+  return sign | half;
+}
+Vec4 MatMulVec4(const Mat4* m, Vec4 v)
+{
+  return (Vec4){
+    m->f[0][0]*v.x + m->f[0][1]*v.y + m->f[0][2]*v.z + m->f[0][3]*v.w,
+    m->f[1][0]*v.x + m->f[1][1]*v.y + m->f[1][2]*v.z + m->f[1][3]*v.w,
+    m->f[2][0]*v.x + m->f[2][1]*v.y + m->f[2][2]*v.z + m->f[2][3]*v.w,
+    m->f[3][0]*v.x + m->f[3][1]*v.y + m->f[3][2]*v.z + m->f[3][3]*v.w
+  };
+}
 #endif // MYLIB_IMPLEMENTATION
@@ -1,6 +1,11 @@
 #include "gabgfx.h"
 #include "raylib.h"
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
 /*const char* map =*/
 /*"1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, \*/
 /*1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, \*/
@@ -45,26 +50,172 @@ const char* sprites[] = {
   "res/shotgun8.png",
 };
 
-SpriteData sprites_data[] = {
-  {3.5, 7.5, 0, 0, 0, 0,0, 0, 0, 8},
-  {3.5, 5.5, 0, 0, 0, 0,0, 0, 0, 11},
-  {3.5, 3.5, 0, 0, 0, 0,0, 0, 0, 9},
-  {7.5, 3.5, 0, 0, 0, 0,0, 0, 0, 8},
-  {5.5, 5.5, 0, 0, 0, 0,0, 0, 0, 10}
-};
-
 #define ARR_SIZE(x) (sizeof x / sizeof x[0])
 
-int main(void)
+static const char* s_levelPath = "res/level_1.txt";
+static const char* s_saveLevelPath = NULL;
+
+// --headless <frames> renders offscreen and dumps frames, e.g.
+//   gabgfx --mode raster --headless 120 --orbit --out out/frame --format png
+// --profile shows per-stage GPU timings, --trace <file.json> also writes a Chrome trace
+// --device cpu|gpu|<index>|<platform>:<device>|<name> picks the OpenCL device (or GABGFX_DEVICE)
+// --raster tile|triangle picks the rasterizer work split
+// --buffer-textures skips the image path and samples textures from global buffers
+// --level <file> loads a raycaster level (text or binary), --save-level <file> writes it as binary
+typedef struct {
+  RenderMode mode;
+  int frames;
+  int width, height;
+  const char* out;
+  const char* format;
+  bool orbit;
+  bool lastOnly;
+  bool listDevices;
+  const char* trace;
+} Options;
+
+static RenderMode parse_mode(const char* name)
+{
+  if(strcmp(name, "raster") == 0 || strcmp(name, "rasterizer") == 0) return RASTERIZER;
+  if(strcmp(name, "raycast") == 0 || strcmp(name, "raycaster") == 0) return RAYCASTER;
+  return RAYTRACER;
+}
+
+static Options parse_options(int argc, char** argv)
+{
+  Options opt = { RAYTRACER, 0, 1280, 720, "frame", "ppm", false, false, false, NULL };
+
+  for(int i = 1; i < argc; i++)
+  {
+    const char* arg = argv[i];
+    bool hasValue = i + 1 < argc;
+
+    if(strcmp(arg, "--headless") == 0 && hasValue) opt.frames = atoi(argv[++i]);
+    else if(strcmp(arg, "--mode") == 0 && hasValue) opt.mode = parse_mode(argv[++i]);
+    else if(strcmp(arg, "--width") == 0 && hasValue) opt.width = atoi(argv[++i]);
+    else if(strcmp(arg, "--height") == 0 && hasValue) opt.height = atoi(argv[++i]);
+    else if(strcmp(arg, "--out") == 0 && hasValue) opt.out = argv[++i];
+    else if(strcmp(arg, "--format") == 0 && hasValue) opt.format = argv[++i];
+    else if(strcmp(arg, "--orbit") == 0) opt.orbit = true;
+    else if(strcmp(arg, "--last-only") == 0) opt.lastOnly = true;
+    else if(strcmp(arg, "--device") == 0 && hasValue) gfx_select_device(argv[++i]);
+    else if(strcmp(arg, "--list-devices") == 0) opt.listDevices = true;
+    else if(strcmp(arg, "--profile") == 0) gfx_set_profiling(true);
+    else if(strcmp(arg, "--bounces") == 0 && hasValue) gfx_set_max_bounces(atoi(argv[++i]));
+    else if(strcmp(arg, "--buffer-textures") == 0) gfx_set_texture_images(false);
+    else if(strcmp(arg, "--level") == 0 && hasValue) s_levelPath = argv[++i];
+    else if(strcmp(arg, "--save-level") == 0 && hasValue) s_saveLevelPath = argv[++i];
+    else if(strcmp(arg, "--raster") == 0 && hasValue)
+      gfx_set_raster_mode(strcmp(argv[++i], "triangle") == 0 ? TRIANGLE_PARALLEL : TILE_PARALLEL);
+    else if(strcmp(arg, "--trace") == 0 && hasValue)
+    {
+      opt.trace = argv[++i];
+      gfx_set_profiling(true);
+    }
+    else printf("Unknown argument: %s\n", arg);
+  }
+
+  return opt;
+}
+
+static void load_scene(RenderMode mode)
+{
+  if(mode == RAYCASTER)
+  {
+    gfx_load_assets(textures, ARR_SIZE(textures), sprites, ARR_SIZE(sprites));
+    if(!gfx_load_level(s_levelPath)) exit(1);
+    if(s_saveLevelPath) gfx_save_level(s_saveLevelPath);
+  }
+  else if(mode == RASTERIZER)
+  {
+    gfx_load_model("res/bunny.obj", NULL, MatIdentity());
+    gfx_upload_models_data();
+  }
+}
+
+// Deterministic camera path so headless runs are reproducible
+static void place_camera(RenderMode mode, int frame, int frames, bool orbit)
+{
+  float t = orbit ? (float)frame / (float)frames : 0.0f;
+  float angle = t * 360.0f;
+
+  if(mode == RAYCASTER)
+  {
+    gfx_set_camera((Vec3){ 5.5f, 5.5f, 0.0f }, 180.0f + angle, 0.0f);
+    return;
+  }
+
+  float radius = 5.0f;
+  float rad = DegToRad(angle);
+  Vec3 pos = { -sinf(rad) * radius, 1.0f, cosf(rad) * radius };
+  gfx_set_camera(pos, angle - 90.0f, -10.0f);
+}
+
+static double now_ms(void)
+{
+  struct timespec ts;
+  timespec_get(&ts, TIME_UTC);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+static int run_headless(Options opt)
+{
+  gfx_init_headless(opt.mode, opt.width, opt.height);
+  load_scene(opt.mode);
+
+  char path[512];
+  double total = 0.0;
+
+  for(int frame = 0; frame < opt.frames; frame++)
+  {
+    // a fixed camera is placed once so the path tracer keeps accumulating
+    if(opt.orbit || frame == 0) place_camera(opt.mode, frame, opt.frames, opt.orbit);
+
+    double start = now_ms();
+    gfx_draw();
+    total += now_ms() - start;
+
+    if(!opt.lastOnly || frame == opt.frames - 1)
+    {
+      snprintf(path, sizeof(path), "%s_%04d.%s", opt.out, frame, opt.format);
+      if(!gfx_save_frame(path))
+      {
+        gfx_close();
+        return 1;
+      }
+    }
+  }
+
+  printf("%d frames, %.3f ms/frame\n", opt.frames, total / opt.frames);
+  gfx_print_profile();
+  if(opt.trace) gfx_export_trace(opt.trace);
+
+  gfx_close();
+  return 0;
+}
+
+int main(int argc, char** argv)
 {
-  gfx_init(RAYTRACER);
+  Options opt = parse_options(argc, argv);
 
-  /*gfx_load_assets(textures, ARR_SIZE(textures), sprites, ARR_SIZE(sprites), sprites_data, ARR_SIZE(sprites_data));*/
+  if(opt.listDevices)
+  {
+    gfx_list_devices();
+    return 0;
+  }
+
+  if(opt.frames > 0) return run_headless(opt);
+
+  gfx_init(opt.mode);
+
+  load_scene(opt.mode);
 
   while (!WindowShouldClose())
   {
     gfx_draw();
   }
 
+  if(opt.trace) gfx_export_trace(opt.trace);
+
   gfx_close();
 }
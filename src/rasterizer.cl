@@ -1,6 +1,8 @@
 
 typedef struct { uchar r, g, b, a; } Color;
 
+typedef struct Vec3 { float x, y, z; } Vec3;
+
 typedef struct Mat4 {
     float x0, x1, x2, x3;
     float y0, y1, y2, y3;
@@ -8,13 +10,6 @@ typedef struct Mat4 {
     float w0, w1, w2, w3;
 } Mat4;
 
-typedef struct {
-    float3 vertex[3];
-    float3 normal[3];
-    float2 uv[3];
-    int modelIdx;
-} Triangle;
-
 typedef struct {
     int triangleOffset;
     int triangleCount;
@@ -23,12 +18,46 @@ typedef struct {
     int pixelOffset;
     int texWidth;
     int texHeight;
-    Mat4 transform;
+    Vec3 boundsMin;
+    Vec3 boundsMax;
+    Vec3 sphereCenter;
+    float sphereRadius;
+    int mipLevels;
+    int atlasX, atlasY; // image path only
 } CustomModel;
 
+// Built with -D GABGFX_IMAGES when the device supports images: textures are then one
+// RGBA8 image2d_t atlas (see create_texture_image in gabgfx.c) instead of a buffer
+#ifdef GABGFX_IMAGES
+#define TEXTURES __read_only image2d_t
+__constant sampler_t nearestSampler = CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_CLAMP_TO_EDGE | CLK_FILTER_NEAREST;
+__constant sampler_t linearSampler = CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_CLAMP_TO_EDGE | CLK_FILTER_LINEAR;
+#else
+#define TEXTURES __global Color*
+#endif
+
+// Host frustum cull output; starts are exclusive prefix sums over the visible
+// instances and index the per-frame vertex and triangle streams
+typedef struct {
+    int instance;
+    int model;
+    int vertexStart;
+    int triangleStart;
+} VisibleInstance;
+
+// Depth is stored everywhere (depth buffer, Hi-Z) as an order-preserving uint key of the
+// float depth, so a plain unsigned compare or atomic_min does the depth test
+#define DEPTH_FAR 0xFFFFFFFFu
+
+inline uint depth_key(float depth)
+{
+    uint bits = as_uint(depth);
+    return (bits & 0x80000000u) ? ~bits : bits | 0x80000000u;
+}
+
 __kernel void clear_buffers(
     __global Color* pixels,
-    __global float* depth,
+    __global uint* depth,
     int width, int height,
     Color color)
 {
@@ -37,38 +66,88 @@ __kernel void clear_buffers(
     if (x >= width || y >= height) return;
     int idx = y * width + x;
     pixels[idx] = color;
-    depth[idx] = FLT_MAX;
+    depth[idx] = DEPTH_FAR;
+}
+
+// Index of the visible instance whose vertex (or triangle) range holds id
+inline int find_visible(__global const VisibleInstance* visible, int numVisible, int id, bool byTriangle)
+{
+  int lo = 0, hi = numVisible - 1;
+  while (lo < hi)
+  {
+    int mid = (lo + hi + 1) / 2;
+    int start = byTriangle ? visible[mid].triangleStart : visible[mid].vertexStart;
+    if (start <= id) lo = mid;
+    else hi = mid - 1;
+  }
+  return lo;
 }
 
+// Inverse of Vec3OctEncode in gabmath.h: 2x snorm16, x in the low half
+inline float3 oct_decode(uint packed)
+{
+    float2 f = (float2)((short)(packed & 0xFFFF), (short)(packed >> 16)) / 32767.0f;
+    float3 n = (float3)(f.x, f.y, 1.0f - fabs(f.x) - fabs(f.y));
+    float t = fmax(-n.z, 0.0f);
+    n.x += n.x >= 0.0f ? -t : t;
+    n.y += n.y >= 0.0f ? -t : t;
+    return normalize(n);
+}
+
+inline uint oct_encode(float3 n)
+{
+    n /= fabs(n.x) + fabs(n.y) + fabs(n.z);
+    float2 p = n.xy;
+    if (n.z < 0.0f)
+        p = (float2)((1.0f - fabs(n.y)) * (n.x >= 0.0f ? 1.0f : -1.0f),
+                     (1.0f - fabs(n.x)) * (n.y >= 0.0f ? 1.0f : -1.0f));
+    short2 q = convert_short2_sat_rte(p * 32767.0f);
+    return (uint)(ushort)q.x | ((uint)(ushort)q.y << 16);
+}
+
+// Screen-space x, y, depth plus clip w, the layout every later stage reads
+inline float4 project_vertex(float4 clip, int width, int height)
+{
+  float3 ndc = clip.xyz / clip.w;
+  return (float4)((ndc.x * 0.5f + 0.5f) * (float)width,
+                  (ndc.y * 0.5f + 0.5f) * (float)height,
+                  ndc.z * 0.5f + 0.5f,
+                  clip.w);
+}
+
+// One work-item per unique vertex of each visible instance. Writes the per-frame
+// streams every triangle of the instance reads from: projected and clip-space
+// position, world normal, uv and model index.
 __kernel void vertex_kernel(
-    __global Triangle* tris,
+    __global const float* positions,
     __global CustomModel* models,
-    int numModels,
-    int totalVerts,
+    int numVisible,
+    int visibleVerts,
     __global float4* projVerts,
     __global Mat4* projection,
     __global Mat4* view,
     __global float3* cameraPos,
     int width,
-    int height)
+    int height,
+    __global const VisibleInstance* visible,
+    __global float4* clipVerts,
+    __global const Mat4* instances,
+    __global const uint* meshNormals,
+    __global const uint* meshUVs,
+    __global uint* normals,
+    __global uint* uvs,
+    __global int* vertexModels)
 {
-  int i = get_global_id(0);
-  if (i >= totalVerts) return;
-
-  int triIdx = i / 3;
-  int vertIdx = i % 3;
+  int id = get_global_id(0);
+  if (id >= visibleVerts) return;
 
-  __global const Triangle* tri = &tris[triIdx];
-  __global const CustomModel* model = &models[tri->modelIdx];
+  int k = find_visible(visible, numVisible, id, false);
+  int modelIdx = visible[k].model;
+  int i = models[modelIdx].vertexOffset + id - visible[k].vertexStart;
 
-  float4 vert = (float4)(
-      tri->vertex[vertIdx].x,
-      tri->vertex[vertIdx].y,
-      tri->vertex[vertIdx].z,
-      1.0f
-  );
+  float4 vert = (float4)(vload3(i, positions), 1.0f);
 
-  Mat4 transform2 = model->transform;
+  Mat4 transform2 = instances[visible[k].instance];
   float4 v_model;
   v_model.x = vert.x * transform2.x0 + vert.y * transform2.x1 + vert.z * transform2.x2 + vert.w * transform2.x3;
   v_model.y = vert.x * transform2.y0 + vert.y * transform2.y1 + vert.z * transform2.y2 + vert.w * transform2.y3;
@@ -87,134 +166,709 @@ __kernel void vertex_kernel(
   v_clip.z = v_view.x * projection->z0 + v_view.y * projection->z1 + v_view.z * projection->z2 + v_view.w * projection->z3;
   v_clip.w = v_view.x * projection->w0 + v_view.y * projection->w1 + v_view.z * projection->w2 + v_view.w * projection->w3;
 
+  clipVerts[id] = v_clip;
+  projVerts[id] = project_vertex(v_clip, width, height);
+
+  // Rotation/scale part only; assumes uniform scale
+  float3 n = oct_decode(meshNormals[i]);
+  float3 worldNormal = (float3)(n.x * transform2.x0 + n.y * transform2.x1 + n.z * transform2.x2,
+                                n.x * transform2.y0 + n.y * transform2.y1 + n.z * transform2.y2,
+                                n.x * transform2.z0 + n.y * transform2.z1 + n.z * transform2.z2);
+  normals[id] = oct_encode(worldNormal);
+  uvs[id] = meshUVs[i];
+  vertexModels[id] = modelIdx;
+}
+
+inline float SignedTriangleArea(float2 a, float2 b, float2 c)
+{
+    return 0.5f * ((b.x - a.x)*(c.y - a.y) - (b.y - a.y)*(c.x - a.x));
+}
 
-  // --- Perspective divide ---
-  float ndc_x = v_clip.x / v_clip.w;
-  float ndc_y = v_clip.y / v_clip.w;
-  float ndc_z = v_clip.z / v_clip.w;
+// Mip levels follow level 0 back to back, each halved (min 1) per axis
+inline int mip_offset(int width, int height, int level)
+{
+  int offset = 0;
+  for (int i = 0; i < level; i++)
+  {
+    offset += width * height;
+    width = max(width >> 1, 1);
+    height = max(height >> 1, 1);
+  }
+  return offset;
+}
 
-  // --- NDC → screen space ---
-  float sx = (ndc_x * 0.5f + 0.5f) * (float)width;
-  float sy = (ndc_y * 0.5f + 0.5f) * (float)height;
-  float sz = ndc_z * 0.5f + 0.5f;
+inline float3 texel(__global const Color* texture, int width, int x, int y)
+{
+  Color c = texture[y * width + x];
+  return (float3)(c.r, c.g, c.b);
+}
+
+inline float3 sample_bilinear(__global const Color* texture, int width, int height, float2 uv)
+{
+  float x = uv.x * width - 0.5f;
+  float y = (1.0f - uv.y) * height - 0.5f;
+  float fx = floor(x), fy = floor(y);
+
+  int x0 = clamp((int)fx, 0, width - 1), x1 = clamp((int)fx + 1, 0, width - 1);
+  int y0 = clamp((int)fy, 0, height - 1), y1 = clamp((int)fy + 1, 0, height - 1);
 
-  projVerts[i] = (float4)(sx, sy, sz, v_clip.w);
+  return mix(mix(texel(texture, width, x0, y0), texel(texture, width, x1, y0), x - fx),
+             mix(texel(texture, width, x0, y1), texel(texture, width, x1, y1), x - fx),
+             y - fy);
 }
 
-inline float SignedTriangleArea(float2 a, float2 b, float2 c)
+// Nearest texel when magnified, trilinear between the two closest levels when
+// minified. lod is log2 of the screen footprint in level 0 texels. Returns 0..1.
+inline float3 sample_texture(__global const Color* texture, int texWidth, int texHeight, int mipLevels, float2 uv, float lod)
 {
-    return 0.5f * ((b.x - a.x)*(c.y - a.y) - (b.y - a.y)*(c.x - a.x));
+  uv.x = clamp(uv.x, 0.001f, 0.999f);
+  uv.y = clamp(uv.y, 0.001f, 0.999f);
+
+  if (lod <= 0.0f || mipLevels <= 1)
+  {
+    int u = (int)floor(uv.x * (texWidth - 1) + 0.5f);
+    int v = (int)floor((1.0f - uv.y) * (texHeight - 1) + 0.5f);
+    return texel(texture, texWidth, u, v) / 255.0f;
+  }
+
+  lod = fmin(lod, (float)(mipLevels - 1));
+  int l0 = (int)lod;
+  int l1 = min(l0 + 1, mipLevels - 1);
+
+  int w0 = max(texWidth >> l0, 1), h0 = max(texHeight >> l0, 1);
+  int w1 = max(texWidth >> l1, 1), h1 = max(texHeight >> l1, 1);
+
+  float3 c0 = sample_bilinear(texture + mip_offset(texWidth, texHeight, l0), w0, h0, uv);
+  float3 c1 = sample_bilinear(texture + mip_offset(texWidth, texHeight, l1), w1, h1, uv);
+  return mix(c0, c1, lod - l0) / 255.0f;
+}
+
+#ifdef GABGFX_IMAGES
+// Level 0 at the model's atlas origin, smaller levels stacked down its right
+inline int2 mip_origin(__global const CustomModel* model, int level)
+{
+  if (level == 0) return (int2)(model->atlasX, model->atlasY);
+
+  int y = model->atlasY;
+  for (int i = 1; i < level; i++) y += max(model->texHeight >> i, 1);
+  return (int2)(model->atlasX + model->texWidth, y);
+}
+
+// Hardware bilinear inside one level's rect; the clamp keeps the footprint off its neighbours
+inline float3 image_bilinear(TEXTURES textures, int2 origin, int width, int height, float2 uv)
+{
+  float2 p = clamp((float2)(uv.x * width, (1.0f - uv.y) * height), 0.5f, (float2)(width - 0.5f, height - 0.5f));
+  return read_imagef(textures, linearSampler, convert_float2(origin) + p).xyz;
 }
+#endif
 
-inline Color sample_texture(__global Color* texture, int texWidth, int texHeight, float2 uv)
+inline float3 sample_model_texture(TEXTURES textures, __global const CustomModel* model, float2 uv, float lod)
 {
+#ifdef GABGFX_IMAGES
+  int tw = model->texWidth, th = model->texHeight;
   uv.x = clamp(uv.x, 0.001f, 0.999f);
   uv.y = clamp(uv.y, 0.001f, 0.999f);
 
-  int u = (int)floor(uv.x * (texWidth - 1) + 0.5f);
-  int v = (int)floor((1.0f - uv.y) * (texHeight - 1) + 0.5f);
+  if (lod <= 0.0f || model->mipLevels <= 1)
+  {
+    int u = (int)floor(uv.x * (tw - 1) + 0.5f);
+    int v = (int)floor((1.0f - uv.y) * (th - 1) + 0.5f);
+    return read_imagef(textures, nearestSampler, mip_origin(model, 0) + (int2)(u, v)).xyz;
+  }
+
+  lod = fmin(lod, (float)(model->mipLevels - 1));
+  int l0 = (int)lod;
+  int l1 = min(l0 + 1, model->mipLevels - 1);
+
+  float3 c0 = image_bilinear(textures, mip_origin(model, l0), max(tw >> l0, 1), max(th >> l0, 1), uv);
+  float3 c1 = image_bilinear(textures, mip_origin(model, l1), max(tw >> l1, 1), max(th >> l1, 1), uv);
+  return mix(c0, c1, lod - l0);
+#else
+  return sample_texture(&textures[model->pixelOffset], model->texWidth, model->texHeight, model->mipLevels, uv, lod);
+#endif
+}
+
+// Perspective-weighted uv at barycentrics bary, with z the per-corner weights
+inline float2 interpolate_uv(float3 bary, float3 z, float2 uv0, float2 uv1, float2 uv2)
+{
+  float3 w = bary * z;
+  return (uv0 * w.x + uv1 * w.y + uv2 * w.z) / (w.x + w.y + w.z);
+}
+
+// New corner on edge a->b at parameter t. Interpolated in clip space, before the
+// divide, so attributes stay linear; written to the stream tail at dst.
+inline uint clip_vertex(
+    uint a, uint b, float t, uint dst,
+    __global const float4* clipVerts,
+    __global float4* projVerts,
+    __global uint* normals,
+    __global half* uvs,
+    __global int* vertexModels,
+    int width, int height)
+{
+    float4 clip = mix(clipVerts[a], clipVerts[b], t);
+    projVerts[dst] = project_vertex(clip, width, height);
+    normals[dst] = oct_encode(mix(oct_decode(normals[a]), oct_decode(normals[b]), t));
+    vstore_half2(mix(vload_half2(a, uvs), vload_half2(b, uvs), t), dst, uvs);
+    vertexModels[dst] = vertexModels[a];
+    return dst;
+}
+
+inline void emit_triangle(uint a, uint b, uint c,
+                          __global const float4* projVerts,
+                          __global uint* visibleIndices,
+                          __global int* clipCounts)
+{
+    float4 p0 = projVerts[a];
+    float4 p1 = projVerts[b];
+    float4 p2 = projVerts[c];
+
+    float area = (p1.x - p0.x) * (p2.y - p0.y)
+               - (p1.y - p0.y) * (p2.x - p0.x);
+    if (area <= 0.0f) return; // backface or degenerate
+
+    int slot = atomic_inc(&clipCounts[0]);
+    visibleIndices[slot * 3 + 0] = a;
+    visibleIndices[slot * 3 + 1] = b;
+    visibleIndices[slot * 3 + 2] = c;
+}
+
+// One work-item per triangle of a visible instance. Rejects triangles wholly outside one side
+// plane (x and y are left to the guard band: bin_kernel clamps to the screen),
+// splits triangles crossing the near plane and drops backfaces. Survivors go to
+// visibleIndices; clipCounts[0] is the visible triangle count and clipCounts[1]
+// the number of corners appended after visibleVerts (at most 2 per triangle).
+// Visible geometry has negative w here, so the near plane is w <= -nearPlane.
+__kernel void clip_kernel(
+    __global const CustomModel* models,
+    __global const float4* clipVerts,
+    __global float4* projVerts,
+    __global const uint* indices,
+    int numTriangles,
+    int visibleVerts,
+    float nearPlane,
+    int width,
+    int height,
+    __global uint* normals,
+    __global half* uvs,
+    __global int* vertexModels,
+    __global uint* visibleIndices,
+    __global int* clipCounts,
+    __global const VisibleInstance* visible,
+    int numVisible)
+{
+    int id = get_global_id(0);
+    if (id >= numTriangles) return;
+
+    int vm = find_visible(visible, numVisible, id, true);
+    __global const CustomModel* model = &models[visible[vm].model];
+    int triIdx = model->triangleOffset + id - visible[vm].triangleStart;
+
+    // mesh vertex index -> this instance's slot in the per-frame streams
+    uint rebase = visible[vm].vertexStart - model->vertexOffset;
+    uint idx[3] = { indices[triIdx * 3 + 0] + rebase, indices[triIdx * 3 + 1] + rebase, indices[triIdx * 3 + 2] + rebase };
+    float4 c0 = clipVerts[idx[0]];
+    float4 c1 = clipVerts[idx[1]];
+    float4 c2 = clipVerts[idx[2]];
+
+    if ((c0.x < c0.w && c1.x < c1.w && c2.x < c2.w) ||
+        (c0.x > -c0.w && c1.x > -c1.w && c2.x > -c2.w) ||
+        (c0.y < c0.w && c1.y < c1.w && c2.y < c2.w) ||
+        (c0.y > -c0.w && c1.y > -c1.w && c2.y > -c2.w))
+        return;
+
+    float d[3] = { -c0.w - nearPlane, -c1.w - nearPlane, -c2.w - nearPlane };
+    int insideMask = (d[0] >= 0.0f) | ((d[1] >= 0.0f) << 1) | ((d[2] >= 0.0f) << 2);
+
+    if (insideMask == 0) return;
+    if (insideMask == 7)
+    {
+        emit_triangle(idx[0], idx[1], idx[2], projVerts, visibleIndices, clipCounts);
+        return;
+    }
+
+    int insideCount = popcount(insideMask);
+
+    // Rotate so the lone inside (or lone outside) corner comes first; keeps winding
+    int k = 0;
+    for (int i = 0; i < 3; i++)
+        if (((insideMask >> i) & 1) == (insideCount == 1)) k = i;
+
+    uint a = idx[k], b = idx[(k + 1) % 3], c = idx[(k + 2) % 3];
+    float da = d[k], db = d[(k + 1) % 3], dc = d[(k + 2) % 3];
+
+    uint dst = visibleVerts + atomic_add(&clipCounts[1], 2);
+
+    if (insideCount == 1)
+    {
+        uint ab = clip_vertex(a, b, da / (da - db), dst,     clipVerts, projVerts, normals, uvs, vertexModels, width, height);
+        uint ac = clip_vertex(a, c, da / (da - dc), dst + 1, clipVerts, projVerts, normals, uvs, vertexModels, width, height);
+        emit_triangle(a, ab, ac, projVerts, visibleIndices, clipCounts);
+    }
+    else
+    {
+        // a is outside, b and c inside: quad b, c, ca, ab
+        uint ab = clip_vertex(b, a, db / (db - da), dst,     clipVerts, projVerts, normals, uvs, vertexModels, width, height);
+        uint ca = clip_vertex(c, a, dc / (dc - da), dst + 1, clipVerts, projVerts, normals, uvs, vertexModels, width, height);
+        emit_triangle(b, c, ca, projVerts, visibleIndices, clipCounts);
+        emit_triangle(b, ca, ab, projVerts, visibleIndices, clipCounts);
+    }
+}
 
-  return texture[v * texWidth + u];
+// Must match TILE_SIZE and HIZ_BLOCK in gabgfx.c
+#define TILE_SIZE 16
+#define TILE_BATCH (TILE_SIZE * TILE_SIZE)
+#define HIZ_BLOCK 4
+
+// Screen-space bounds and depth range of a visible triangle. Depth inside the
+// triangle is a barycentric blend of z0..z2, so the corner range bounds it.
+inline void triangle_bounds(
+    int triIdx,
+    __global const float4* projVerts,
+    __global const uint* indices,
+    float2* v, float4* bounds, uint* minDepth, uint* maxDepth)
+{
+    float4 pv0 = projVerts[indices[triIdx * 3 + 0]];
+    float4 pv1 = projVerts[indices[triIdx * 3 + 1]];
+    float4 pv2 = projVerts[indices[triIdx * 3 + 2]];
+
+    v[0] = (float2)(pv0.x, pv0.y);
+    v[1] = (float2)(pv1.x, pv1.y);
+    v[2] = (float2)(pv2.x, pv2.y);
+
+    *bounds = (float4)(fmin(pv0.x, fmin(pv1.x, pv2.x)), fmin(pv0.y, fmin(pv1.y, pv2.y)),
+                       fmax(pv0.x, fmax(pv1.x, pv2.x)), fmax(pv0.y, fmax(pv1.y, pv2.y)));
+
+    float z0 = pv0.z / pv0.w;
+    float z1 = pv1.z / pv1.w;
+    float z2 = pv2.z / pv2.w;
+    *minDepth = depth_key(fmin(z0, fmin(z1, z2)));
+    *maxDepth = depth_key(fmax(z0, fmax(z1, z2)));
 }
 
+inline bool covers_point(float2 P, const float2* v)
+{
+    return SignedTriangleArea(P, v[1], v[2]) >= 0.0f &&
+           SignedTriangleArea(P, v[2], v[0]) >= 0.0f &&
+           SignedTriangleArea(P, v[0], v[1]) >= 0.0f;
+}
+
+// Occluder pass over the clipped triangles, before binning. The Hi-Z buffer holds a
+// conservative farthest depth per tile (level 0) followed by one per HIZ_BLOCK x
+// HIZ_BLOCK tiles (level 1). A triangle covering every pixel center of a tile caps
+// that tile at its own farthest depth; entries only ever shrink, so any launch
+// order gives a bound that is never nearer than the real one.
+__kernel void hiz_kernel(
+    __global const float4* projVerts,
+    __global const int* clipCounts,
+    int width,
+    int height,
+    __global uint* hiZ,
+    __global const uint* indices)
+{
+    int triIdx = get_global_id(0);
+    if (triIdx >= clipCounts[0]) return;
+
+    float2 v[3];
+    float4 bounds;
+    uint minDepth, maxDepth;
+    triangle_bounds(triIdx, projVerts, indices, v, &bounds, &minDepth, &maxDepth);
+
+    // too small to cover a whole tile
+    if (bounds.z - bounds.x < TILE_SIZE - 1 || bounds.w - bounds.y < TILE_SIZE - 1) return;
+    if (bounds.z < 0.0f || bounds.w < 0.0f || bounds.x >= width || bounds.y >= height) return;
+
+    int tilesX = (width  + TILE_SIZE - 1) / TILE_SIZE;
+    int tilesY = (height + TILE_SIZE - 1) / TILE_SIZE;
+    int blocksX = (tilesX + HIZ_BLOCK - 1) / HIZ_BLOCK;
+    __global uint* blockZ = hiZ + tilesX * tilesY;
+
+    int tx0 = clamp((int)fmax(bounds.x, 0.0f) / TILE_SIZE, 0, tilesX - 1);
+    int ty0 = clamp((int)fmax(bounds.y, 0.0f) / TILE_SIZE, 0, tilesY - 1);
+    int tx1 = clamp((int)fmin(bounds.z, width  - 1.0f) / TILE_SIZE, 0, tilesX - 1);
+    int ty1 = clamp((int)fmin(bounds.w, height - 1.0f) / TILE_SIZE, 0, tilesY - 1);
+
+    for (int ty = ty0; ty <= ty1; ty++)
+    {
+        for (int tx = tx0; tx <= tx1; tx++)
+        {
+            // Corner pixel centers of the on-screen part of the tile; convexity covers the rest
+            float x0 = tx * TILE_SIZE + 0.5f;
+            float y0 = ty * TILE_SIZE + 0.5f;
+            float x1 = min(tx * TILE_SIZE + TILE_SIZE, width)  - 0.5f;
+            float y1 = min(ty * TILE_SIZE + TILE_SIZE, height) - 0.5f;
+
+            if (!covers_point((float2)(x0, y0), v) || !covers_point((float2)(x1, y0), v) ||
+                !covers_point((float2)(x0, y1), v) || !covers_point((float2)(x1, y1), v))
+                continue;
+
+            int tile = ty * tilesX + tx;
+            if (atomic_min(&hiZ[tile], maxDepth) <= maxDepth) continue;
+
+            // Children can only have shrunk since they were read, so the max stays conservative
+            int bx = tx / HIZ_BLOCK, by = ty / HIZ_BLOCK;
+            uint blockMax = 0;
+            for (int cy = by * HIZ_BLOCK; cy < min(by * HIZ_BLOCK + HIZ_BLOCK, tilesY); cy++)
+                for (int cx = bx * HIZ_BLOCK; cx < min(bx * HIZ_BLOCK + HIZ_BLOCK, tilesX); cx++)
+                    blockMax = max(blockMax, hiZ[cy * tilesX + cx]);
+            atomic_min(&blockZ[by * blocksX + bx], blockMax);
+        }
+    }
+}
+
+// Bins each clipped triangle into the tiles its bounds touch, skipping whole
+// HIZ_BLOCK blocks and then single tiles whose Hi-Z bound is nearer than the
+// triangle's nearest point. Ties are kept: the fragment depth test decides those.
+__kernel void bin_kernel(
+    __global float4* projVerts,
+    __global const int* clipCounts,
+    int width,
+    int height,
+    __global int* tileCounts,
+    __global int* tileTris,
+    int tileCapacity,
+    __global const uint* indices,
+    __global const uint* hiZ)
+{
+    int triIdx = get_global_id(0);
+    if (triIdx >= clipCounts[0]) return;
+
+    float2 v[3];
+    float4 bounds;
+    uint minDepth, maxDepth;
+    triangle_bounds(triIdx, projVerts, indices, v, &bounds, &minDepth, &maxDepth);
+
+    if (bounds.z < 0.0f || bounds.w < 0.0f || bounds.x >= width || bounds.y >= height) return;
+
+    int tilesX = (width  + TILE_SIZE - 1) / TILE_SIZE;
+    int tilesY = (height + TILE_SIZE - 1) / TILE_SIZE;
+    int blocksX = (tilesX + HIZ_BLOCK - 1) / HIZ_BLOCK;
+    __global const uint* blockZ = hiZ + tilesX * tilesY;
+
+    int tx0 = clamp((int)fmax(bounds.x, 0.0f) / TILE_SIZE, 0, tilesX - 1);
+    int ty0 = clamp((int)fmax(bounds.y, 0.0f) / TILE_SIZE, 0, tilesY - 1);
+    int tx1 = clamp((int)fmin(bounds.z, width  - 1.0f) / TILE_SIZE, 0, tilesX - 1);
+    int ty1 = clamp((int)fmin(bounds.w, height - 1.0f) / TILE_SIZE, 0, tilesY - 1);
+
+    for (int by = ty0 / HIZ_BLOCK; by <= ty1 / HIZ_BLOCK; by++)
+    {
+        for (int bx = tx0 / HIZ_BLOCK; bx <= tx1 / HIZ_BLOCK; bx++)
+        {
+            if (minDepth > blockZ[by * blocksX + bx]) continue;
+
+            for (int ty = max(ty0, by * HIZ_BLOCK); ty <= min(ty1, by * HIZ_BLOCK + HIZ_BLOCK - 1); ty++)
+            {
+                for (int tx = max(tx0, bx * HIZ_BLOCK); tx <= min(tx1, bx * HIZ_BLOCK + HIZ_BLOCK - 1); tx++)
+                {
+                    int tile = ty * tilesX + tx;
+                    if (minDepth > hiZ[tile]) continue;
+
+                    int slot = atomic_inc(&tileCounts[tile]);
+                    if (slot < tileCapacity)
+                        tileTris[tile * tileCapacity + slot] = triIdx;
+                }
+            }
+        }
+    }
+}
+
+inline void raster_triangle(
+    int triIdx,
+    float2 P,
+    __global float4* projVerts,
+    __global const uint* indices,
+    __global const uint* normals,
+    __global const half* uvs,
+    __global const int* vertexModels,
+    __global CustomModel* models,
+    TEXTURES textures,
+    float3 dirToLight,
+    uint* outDepth,
+    Color* outColor)
+{
+    uint i0 = indices[triIdx * 3 + 0];
+    uint i1 = indices[triIdx * 3 + 1];
+    uint i2 = indices[triIdx * 3 + 2];
+
+    float4 pv0 = projVerts[i0];
+    float4 pv1 = projVerts[i1];
+    float4 pv2 = projVerts[i2];
+
+    float z0 = pv0.z / pv0.w;
+    float z1 = pv1.z / pv1.w;
+    float z2 = pv2.z / pv2.w;
+
+    // Early depth rejection: the nearest corner is already behind this pixel
+    if (depth_key(fmin(z0, fmin(z1, z2))) >= *outDepth) return;
+
+    float2 v0 = (float2)(pv0.x, pv0.y);
+    float2 v1 = (float2)(pv1.x, pv1.y);
+    float2 v2 = (float2)(pv2.x, pv2.y);
+
+    float area = (v1.x - v0.x) * (v2.y - v0.y)
+               - (v1.y - v0.y) * (v2.x - v0.x);
+
+    if (area <= 0.0f) return;  // degenerate; backfaces are gone after clip_kernel
+
+    // area is twice the triangle's, so these sum to one
+    float halfArea = 0.5f * area;
+    float a = SignedTriangleArea(P, v1, v2) / halfArea;
+    float b = SignedTriangleArea(P, v2, v0) / halfArea;
+    float g = SignedTriangleArea(P, v0, v1) / halfArea;
+
+    if (a < 0 || b < 0 || g < 0) return;
+
+    float depth = a*z0 + b*z1 + g*z2;
+    uint key = depth_key(depth);
+
+    if (key >= *outDepth) return;
+
+    __global const CustomModel* model = &models[vertexModels[i0]];
+
+    float2 uv0 = vload_half2(i0, uvs);
+    float2 uv1 = vload_half2(i1, uvs);
+    float2 uv2 = vload_half2(i2, uvs);
+
+    float3 bary = (float3)(a, b, g);
+    float3 z = (float3)(z0, z1, z2);
+    float2 uv = interpolate_uv(bary, z, uv0, uv1, uv2);
+
+    float3 norm0 = oct_decode(normals[i0]);
+    float3 norm1 = oct_decode(normals[i1]);
+    float3 norm2 = oct_decode(normals[i2]);
+    float3 norm = normalize((norm0*(a*z0) + norm1*(b*z1) + norm2*(g*z2)) / depth);
+
+    int tw = model->texWidth;
+    int th = model->texHeight;
+
+    float3 texColor;
+    if (tw > 0 && th > 0) {
+        // Barycentrics are affine in screen space, so one pixel step is a constant offset
+        float3 dBdx = (float3)(v1.y - v2.y, v2.y - v0.y, v0.y - v1.y) / area;
+        float3 dBdy = (float3)(v2.x - v1.x, v0.x - v2.x, v1.x - v0.x) / area;
+        float2 texSize = (float2)(tw, th);
+        float2 dx = (interpolate_uv(bary + dBdx, z, uv0, uv1, uv2) - uv) * texSize;
+        float2 dy = (interpolate_uv(bary + dBdy, z, uv0, uv1, uv2) - uv) * texSize;
+        float lod = 0.5f * log2(fmax(dot(dx, dx), dot(dy, dy)));
+
+        texColor = sample_model_texture(textures, model, uv, lod);
+    } else {
+        texColor = (float3)(0.8f, 0.8f, 0.8f);
+    }
+
+    float light_intensity = fmax(0.1f, dot(norm, dirToLight));
+    float3 finalColor = texColor * light_intensity;
+
+    *outColor = (Color){
+        (uchar)(finalColor.x * 255),
+        (uchar)(finalColor.y * 255),
+        (uchar)(finalColor.z * 255),
+        255
+    };
+    *outDepth = key;
+}
+
+// One work-group per screen tile. The tile's triangle list is staged through
+// local memory in batches; tiles whose list overflowed tileCapacity fall back
+// to testing every triangle so nothing is dropped.
 __kernel void fragment_kernel(
     __global Color* pixels,
     __global float4* projVerts,
     int width,
     int height,
-    __global float* depthBuffer,
+    __global uint* depthBuffer,
     __global float3* cameraPos,
-    __global Triangle* tris2,
+    __global const uint* normals,
     __global CustomModel* models,
-    int numModels, 
-    __global Color* textures)
+    __global const int* clipCounts,
+    TEXTURES textures,
+    __global int* tileCounts,
+    __global int* tileTris,
+    int tileCapacity,
+    __global const uint* indices,
+    __global const half* uvs,
+    __global const int* vertexModels)
 {
+    __local int batch[TILE_BATCH];
+
     int x = get_global_id(0);
     int y = get_global_id(1);
-    if (x >= width || y >= height) return;
+    bool inside = x < width && y < height;
+
+    int tile = get_group_id(1) * get_num_groups(0) + get_group_id(0);
+    int lid  = get_local_id(1) * TILE_SIZE + get_local_id(0);
 
     int idx = y * width + x;
     float2 P = (float2)(x + 0.5f, y + 0.5f); // pixel center
 
     float3 dirToLight = normalize((float3){5.0f, 5.0f, 0.0f});
 
-    for (int modelidx = 0; modelidx < numModels; modelidx++)
+    uint depth = inside ? depthBuffer[idx] : 0;
+    Color color = inside ? pixels[idx] : (Color){0,0,0,0};
+    bool written = false;
+
+    int count = tileCounts[tile];
+    bool overflow = count > tileCapacity;
+    int listCount = overflow ? clipCounts[0] : count;
+
+    for (int base = 0; base < listCount; base += TILE_BATCH)
     {
-        __global const CustomModel* model = &models[modelidx];
+        int n = min(TILE_BATCH, listCount - base);
+
+        if (lid < n)
+            batch[lid] = overflow ? base + lid : tileTris[tile * tileCapacity + base + lid];
+        barrier(CLK_LOCAL_MEM_FENCE);
 
-        for (int triIdx = model->triangleOffset;
-             triIdx < model->triangleOffset + model->triangleCount;
-             triIdx++)
+        if (inside)
         {
-            float4 pv0 = projVerts[triIdx * 3 + 0];
-            float4 pv1 = projVerts[triIdx * 3 + 1];
-            float4 pv2 = projVerts[triIdx * 3 + 2];
+            for (int i = 0; i < n; i++)
+            {
+                uint prevDepth = depth;
+                raster_triangle(batch[i], P, projVerts, indices, normals, uvs, vertexModels, models, textures,
+                                dirToLight, &depth, &color);
+                written |= depth != prevDepth;
+            }
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
 
-            if (pv0.w >= 0 || pv1.w >= 0 || pv2.w >= 0)
-                continue; // discard whole triangle
+    if (inside && written && atomic_min(&depthBuffer[idx], depth) > depth)
+        pixels[idx] = color;
+}
 
-            float2 v0 = (float2)(pv0.x, pv0.y);
-            float2 v1 = (float2)(pv1.x, pv1.y);
-            float2 v2 = (float2)(pv2.x, pv2.y);
+inline uint pack_color(Color c)
+{
+    return (uint)c.r | ((uint)c.g << 8) | ((uint)c.b << 16) | ((uint)c.a << 24);
+}
 
-            float area = (v1.x - v0.x) * (v2.y - v0.y)
-                       - (v1.y - v0.y) * (v2.x - v0.x);
+// Triangle-parallel path: depth key in the high half, packed color in the low half,
+// so one 64-bit atomic min resolves depth and color together
+__kernel void resolve_kernel(
+    __global const ulong* depthColor,
+    __global Color* pixels,
+    int width,
+    int height)
+{
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+    if (x >= width || y >= height) return;
 
-            if (area <= 0.0f) continue;  // Cull triangle
+    int idx = y * width + x;
+    uint c = (uint)depthColor[idx];
+    pixels[idx] = (Color){ c & 0xFF, (c >> 8) & 0xFF, (c >> 16) & 0xFF, c >> 24 };
+}
 
-            float a = SignedTriangleArea(P, v1, v2) / area;
-            float b = SignedTriangleArea(P, v2, v0) / area;
-            float g = SignedTriangleArea(P, v0, v1) / area;
+#ifdef cl_khr_int64_extended_atomics
+#pragma OPENCL EXTENSION cl_khr_int64_extended_atomics : enable
 
-            if (a >= 0 && b >= 0 && g >= 0)
-            {
-                float z0 = pv0.z / pv0.w;
-                float z1 = pv1.z / pv1.w;
-                float z2 = pv2.z / pv2.w;
-                float depth = a*z0 + b*z1 + g*z2;
+// Must match RASTER_GROUP in gabgfx.c
+#define RASTER_GROUP 64
 
-                if (depth < depthBuffer[idx])
-                {
-                    __global const Triangle* t = &tris2[triIdx];
-
-                    float2 uv0 = (float2){t->uv[0].x,t->uv[0].y};
-                    float2 uv1 = (float2){t->uv[1].x,t->uv[1].y};
-                    float2 uv2 = (float2){t->uv[2].x,t->uv[2].y};
-
-                    float2 uv = (uv0 * (a * z0) +
-                                 uv1 * (b * z1) +
-                                 uv2 * (g * z2)) / depth;
-
-                    float3 norm0 = (float3){t->normal[0].x,t->normal[0].y,t->normal[0].z};
-                    float3 norm1 = (float3){t->normal[1].x,t->normal[1].y,t->normal[1].z};
-                    float3 norm2 = (float3){t->normal[2].x,t->normal[2].y,t->normal[2].z};
-                    float3 norm = normalize((norm0*(a*z0) + norm1*(b*z1) + norm2*(g*z2)) / depth);
-
-                    int texOffset = model->pixelOffset;
-                    int tw = model->texWidth;
-                    int th = model->texHeight;
-
-                    float3 texColor;
-                    if (tw > 0 && th > 0) {
-                        Color texel = sample_texture(&textures[texOffset], tw, th, uv);
-                        texColor = (float3){texel.r, texel.g, texel.b} / 255.0f;
-                    } else {
-                        texColor = (float3)(0.8f, 0.8f, 0.8f);
-                    }
-                
-                    float light_intensity = fmax(0.1f, dot(norm, dirToLight));
-                    float3 finalColor = texColor * light_intensity;
-
-                    pixels[idx] = (Color){
-                        (uchar)(finalColor.x * 255),
-                        (uchar)(finalColor.y * 255),
-                        (uchar)(finalColor.z * 255),
-                        255
-                    };
-
-                    depthBuffer[idx] = depth;
-                }
+inline void raster_pixel(
+    int triIdx, int x, int y, int width,
+    __global ulong* depthColor,
+    __global float4* projVerts,
+    __global const uint* indices,
+    __global const uint* normals,
+    __global const half* uvs,
+    __global const int* vertexModels,
+    __global CustomModel* models,
+    TEXTURES textures,
+    float3 dirToLight)
+{
+    int idx = y * width + x;
+    uint prevDepth = (uint)(depthColor[idx] >> 32);
+    uint depth = prevDepth;
+    Color color;
+
+    raster_triangle(triIdx, (float2)(x + 0.5f, y + 0.5f), projVerts, indices, normals, uvs, vertexModels,
+                    models, textures, dirToLight, &depth, &color);
+
+    if (depth != prevDepth)
+        atom_min(&depthColor[idx], ((ulong)depth << 32) | pack_color(color));
+}
+
+// True when every tile under rect has a Hi-Z bound strictly nearer than minDepth
+inline bool hiz_occluded(__global const uint* hiZ, int tilesX, int4 rect, uint minDepth)
+{
+    for (int ty = rect.y / TILE_SIZE; ty <= rect.w / TILE_SIZE; ty++)
+        for (int tx = rect.x / TILE_SIZE; tx <= rect.z / TILE_SIZE; tx++)
+            if (minDepth <= hiZ[ty * tilesX + tx]) return false;
+    return true;
+}
+
+// One work-group per RASTER_GROUP clipped triangles. Each work-item sets up one
+// triangle; those covering at most RASTER_GROUP pixel centers are walked by that
+// work-item alone, larger ones are queued in local memory and walked by the whole
+// group. Cost follows triangle count and covered area, not screen size.
+__kernel void triangle_kernel(
+    __global ulong* depthColor,
+    __global float4* projVerts,
+    int width,
+    int height,
+    __global const uint* normals,
+    __global CustomModel* models,
+    __global const int* clipCounts,
+    TEXTURES textures,
+    __global const uint* indices,
+    __global const half* uvs,
+    __global const int* vertexModels,
+    __global const uint* hiZ)
+{
+    __local int bigTris[RASTER_GROUP];
+    __local int4 bigRects[RASTER_GROUP];
+    __local int bigCount;
+
+    int triIdx = get_global_id(0);
+    int lid = get_local_id(0);
+    int tilesX = (width + TILE_SIZE - 1) / TILE_SIZE;
+
+    float3 dirToLight = normalize((float3){5.0f, 5.0f, 0.0f});
+
+    if (lid == 0) bigCount = 0;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if (triIdx < clipCounts[0])
+    {
+        float2 v[3];
+        float4 bounds;
+        uint minDepth, maxDepth;
+        triangle_bounds(triIdx, projVerts, indices, v, &bounds, &minDepth, &maxDepth);
+
+        // Pixels whose centers fall inside the bounds, clamped to the screen
+        int4 rect = (int4)(max((int)ceil(bounds.x - 0.5f), 0),
+                           max((int)ceil(bounds.y - 0.5f), 0),
+                           min((int)floor(bounds.z - 0.5f), width - 1),
+                           min((int)floor(bounds.w - 0.5f), height - 1));
+
+        if (rect.x <= rect.z && rect.y <= rect.w && !hiz_occluded(hiZ, tilesX, rect, minDepth))
+        {
+            if ((rect.z - rect.x + 1) * (rect.w - rect.y + 1) <= RASTER_GROUP)
+            {
+                for (int y = rect.y; y <= rect.w; y++)
+                    for (int x = rect.x; x <= rect.z; x++)
+                        raster_pixel(triIdx, x, y, width, depthColor, projVerts, indices, normals, uvs,
+                                     vertexModels, models, textures, dirToLight);
+            }
+            else
+            {
+                int slot = atomic_inc(&bigCount);
+                bigTris[slot] = triIdx;
+                bigRects[slot] = rect;
             }
         }
     }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (int i = 0; i < bigCount; i++)
+    {
+        int4 rect = bigRects[i];
+        int w = rect.z - rect.x + 1;
+        int n = w * (rect.w - rect.y + 1);
+
+        for (int p = lid; p < n; p += RASTER_GROUP)
+            raster_pixel(bigTris[i], rect.x + p % w, rect.y + p / w, width, depthColor, projVerts, indices,
+                         normals, uvs, vertexModels, models, textures, dirToLight);
+    }
 }
+#endif
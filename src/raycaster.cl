@@ -13,30 +13,153 @@ typedef struct SpriteData {
 
 typedef struct { float x, y; float dirX, dirY; float planeX, planeY; } Player;
 typedef struct { uchar r,g,b,a; } Color;
-typedef struct Sprite { int offset; int width; int height; } Sprite;
+typedef struct Sprite { int offset; int width; int height; int mipLevels; int atlasX; int atlasY; } Sprite;
+
+// Textures and sprites share one square atlas packed by pack_texture_atlas in gabgfx.c;
+// each Sprite is its rect there. Built with -D GABGFX_IMAGES when the device supports
+// images, the atlas is an RGBA8 image2d_t, otherwise a row-major buffer atlas_width wide.
+#ifdef GABGFX_IMAGES
+#define TEXTURES __read_only image2d_t
+__constant sampler_t nearestSampler = CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_CLAMP_TO_EDGE | CLK_FILTER_NEAREST;
+__constant sampler_t linearSampler = CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_CLAMP_TO_EDGE | CLK_FILTER_LINEAR;
+#else
+#define TEXTURES __global Color*
+#endif
+
+// Level 0 at the sprite's atlas origin, smaller levels stacked down its right
+inline int2 mip_origin(Sprite s, int level)
+{
+    if(level == 0) return (int2)(s.atlasX, s.atlasY);
+
+    int y = s.atlasY;
+    for(int i = 1; i < level; i++) y += max(s.height >> i, 1);
+    return (int2)(s.atlasX + s.width, y);
+}
+
+inline float4 color_to_float4(Color c)
+{
+    return (float4)(c.r, c.g, c.b, c.a);
+}
+
+// Texel (x, y) of one level, clamped to it
+inline Color level_texel(TEXTURES atlas, int atlas_width, Sprite s, int level, int x, int y)
+{
+    int w = max(s.width >> level, 1);
+    int h = max(s.height >> level, 1);
+    x = clamp(x, 0, w - 1);
+    y = clamp(y, 0, h - 1);
+#ifdef GABGFX_IMAGES
+    uchar4 c = convert_uchar4_sat_rte(read_imagef(atlas, nearestSampler, mip_origin(s, level) + (int2)(x, y)) * 255.0f);
+    return (Color){ c.x, c.y, c.z, c.w };
+#else
+    int2 origin = mip_origin(s, level);
+    return atlas[(origin.y + y) * atlas_width + origin.x + x];
+#endif
+}
 
 inline Color sample_color(
-    __global Color* atlas,
+    TEXTURES atlas,
+    int atlas_width,
     __global Sprite* sprites,
     int sprite_id,
     int x, int y)
+{
+    return level_texel(atlas, atlas_width, sprites[sprite_id], 0, x, y);
+}
+
+// Bilinear inside one level, 0..255 per channel
+inline float4 level_bilinear(TEXTURES atlas, int atlas_width, Sprite s, int level, float u, float v)
+{
+    int w = max(s.width >> level, 1);
+    int h = max(s.height >> level, 1);
+#ifdef GABGFX_IMAGES
+    // the clamp keeps the filter footprint off neighbouring levels and textures
+    float2 p = clamp((float2)(u * w, v * h), 0.5f, (float2)(w - 0.5f, h - 0.5f));
+    return read_imagef(atlas, linearSampler, convert_float2(mip_origin(s, level)) + p) * 255.0f;
+#else
+    float x = u * w - 0.5f, y = v * h - 0.5f;
+    float fx = floor(x), fy = floor(y);
+    int x0 = (int)fx, y0 = (int)fy;
+
+    return mix(mix(color_to_float4(level_texel(atlas, atlas_width, s, level, x0, y0)), color_to_float4(level_texel(atlas, atlas_width, s, level, x0 + 1, y0)), x - fx),
+               mix(color_to_float4(level_texel(atlas, atlas_width, s, level, x0, y0 + 1)), color_to_float4(level_texel(atlas, atlas_width, s, level, x0 + 1, y0 + 1)), x - fx),
+               y - fy);
+#endif
+}
+
+// texX/texY are level 0 texels; lod is log2 of level 0 texels per screen pixel.
+// Magnified surfaces keep the nearest texel, minified ones blend the two closest levels.
+inline Color sample_trilinear(
+    TEXTURES atlas,
+    int atlas_width,
+    __global Sprite* sprites,
+    int sprite_id,
+    int texX, int texY,
+    float lod)
 {
     Sprite s = sprites[sprite_id];
-    x = clamp(x, 0, s.width - 1);
-    y = clamp(y, 0, s.height - 1);
-    return atlas[s.offset + y * s.width + x];
+    if(lod <= 0.0f || s.mipLevels <= 1) return level_texel(atlas, atlas_width, s, 0, texX, texY);
+
+    float u = (clamp(texX, 0, s.width - 1) + 0.5f) / s.width;
+    float v = (clamp(texY, 0, s.height - 1) + 0.5f) / s.height;
+
+    lod = fmin(lod, (float)(s.mipLevels - 1));
+    int l0 = (int)lod;
+    int l1 = min(l0 + 1, s.mipLevels - 1);
+
+    float4 c = mix(level_bilinear(atlas, atlas_width, s, l0, u, v), level_bilinear(atlas, atlas_width, s, l1, u, v), lod - l0);
+    return (Color){ (uchar)(c.x + 0.5f), (uchar)(c.y + 0.5f), (uchar)(c.z + 0.5f), (uchar)(c.w + 0.5f) };
 }
 
-__kernel void surface_kernel(
-    __global Color* framebuffer,
+// Nearest texel from the closest level, so alpha-tested sprites keep hard edges
+inline Color sample_nearest_mip(
+    TEXTURES atlas,
+    int atlas_width,
+    __global Sprite* sprites,
+    int sprite_id,
+    int texX, int texY,
+    float lod)
+{
+    Sprite s = sprites[sprite_id];
+    int level = clamp((int)(lod + 0.5f), 0, max(s.mipLevels - 1, 0));
+    return level_texel(atlas, atlas_width, s, level, texX >> level, texY >> level);
+}
+
+// Wall hit of one screen column, shared by every pixel of it; see WALL_COLUMN_SIZE in gabgfx.c
+typedef struct {
+    float perpWallDist;
+    int lineHeight;
+    int drawStart, drawEnd;
+    int texture, texX;
+    int side;
+} WallColumn;
+
+// Occupancy pyramid over the map, built by build_occupancy in gabgfx.c: level L >= 1
+// has one byte per 2^L x 2^L block, nonzero when any cell in it is a wall or lies
+// outside the map. Levels are stored back to back starting with level 1;
+// layout[L - 1] holds that level's byte offset and width.
+inline bool block_empty(__global uchar* occupancy, __constant int2* layout, int level, int mapX, int mapY)
+{
+    int2 l = layout[level - 1];
+    return occupancy[l.x + (mapY >> level) * l.y + (mapX >> level)] == 0;
+}
+
+// Column pass: one DDA per screen column. Empty cells climb the occupancy pyramid
+// and the ray jumps straight to the first cell past the largest empty block, with
+// sideDist kept exactly as unit steps would leave it.
+__kernel void wall_columns_kernel(
+    __global WallColumn* columns,
     __global float* depthbuffer,
     int screen_width,
     int screen_height,
     __global Player* player,
     __global uchar* map_data,
-    int map_size,
-    __global Color* texture_atlas,
-    __global Sprite* sprites)
+    int map_width,
+    int map_height,
+    __global Sprite* sprites,
+    __global uchar* occupancy,
+    int occupancy_levels,
+    __constant int2* occupancy_layout)
 {
     int x = get_global_id(0);
     if(x >= screen_width) return;
@@ -62,6 +185,7 @@ __kernel void surface_kernel(
     int hit = 0;
     int side = 0;
     int wall_id = 0;
+    int level = 0; // largest empty block around the previous cell
 
     while(!hit)
     {
@@ -78,10 +202,41 @@ __kernel void surface_kernel(
             side = 1;
         }
 
-        if(mapX < 0 || mapY < 0 || mapX >= map_size || mapY >= map_size) break;
+        if(mapX < 0 || mapY < 0 || mapX >= map_width || mapY >= map_height) break;
 
-        wall_id = map_data[mapY * map_size + mapX];
-        if(wall_id > 0) hit = 1;
+        wall_id = map_data[mapY * map_width + mapX];
+        if(wall_id > 0)
+        {
+            hit = 1;
+            break;
+        }
+
+        // Empty levels around a cell are always 1..n, so start from the last cell's
+        // level: drop while the block is occupied, then climb while the parent is empty
+        while(level > 0 && !block_empty(occupancy, occupancy_layout, level, mapX, mapY)) level--;
+        while(level < occupancy_levels && block_empty(occupancy, occupancy_layout, level + 1, mapX, mapY)) level++;
+        if(level == 0) continue;
+
+        // Leave the block through whichever side the ray reaches first; the loop's
+        // next step then enters the cell beyond it
+        int size = 1 << level;
+        int minX = (mapX >> level) << level;
+        int minY = (mapY >> level) << level;
+        float exitX = ((rayDirX < 0) ? p.x - minX : minX + size - p.x) * deltaDistX;
+        float exitY = ((rayDirY < 0) ? p.y - minY : minY + size - p.y) * deltaDistY;
+
+        if(exitX < exitY)
+        {
+            mapX = (rayDirX < 0) ? minX : minX + size - 1;
+            mapY = clamp((int)floor(p.y + exitX * rayDirY), minY, minY + size - 1);
+        }
+        else
+        {
+            mapY = (rayDirY < 0) ? minY : minY + size - 1;
+            mapX = clamp((int)floor(p.x + exitY * rayDirX), minX, minX + size - 1);
+        }
+        sideDistX = (rayDirX < 0) ? (p.x - mapX) * deltaDistX : (mapX + 1.0f - p.x) * deltaDistX;
+        sideDistY = (rayDirY < 0) ? (p.y - mapY) * deltaDistY : (mapY + 1.0f - p.y) * deltaDistY;
     }
 
     float perpWallDist = (side == 0)
@@ -90,107 +245,208 @@ __kernel void surface_kernel(
     perpWallDist = fmax(perpWallDist, 0.01f);
 
     int lineHeight = (int)(screen_height / perpWallDist);
-    int drawStart = max(-lineHeight / 2 + screen_height / 2, 0);
-    int drawEnd   = min(lineHeight / 2 + screen_height / 2, screen_height - 1);
-
-    int floor_tex = 1;
-    int ceiling_tex = 0;
 
-    for(int y = 0; y < screen_height; y++)
+    int tex_id;
+    switch(wall_id)
     {
-        int idx = y * screen_width + x;
+        case 1: tex_id = 2; break;
+        case 2: tex_id = 3; break;
+        case 3: tex_id = 4; break;
+        case 4: tex_id = 5; break;
+        case 5: tex_id = 6; break;
+        default: tex_id = 2; break;
+    }
 
-        if(y < drawStart)
-        {
-            // Ceiling
-            float rowDist = screen_height / (2.0f * y - screen_height);
-            float worldX = p.x + (-rayDirX) * rowDist;
-            float worldY = p.y + (-rayDirY) * rowDist;
-
-            Sprite s = sprites[ceiling_tex];
-            int texX = (int)((worldX - floor(worldX)) * s.width);
-            int texY = (int)((worldY - floor(worldY)) * s.height);
-            framebuffer[idx] = sample_color(texture_atlas, sprites, ceiling_tex, texX, texY);
-        }
-        else if(y > drawEnd)
-        {
-            // Floor
-            float rowDist = screen_height / (2.0f * y - screen_height);
-            float worldX = p.x + rayDirX * rowDist;
-            float worldY = p.y + rayDirY * rowDist;
-
-            Sprite s = sprites[floor_tex];
-            int texX = (int)((worldX - floor(worldX)) * s.width);
-            int texY = (int)((worldY - floor(worldY)) * s.height);
-            framebuffer[idx] = sample_color(texture_atlas, sprites, floor_tex, texX, texY);
-        }
-        else
-        {
-            // Wall
-            int tex_id;
-            switch(wall_id)
-            {
-                case 1: tex_id = 2; break;
-                case 2: tex_id = 3; break;
-                case 3: tex_id = 4; break;
-                case 4: tex_id = 5; break;
-                case 5: tex_id = 6; break;
-                default: tex_id = 2; break;
-            }
+    float wallX = (side == 0)
+        ? p.y + perpWallDist * rayDirY
+        : p.x + perpWallDist * rayDirX;
+    wallX -= floor(wallX);
+
+    int texWidth = sprites[tex_id].width;
+    int texX = (int)(wallX * texWidth);
+    if(side == 0 && rayDirX > 0) texX = texWidth - texX - 1;
+    if(side == 1 && rayDirY < 0) texX = texWidth - texX - 1;
+
+    columns[x] = (WallColumn){
+        perpWallDist,
+        lineHeight,
+        max(-lineHeight / 2 + screen_height / 2, 0),
+        min(lineHeight / 2 + screen_height / 2, screen_height - 1),
+        tex_id, texX,
+        side
+    };
+    depthbuffer[x] = perpWallDist;
+}
 
-            float wallX = (side == 0)
-                ? p.y + perpWallDist * rayDirY
-                : p.x + perpWallDist * rayDirX;
-            wallX -= floor(wallX);
+// Pixel pass: one work-item per pixel, x fastest so rows are written contiguously
+__kernel void surface_kernel(
+    __global Color* framebuffer,
+    __global WallColumn* columns,
+    int screen_width,
+    int screen_height,
+    __global Player* player,
+    TEXTURES texture_atlas,
+    __global Sprite* sprites,
+    int atlas_width)
+{
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+    if(x >= screen_width || y >= screen_height) return;
 
-            Sprite s = sprites[tex_id];
-            int texX = (int)(wallX * s.width);
-            if(side == 0 && rayDirX > 0) texX = s.width - texX - 1;
-            if(side == 1 && rayDirY < 0) texX = s.width - texX - 1;
+    int idx = y * screen_width + x;
+    WallColumn col = columns[x];
 
-            int d = y * 256 - screen_height * 128 + lineHeight * 128;
-            int texY = ((d * s.height) / lineHeight) / 256;
+    if(y >= col.drawStart && y <= col.drawEnd)
+    {
+        // Wall
+        Sprite s = sprites[col.texture];
+
+        int d = y * 256 - screen_height * 128 + col.lineHeight * 128;
+        int texY = ((d * s.height) / col.lineHeight) / 256;
+
+        Color output = sample_trilinear(texture_atlas, atlas_width, sprites, col.texture, col.texX, texY, log2((float)s.height / col.lineHeight));
 
-            Color output = sample_color(texture_atlas, sprites, tex_id, texX, texY); 
-            
-            framebuffer[idx] = (side == 1) ? (Color){(output.r >> 1) & 8355711,
+        framebuffer[idx] = (col.side == 1) ? (Color){(output.r >> 1) & 8355711,
                                                      (output.g >> 1) & 8355711,
                                                      (output.b >> 1) & 8355711,
                                                       255} : output;
+        return;
+    }
+
+    // Floor below the wall, ceiling above it, mirrored through the view direction
+    Player p = player[0];
+
+    float cameraX = 2.0f * x / (float)screen_width - 1.0f;
+    float rayDirX = p.dirX + p.planeX * cameraX;
+    float rayDirY = p.dirY + p.planeY * cameraX;
+
+    bool ceiling = y < col.drawStart;
+    int tex_id = ceiling ? 0 : 1;
+    float sign = ceiling ? -1.0f : 1.0f;
 
-            depthbuffer[x] = perpWallDist;
+    float rowDist = screen_height / (2.0f * y - screen_height);
+    float worldX = p.x + sign * rayDirX * rowDist;
+    float worldY = p.y + sign * rayDirY * rowDist;
+
+    Sprite s = sprites[tex_id];
+    int texX = (int)((worldX - floor(worldX)) * s.width);
+    int texY = (int)((worldY - floor(worldY)) * s.height);
+
+    // Footprint per pixel in world units: across the row, and along the view
+    // direction (d rowDist / dy)
+    float planeLen = length((float2)(p.planeX, p.planeY));
+    float footprint = fmax(2.0f * planeLen * rowDist / screen_width, 2.0f * rowDist * rowDist / screen_height);
+    framebuffer[idx] = sample_trilinear(texture_atlas, atlas_width, sprites, tex_id, texX, texY, log2(footprint * s.width));
+}
+
+// Fraction of the segment (x, y) + t * (dx, dy), t in 0..1, travelled before it enters
+// a solid or out-of-map cell; 1 when the whole segment is clear. Same DDA as wall_columns_kernel.
+inline float segment_hit(__global uchar* map_data, int map_width, int map_height, float x, float y, float dx, float dy)
+{
+    int mapX = (int)floor(x);
+    int mapY = (int)floor(y);
+    int endX = (int)floor(x + dx);
+    int endY = (int)floor(y + dy);
+
+    int stepX = dx < 0.0f ? -1 : 1;
+    int stepY = dy < 0.0f ? -1 : 1;
+    float deltaDistX = dx == 0.0f ? 1e30f : fabs(1.0f / dx);
+    float deltaDistY = dy == 0.0f ? 1e30f : fabs(1.0f / dy);
+    float sideDistX = (dx < 0.0f ? x - mapX : mapX + 1.0f - x) * deltaDistX;
+    float sideDistY = (dy < 0.0f ? y - mapY : mapY + 1.0f - y) * deltaDistY;
+
+    while (mapX != endX || mapY != endY)
+    {
+        float t;
+        if (sideDistX < sideDistY)
+        {
+            t = sideDistX;
+            sideDistX += deltaDistX;
+            mapX += stepX;
+        }
+        else
+        {
+            t = sideDistY;
+            sideDistY += deltaDistY;
+            mapY += stepY;
         }
+        if (t > 1.0f) break;
+
+        if (mapX < 0 || mapY < 0 || mapX >= map_width || mapY >= map_height) return t;
+        if (map_data[mapY * map_width + mapX] > 0) return t;
     }
+    return 1.0f;
 }
 
-__kernel void sprites_kernel(
-    __global Color* framebuffer,
-    __global float* depthbuffer,
-    int screen_width,
-    int screen_height,
-    __global Player* player,
-    __global SpriteData* spritesData,
-    __global int* spriteOrder,
+// Advances every sprite by dt from the previous state into the next one, so the
+// render kernels always see one consistent snapshot. Projectiles are destroyed at
+// the first wall on their path; other moving entities stop in front of it.
+__kernel void simulate_sprites_kernel(
+    __global const SpriteData* in,
+    __global SpriteData* out,
     int numSprites,
-    __global Color* texture_atlas,
-    __global Sprite* sprites,
-    int frameID)
+    __global uchar* map_data,
+    int map_width,
+    int map_height,
+    float dt)
 {
-    int stripe = get_global_id(0);
-    if (stripe >= screen_width) return;
+    int i = get_global_id(0);
+    if (i >= numSprites) return;
 
-    Player p = player[0];
+    SpriteData sd = in[i];
+    float dx = sd.vx * dt;
+    float dy = sd.vy * dt;
 
-    // World space sprites
-    for (int i = 0; i < numSprites; i++)
+    if (!sd.is_destroyed && !sd.is_ui && (dx != 0.0f || dy != 0.0f))
     {
-        int s = spriteOrder[i]; // indeks w spritesData
+        float t = segment_hit(map_data, map_width, map_height, sd.x, sd.y, dx, dy);
+        if (t < 1.0f)
+        {
+            if (sd.is_projectile) sd.is_destroyed = 1;
+            sd.vx = 0.0f;
+            sd.vy = 0.0f;
+            t = fmax(t - 1e-3f / length((float2)(dx, dy)), 0.0f); // stay out of the wall cell
+        }
+
+        sd.x += dx * t;
+        sd.y += dy * t;
+    }
+
+    out[i] = sd;
+}
+
+// Must match SPRITE_SORT_GROUP in gabgfx.c
+#define SPRITE_SORT_GROUP 128
+#define SPRITE_CULLED 0xFFFFFFFFu // sort key of culled sprites and padding, sorts last
 
-        if (s < 0 || s >= numSprites) continue;
+// A sprite that survived culling, projected to the screen
+typedef struct {
+    int startX, endX; // covered columns, clamped to the screen, inclusive
+    int startY, endY;
+    int left, size;   // unclamped left column and side in pixels
+    float depth;      // distance along the view direction
+    int texture;
+} VisibleSprite;
 
-        SpriteData sd = spritesData[s];
+// One work-item per sort slot (numSprites padded to a power of two). Visible sprites
+// get key ~depth bits, so an ascending sort draws them far to near; the rest sort last.
+__kernel void project_sprites_kernel(
+    __global Player* player,
+    __global SpriteData* spritesData,
+    int numSprites,
+    int screen_width,
+    int screen_height,
+    __global VisibleSprite* projected,
+    __global uint2* sortKeys,
+    __global uint* visibleCount)
+{
+    int i = get_global_id(0);
+    uint2 key = (uint2)(SPRITE_CULLED, i);
 
-        if (sd.is_destroyed || sd.is_ui) continue;
+    if (i < numSprites)
+    {
+        Player p = player[0];
+        SpriteData sd = spritesData[i];
 
         float spriteX = sd.x - p.x;
         float spriteY = sd.y - p.y;
@@ -199,42 +455,191 @@ __kernel void sprites_kernel(
         float transformX = invDet * (p.dirY * spriteX - p.dirX * spriteY);
         float transformY = invDet * (-p.planeY * spriteX + p.planeX * spriteY);
 
-        if (transformY <= 0 || transformY >= depthbuffer[stripe])
-            continue;
+        if (!sd.is_destroyed && !sd.is_ui && sd.texture >= 0 && transformY > 0.0f)
+        {
+            int spriteScreenX = (int)((screen_width / 2.0f) * (1 + transformX / transformY));
+            int spriteHeight  = abs((int)(screen_height / transformY));
+            int drawStartX    = -spriteHeight / 2 + spriteScreenX;
+            int drawEndX      = spriteHeight / 2 + spriteScreenX;
+
+            if (drawEndX >= 0 && drawStartX < screen_width)
+            {
+                projected[i] = (VisibleSprite){
+                    max(drawStartX, 0), min(drawEndX, screen_width - 1),
+                    max(-spriteHeight / 2 + screen_height / 2, 0),
+                    min(spriteHeight / 2 + screen_height / 2, screen_height - 1),
+                    drawStartX, spriteHeight,
+                    transformY, sd.texture
+                };
+                key.x = ~as_uint(transformY);
+                atomic_inc(visibleCount);
+            }
+        }
+    }
+
+    sortKeys[i] = key;
+}
+
+// Index breaks key ties so the order is the same every frame
+inline bool sort_greater(uint2 a, uint2 b)
+{
+    return a.x > b.x || (a.x == b.x && a.y > b.y);
+}
+
+inline void sort_compare(__global uint2* keys, int i, int j, int k)
+{
+    int partner = i ^ j;
+    if (partner <= i) return;
+
+    uint2 a = keys[i];
+    uint2 b = keys[partner];
+    if (sort_greater(a, b) == ((i & k) == 0))
+    {
+        keys[i] = b;
+        keys[partner] = a;
+    }
+}
+
+// Bitonic steps with j < SPRITE_SORT_GROUP stay inside one work-group. k == 0 sorts
+// each block from scratch; otherwise finishes merge stage k after its wider steps.
+__kernel void sort_sprites_local_kernel(__global uint2* keys, int k)
+{
+    __local uint2 block[SPRITE_SORT_GROUP];
+    int gid = get_global_id(0);
+    int lid = get_local_id(0);
+
+    block[lid] = keys[gid];
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    int first = k ? k : 2;
+    int last  = k ? k : SPRITE_SORT_GROUP;
+    for (int size = first; size <= last; size <<= 1)
+    {
+        for (int j = min(size, SPRITE_SORT_GROUP) >> 1; j > 0; j >>= 1)
+        {
+            int partner = lid ^ j;
+            if (partner > lid)
+            {
+                uint2 a = block[lid];
+                uint2 b = block[partner];
+                if (sort_greater(a, b) == ((gid & size) == 0))
+                {
+                    block[lid] = b;
+                    block[partner] = a;
+                }
+            }
+            barrier(CLK_LOCAL_MEM_FENCE);
+        }
+    }
+
+    keys[gid] = block[lid];
+}
+
+// One bitonic step whose partners are at least SPRITE_SORT_GROUP apart
+__kernel void sort_sprites_step_kernel(__global uint2* keys, int j, int k)
+{
+    sort_compare(keys, get_global_id(0), j, k);
+}
+
+// Gathers the visible sprites, now first in the sorted keys, into draw order
+__kernel void compact_sprites_kernel(
+    __global uint2* sortKeys,
+    __global VisibleSprite* projected,
+    __global VisibleSprite* visible,
+    __global uint* visibleCount)
+{
+    uint i = get_global_id(0);
+    if (i >= visibleCount[0]) return;
+
+    visible[i] = projected[sortKeys[i].y];
+}
+
+// Must match SPRITE_TILE_WIDTH in gabgfx.c
+#define SPRITE_TILE_WIDTH 64
 
-        int spriteScreenX = (int)((screen_width / 2.0f) * (1 + transformX / transformY));
-        int spriteHeight   = abs((int)(screen_height / transformY));
-        int drawStartY     = max(-spriteHeight / 2 + screen_height / 2, 0);
-        int drawEndY       = min(spriteHeight / 2 + screen_height / 2, screen_height - 1);
+// One work-group per SPRITE_TILE_WIDTH columns. The group walks the far to near
+// visible list a chunk at a time and bins the sprites whose startX..endX overlaps
+// its columns into local memory, keeping their order with a prefix sum over the
+// chunk; each column then merges only that tile's short list.
+__kernel void sprites_kernel(
+    __global Color* framebuffer,
+    __global float* depthbuffer,
+    int screen_width,
+    int screen_height,
+    __global VisibleSprite* visible,
+    __global uint* visibleCount,
+    TEXTURES texture_atlas,
+    __global Sprite* sprites,
+    int frameID,
+    int atlas_width)
+{
+    __local VisibleSprite tile[SPRITE_TILE_WIDTH];
+    __local int slots[SPRITE_TILE_WIDTH];
 
-        int spriteWidth = spriteHeight;
-        int drawStartX  = -spriteWidth / 2 + spriteScreenX;
-        int drawEndX    = spriteWidth / 2 + spriteScreenX;
+    int stripe = get_global_id(0);
+    int lid = get_local_id(0);
+    int tileStart = get_group_id(0) * SPRITE_TILE_WIDTH;
+    int tileEnd = min(tileStart + SPRITE_TILE_WIDTH, screen_width) - 1;
 
-        if (stripe < drawStartX || stripe > drawEndX) continue;
+    // columns past the screen edge still take part in the barriers below
+    bool onScreen = stripe < screen_width;
+    float wallDepth = onScreen ? depthbuffer[stripe] : 0.0f;
+    uint count = visibleCount[0];
 
-        int texId = sd.texture;
-        if (texId < 0) continue;
+    for (uint base = 0; base < count; base += SPRITE_TILE_WIDTH)
+    {
+        VisibleSprite vs;
+        int keep = 0;
+        if (base + lid < count)
+        {
+            vs = visible[base + lid];
+            keep = vs.endX >= tileStart && vs.startX <= tileEnd;
+        }
 
-        Sprite spr = sprites[texId];
+        slots[lid] = keep;
+        barrier(CLK_LOCAL_MEM_FENCE);
 
-        int texX = (int)(
-            256 * (stripe - (-spriteWidth / 2 + spriteScreenX))
-            * spr.width / spriteWidth) / 256;
+        for (int offset = 1; offset < SPRITE_TILE_WIDTH; offset <<= 1)
+        {
+            int add = lid >= offset ? slots[lid - offset] : 0;
+            barrier(CLK_LOCAL_MEM_FENCE);
+            slots[lid] += add;
+            barrier(CLK_LOCAL_MEM_FENCE);
+        }
+
+        if (keep) tile[slots[lid] - 1] = vs;
+        int binned = slots[SPRITE_TILE_WIDTH - 1];
+        barrier(CLK_LOCAL_MEM_FENCE);
 
-        for (int y = drawStartY; y < drawEndY; y++)
+        for (int i = 0; onScreen && i < binned; i++)
         {
-            int d = y * 256 - screen_height * 128 + spriteHeight * 128;
-            int texY = ((d * spr.height) / spriteHeight) / 256;
-            texY = spr.height - texY - 1;
+            VisibleSprite ts = tile[i];
+            if (stripe < ts.startX || stripe > ts.endX || ts.depth >= wallDepth) continue;
+
+            Sprite spr = sprites[ts.texture];
+
+            int texX = (int)(256 * (stripe - ts.left) * spr.width / ts.size) / 256;
+            float lod = log2((float)spr.height / max(ts.size, 1));
 
-            Color c = sample_color(texture_atlas, sprites, texId, texX, texY);
+            for (int y = ts.startY; y < ts.endY; y++)
+            {
+                int d = y * 256 - screen_height * 128 + ts.size * 128;
+                int texY = ((d * spr.height) / ts.size) / 256;
+                texY = spr.height - texY - 1;
+
+                Color c = sample_nearest_mip(texture_atlas, atlas_width, sprites, ts.texture, texX, texY, lod);
 
-            if (c.a > 0)
-                framebuffer[y * screen_width + stripe] = c;
+                if (c.a > 0)
+                    framebuffer[y * screen_width + stripe] = c;
+            }
         }
+
+        // the next chunk overwrites tile and slots
+        barrier(CLK_LOCAL_MEM_FENCE);
     }
 
+    if (!onScreen) return;
+
     // Shotgun animation
     int texId = frameID;
     int uiW   = 400;
@@ -254,7 +659,7 @@ __kernel void sprites_kernel(
 
       texY = spr.height - texY - 1;
 
-      Color c = sample_color(texture_atlas, sprites, texId, texX, texY);
+      Color c = sample_color(texture_atlas, atlas_width, sprites, texId, texX, texY);
 
       if (c.a > 0) framebuffer[y * screen_width + stripe] = c;
     }
@@ -3,14 +3,17 @@ typedef struct { uchar r,g,b,a; } Color;
 
 typedef struct { float m[4][4]; } Mat4;
 
+typedef struct Vec2 { float x,y; } Vec2;
 typedef struct Vec3 { float x,y,z; } Vec3;
 typedef struct Vec4 { float x,y,z,w; } Vec4;
 
+// Packed like the host struct (Vec3 is 12 bytes, float3 would be 16); 112 bytes
 typedef struct {
-    float3 vertex[3];
-    float3 normal[3];
-    float2 uv[3];
+    Vec3 vertex[3];
+    Vec3 normal[3];
+    Vec2 uv[3];
     int modelIdx;
+    int pad[3];
 } Triangle;
 
 typedef struct {
@@ -21,7 +24,12 @@ typedef struct {
     int pixelOffset;
     int texWidth;
     int texHeight;
-    Mat4 transform;
+    Vec3 boundsMin;
+    Vec3 boundsMax;
+    Vec3 sphereCenter;
+    float sphereRadius;
+    int mipLevels;
+    int atlasX, atlasY;
 } CustomModel;
 
 typedef struct {
@@ -39,7 +47,31 @@ typedef struct {
   CustomMaterial material;
 } Sphere;
 
+typedef struct {
+  Vec3 min; int leftFirst;
+  Vec3 max; int count;
+} BVHNode;
+
+typedef struct {
+  Mat4 transform;
+  Mat4 inverse;
+  int blasRoot;
+  int pixelOffset;
+  int texWidth;
+  int texHeight;
+  CustomMaterial material;
+} MeshInstance;
+
+typedef struct {
+  int instance;
+  int triangle;
+  float u, v;
+} MeshHit;
+
 #define PI 3.14159265359f
+#define MISS 1e30f
+// Must be >= BVH_MAX_DEPTH in gabbvh.h
+#define BVH_STACK_SIZE 48
 
 inline float4 mul_mat4_vec4(Mat4 m, float4 v)
 {
@@ -196,20 +228,380 @@ inline float GGX_PDF(float3 N, float3 L, float roughness,float3 rayDir)
     return (D * NdotH) / max(4.0f * VdotH, 0.001f);
 }
 
-__kernel void fragment_kernel(
-    __global Color* frameBuffer,
-    __global float* depthBuffer,
+inline float intersect_aabb(float3 rayOrigin, float3 invDir, Vec3 bmin, Vec3 bmax, float tmax)
+{
+    float3 t0 = ((float3)(bmin.x, bmin.y, bmin.z) - rayOrigin) * invDir;
+    float3 t1 = ((float3)(bmax.x, bmax.y, bmax.z) - rayOrigin) * invDir;
+    float3 tsmall = fmin(t0, t1);
+    float3 tbig   = fmax(t0, t1);
+    float tnear = fmax(fmax(tsmall.x, tsmall.y), tsmall.z);
+    float tfar  = fmin(fmin(tbig.x, tbig.y), tbig.z);
+    return (tfar >= tnear && tfar > 0.0f && tnear < tmax) ? tnear : MISS;
+}
+
+inline float intersect_sphere(__global const Sphere* sphere, float3 rayOrigin, float3 rayDir)
+{
+    float3 oc = rayOrigin - (float3)(sphere->pos.x, sphere->pos.y, sphere->pos.z);
+    float b = 2.0f * dot(oc, rayDir);
+    float c = dot(oc, oc) - sphere->radius * sphere->radius;
+    float disc = b*b - 4.0f*c;
+    if (disc < 0.0f) return MISS;
+
+    float t = (-b - sqrt(disc)) * 0.5f;
+    return t > 0.001f ? t : MISS;
+}
+
+inline float3 to_float3(Vec3 v)
+{
+    return (float3)(v.x, v.y, v.z);
+}
+
+inline float axis3(float3 v, int axis)
+{
+    return axis == 0 ? v.x : (axis == 1 ? v.y : v.z);
+}
+
+// Watertight ray/triangle test (Woop, Benthin, Wald 2013): shared edges are
+// never missed or hit twice. u and v are the barycentric weights of B and C.
+inline float intersect_triangle(
+    float3 A, float3 B, float3 C,
+    float3 rayOrigin,
+    int kx, int ky, int kz,
+    float Sx, float Sy, float Sz,
+    float tmax,
+    float* u, float* v)
+{
+    A -= rayOrigin;
+    B -= rayOrigin;
+    C -= rayOrigin;
+
+    float Ax = axis3(A, kx) - Sx * axis3(A, kz);
+    float Ay = axis3(A, ky) - Sy * axis3(A, kz);
+    float Bx = axis3(B, kx) - Sx * axis3(B, kz);
+    float By = axis3(B, ky) - Sy * axis3(B, kz);
+    float Cx = axis3(C, kx) - Sx * axis3(C, kz);
+    float Cy = axis3(C, ky) - Sy * axis3(C, kz);
+
+    float U = Cx * By - Cy * Bx;
+    float V = Ax * Cy - Ay * Cx;
+    float W = Bx * Ay - By * Ax;
+
+    if ((U < 0.0f || V < 0.0f || W < 0.0f) && (U > 0.0f || V > 0.0f || W > 0.0f))
+        return MISS;
+
+    float det = U + V + W;
+    if (det == 0.0f) return MISS;
+
+    float Az = Sz * axis3(A, kz);
+    float Bz = Sz * axis3(B, kz);
+    float Cz = Sz * axis3(C, kz);
+    float T = U * Az + V * Bz + W * Cz;
+
+    float rcpDet = 1.0f / det;
+    float t = T * rcpDet;
+    if (t <= 0.001f || t >= tmax) return MISS;
+
+    *u = V * rcpDet;
+    *v = W * rcpDet;
+    return t;
+}
+
+// Ordered short-stack traversal shared by the sphere BVH, the TLAS and every BLAS:
+// nearer child first, far children are only revisited if they can still beat the
+// closest hit found so far. bvh_next_leaf hands back one leaf at a time so each
+// caller only supplies its own primitive test.
+typedef struct {
+    int   stackNode[BVH_STACK_SIZE];
+    float stackDist[BVH_STACK_SIZE];
+    int sp;
+    int next; // node to descend from, -1 to pop
+} BVHWalk;
+
+inline void bvh_walk_begin(BVHWalk* walk, __global const BVHNode* nodes, int root, float3 rayOrigin, float3 invDir, float hitDistance)
+{
+    walk->sp = 0;
+    walk->next = intersect_aabb(rayOrigin, invDir, nodes[root].min, nodes[root].max, hitDistance) == MISS ? -1 : root;
+}
+
+// Returns the next leaf the ray may reach before hitDistance, or -1 when done
+inline int bvh_next_leaf(BVHWalk* walk, __global const BVHNode* nodes, float3 rayOrigin, float3 invDir, float hitDistance, BVHNode* leaf)
+{
+    int nodeIdx = walk->next;
+
+    while (true)
+    {
+        if (nodeIdx < 0)
+        {
+            // pop the next subtree that is still closer than the current hit
+            while (walk->sp > 0)
+            {
+                walk->sp--;
+                if (walk->stackDist[walk->sp] < hitDistance)
+                {
+                    nodeIdx = walk->stackNode[walk->sp];
+                    break;
+                }
+            }
+            if (nodeIdx < 0) return -1;
+        }
+
+        BVHNode node = nodes[nodeIdx];
+        if (node.count > 0)
+        {
+            walk->next = -1;
+            *leaf = node;
+            return nodeIdx;
+        }
+
+        int near = node.leftFirst;
+        int far  = node.leftFirst + 1;
+        float dNear = intersect_aabb(rayOrigin, invDir, nodes[near].min, nodes[near].max, hitDistance);
+        float dFar  = intersect_aabb(rayOrigin, invDir, nodes[far].min, nodes[far].max, hitDistance);
+
+        if (dFar < dNear)
+        {
+            int ti = near; near = far; far = ti;
+            float td = dNear; dNear = dFar; dFar = td;
+        }
+
+        nodeIdx = -1;
+        if (dNear != MISS)
+        {
+            if (dFar != MISS && walk->sp < BVH_STACK_SIZE)
+            {
+                walk->stackNode[walk->sp] = far;
+                walk->stackDist[walk->sp] = dFar;
+                walk->sp++;
+            }
+            nodeIdx = near;
+        }
+    }
+}
+
+inline int trace_spheres(
+    __global const BVHNode* nodes,
+    __global const int* primIndices,
+    __global const Sphere* spheres,
+    uint spheres_count,
+    float3 rayOrigin,
+    float3 rayDir,
+    float* hitDistance)
+{
+    int closestIndex = -1;
+    *hitDistance = MISS;
+    if (spheres_count == 0) return -1;
+
+    float3 invDir = 1.0f / rayDir;
+
+    BVHWalk walk;
+    BVHNode leaf;
+    bvh_walk_begin(&walk, nodes, 0, rayOrigin, invDir, *hitDistance);
+
+    while (bvh_next_leaf(&walk, nodes, rayOrigin, invDir, *hitDistance, &leaf) >= 0)
+    {
+        for (int i = 0; i < leaf.count; i++)
+        {
+            int prim = primIndices[leaf.leftFirst + i];
+            float t = intersect_sphere(&spheres[prim], rayOrigin, rayDir);
+            if (t < *hitDistance)
+            {
+                *hitDistance = t;
+                closestIndex = prim;
+            }
+        }
+    }
+
+    return closestIndex;
+}
+
+// Object-space traversal of one mesh BLAS. rayDir is not normalized, so t
+// stays comparable with the world-space hitDistance.
+inline void trace_blas(
+    __global const BVHNode* nodes,
+    __global const int* triIndices,
+    __global const Triangle* tris,
+    int root,
+    float3 rayOrigin,
+    float3 rayDir,
+    int instance,
+    float* hitDistance,
+    MeshHit* hit)
+{
+    float3 invDir = 1.0f / rayDir;
+    float3 absDir = fabs(rayDir);
+
+    int kz = (absDir.x > absDir.y) ? ((absDir.x > absDir.z) ? 0 : 2) : ((absDir.y > absDir.z) ? 1 : 2);
+    int kx = (kz + 1) % 3;
+    int ky = (kx + 1) % 3;
+    if (axis3(rayDir, kz) < 0.0f) { int tmp = kx; kx = ky; ky = tmp; }
+
+    float Sz = 1.0f / axis3(rayDir, kz);
+    float Sx = axis3(rayDir, kx) * Sz;
+    float Sy = axis3(rayDir, ky) * Sz;
+
+    BVHWalk walk;
+    BVHNode leaf;
+    bvh_walk_begin(&walk, nodes, root, rayOrigin, invDir, *hitDistance);
+
+    while (bvh_next_leaf(&walk, nodes, rayOrigin, invDir, *hitDistance, &leaf) >= 0)
+    {
+        for (int i = 0; i < leaf.count; i++)
+        {
+            int triIdx = triIndices[leaf.leftFirst + i];
+            __global const Triangle* tri = &tris[triIdx];
+            float u, v;
+            float t = intersect_triangle(to_float3(tri->vertex[0]),
+                                         to_float3(tri->vertex[1]),
+                                         to_float3(tri->vertex[2]),
+                                         rayOrigin, kx, ky, kz, Sx, Sy, Sz,
+                                         *hitDistance, &u, &v);
+            if (t < *hitDistance)
+            {
+                *hitDistance = t;
+                hit->instance = instance;
+                hit->triangle = triIdx;
+                hit->u = u;
+                hit->v = v;
+            }
+        }
+    }
+}
+
+// Two-level traversal: the TLAS holds world-space instance bounds, each leaf
+// instance moves the ray into object space and walks its (possibly shared) BLAS.
+inline bool trace_meshes(
+    __global const BVHNode* tlasNodes,
+    __global const int* tlasIndices,
+    __global const MeshInstance* instances,
+    uint instanceCount,
+    __global const BVHNode* blasNodes,
+    __global const int* blasIndices,
+    __global const Triangle* tris,
+    float3 rayOrigin,
+    float3 rayDir,
+    float* hitDistance,
+    MeshHit* hit)
+{
+    hit->instance = -1;
+    if (instanceCount == 0) return false;
+
+    float3 invDir = 1.0f / rayDir;
+
+    BVHWalk walk;
+    BVHNode leaf;
+    bvh_walk_begin(&walk, tlasNodes, 0, rayOrigin, invDir, *hitDistance);
+
+    while (bvh_next_leaf(&walk, tlasNodes, rayOrigin, invDir, *hitDistance, &leaf) >= 0)
+    {
+        for (int i = 0; i < leaf.count; i++)
+        {
+            int inst = tlasIndices[leaf.leftFirst + i];
+            Mat4 inv = instances[inst].inverse;
+            float3 localOrigin = mul_mat4_vec4(inv, (float4)(rayOrigin, 1.0f)).xyz;
+            float3 localDir    = mul_mat4_vec4(inv, (float4)(rayDir, 0.0f)).xyz;
+            trace_blas(blasNodes, blasIndices, tris, instances[inst].blasRoot,
+                       localOrigin, localDir, inst, hitDistance, hit);
+        }
+    }
+
+    return hit->instance >= 0;
+}
+
+inline float3 sample_texture(__global const Color* texture, int texWidth, int texHeight, float2 uv)
+{
+  uv.x = uv.x - floor(uv.x);
+  uv.y = uv.y - floor(uv.y);
+
+  int u = (int)floor(uv.x * (texWidth - 1) + 0.5f);
+  int v = (int)floor((1.0f - uv.y) * (texHeight - 1) + 0.5f);
+
+  Color c = texture[v * texWidth + u];
+  return (float3)(c.r, c.g, c.b) / 255.0f;
+}
+
+// Resolves a mesh hit into a world-space shading normal and material
+inline void shade_mesh_hit(
+    MeshHit hit,
+    __global const MeshInstance* instances,
+    __global const Triangle* tris,
+    __global const Color* textures,
+    float3 rayDir,
+    float3* normal,
+    CustomMaterial* material)
+{
+    __global const MeshInstance* inst = &instances[hit.instance];
+    __global const Triangle* tri = &tris[hit.triangle];
+
+    float w = 1.0f - hit.u - hit.v;
+
+    float3 n = to_float3(tri->normal[0]) * w
+             + to_float3(tri->normal[1]) * hit.u
+             + to_float3(tri->normal[2]) * hit.v;
+
+    if (dot(n, n) < 1e-12f)
+        n = cross(to_float3(tri->vertex[1]) - to_float3(tri->vertex[0]),
+                  to_float3(tri->vertex[2]) - to_float3(tri->vertex[0]));
+
+    // normals go through the inverse transpose
+    Mat4 inv = inst->inverse;
+    float3 worldN = (float3)(
+        inv.m[0][0]*n.x + inv.m[1][0]*n.y + inv.m[2][0]*n.z,
+        inv.m[0][1]*n.x + inv.m[1][1]*n.y + inv.m[2][1]*n.z,
+        inv.m[0][2]*n.x + inv.m[1][2]*n.y + inv.m[2][2]*n.z
+    );
+    *normal = normalize(worldN);
+
+    *material = inst->material;
+
+    // opaque surfaces are shaded from whichever side the ray arrived
+    if (material->Translucent <= 0.99f && dot(*normal, rayDir) > 0.0f)
+        *normal = -*normal;
+
+    if (inst->texWidth > 0 && inst->texHeight > 0)
+    {
+        float2 uv = (float2)(tri->uv[0].x, tri->uv[0].y) * w
+                  + (float2)(tri->uv[1].x, tri->uv[1].y) * hit.u
+                  + (float2)(tri->uv[2].x, tri->uv[2].y) * hit.v;
+
+        float3 texColor = sample_texture(&textures[inst->pixelOffset], inst->texWidth, inst->texHeight, uv);
+        material->Albedo.x *= texColor.x;
+        material->Albedo.y *= texColor.y;
+        material->Albedo.z *= texColor.z;
+    }
+}
+
+// Wavefront path tracing: generate -> (extend -> classify -> shade per material)
+// x bounces -> accumulate. Each stage is its own kernel so lanes run the same code;
+// shade appends surviving paths to the next queue, so dead paths never occupy SIMD
+// lanes in later bounces.
+
+// 64 bytes
+typedef struct {
+  float4 origin;
+  float4 direction;
+  float4 throughput;
+  int pixel;
+  uint seed;
+  int pad0, pad1;
+} PathState;
+
+// 32 bytes. sphere and mesh.instance are both -1 on a miss
+typedef struct {
+  float t;
+  int sphere;
+  MeshHit mesh;
+  int pad0, pad1;
+} PathHit;
+
+__kernel void generate_kernel(
+    __global PathState* paths,
+    __global float4* radiance,
     int width,
     int height,
-    __global Mat4* projection,
     __global Mat4* inverseProjection,
-    __global Mat4* view,
     __global Mat4* inverseView,
     __global float3* cameraPos,
-    __global Sphere* spheres,
-    uint spheres_count,
-    uint frameIndex,
-    __global float4* accumulationBuffer)
+    uint frameIndex)
 {
   int x = get_global_id(0);
   int y = get_global_id(1);
@@ -217,9 +609,6 @@ __kernel void fragment_kernel(
 
   uint idx = y * width + x;
 
-  uint seed = idx;
-  seed *= frameIndex;
-
   float x_ndc = (2.0f * ((float)x + 0.5f) / width) - 1.0f;
   float y_ndc = 1.0f - (2.0f * ((float)y + 0.5f) / height);
 
@@ -230,163 +619,205 @@ __kernel void fragment_kernel(
 
   float3 ray_view = normalize(viewPos.xyz);
   float3 rayDir = normalize(mul_mat4_vec4(*inverseView, (float4)(ray_view, 0.0f)).xyz);
-  float3 rayOrigin = *cameraPos;
 
-  float3 color = (float3)(0.0f);
-  float3 throughput = (float3)(1.0f);
+  PathState path;
+  path.origin = (float4)(*cameraPos, 0.0f);
+  path.direction = (float4)(rayDir, 0.0f);
+  path.throughput = (float4)(1.0f);
+  path.pixel = idx;
+  path.seed = idx * frameIndex;
 
-  float3 lightDir = normalize((float3)(-1.0f, -1.0f, -1.0f));
+  paths[idx] = path;
+  radiance[idx] = (float4)(0.0f);
+}
 
-  for (uint bounce = 0; bounce < 5; ++bounce)
-  {
-    seed += bounce;
-    // find closest sphere
-    int closestIndex = -1;
-    float hitDistance = 1e30f;
+__kernel void extend_kernel(
+    __global const PathState* paths,
+    __global const int* queueCounts,
+    int queue,
+    __global PathHit* hits,
+    __global Sphere* spheres,
+    uint spheres_count,
+    __global BVHNode* bvhNodes,
+    __global int* bvhIndices,
+    __global Triangle* tris,
+    __global BVHNode* blasNodes,
+    __global int* blasIndices,
+    __global BVHNode* tlasNodes,
+    __global int* tlasIndices,
+    __global MeshInstance* instances,
+    uint instanceCount)
+{
+  int gid = get_global_id(0);
+  if (gid >= queueCounts[queue]) return;
 
-    for (uint i = 0; i < spheres_count; ++i) 
-    {
-      float3 oc = rayOrigin - (float3)(spheres[i].pos.x, spheres[i].pos.y, spheres[i].pos.z);
-      float b = 2.0f * dot(oc, rayDir);
-      float c = dot(oc, oc) - spheres[i].radius * spheres[i].radius;
-      float disc = b*b - 4.0f*c;
-      if (disc < 0.0f) continue;
+  float3 rayOrigin = paths[gid].origin.xyz;
+  float3 rayDir = paths[gid].direction.xyz;
 
-      float t = (-b - sqrt(disc)) * 0.5f;
+  // find closest sphere, then let meshes beat it
+  PathHit hit;
+  hit.sphere = trace_spheres(bvhNodes, bvhIndices, spheres, spheres_count,
+                             rayOrigin, rayDir, &hit.t);
 
-      if (t > 0.001f && t < hitDistance)
-      {
-        hitDistance = t;
-        closestIndex = i;
-      }
-    }
+  if (trace_meshes(tlasNodes, tlasIndices, instances, instanceCount,
+                   blasNodes, blasIndices, tris,
+                   rayOrigin, rayDir, &hit.t, &hit.mesh))
+    hit.sphere = -1;
 
-    if (closestIndex < 0)
-    {
-      color += (float3)(0.6f, 0.7f, 0.9f) * throughput;
-      break;
-    }
+  hits[gid] = hit;
+}
 
-    Sphere s = spheres[closestIndex];
+// Material classes, one shade kernel and one queue each. Lights end their
+// paths in classify_kernel, so they never reach a shade queue.
+#define MATERIAL_GLASS 0
+#define MATERIAL_MIRROR 1
+#define MATERIAL_SURFACE 2
+#define MATERIAL_CLASSES 3
 
-    float3 hitPos = rayOrigin + rayDir * hitDistance;
-    float3 normal = normalize(hitPos - (float3)(s.pos.x, s.pos.y, s.pos.z));
+// 48 bytes. The resolved hit, written by classify_kernel for the shade kernels
+typedef struct {
+  float4 normal;
+  CustomMaterial material;
+} SurfaceHit;
 
-    CustomMaterial material = s.material;
+inline int material_class(CustomMaterial material)
+{
+    if(material.Translucent > 0.99f && material.Roughness < 0.001f) return MATERIAL_GLASS;
+    if(material.Roughness < 0.001f && clamp(material.Metallic, 0.0f, 1.0f) > 0.99f) return MATERIAL_MIRROR;
+    return MATERIAL_SURFACE;
+}
 
+inline float3 material_f0(CustomMaterial material)
+{
     float3 Albedo = (float3){material.Albedo.x,material.Albedo.y,material.Albedo.z};
-    float metallic  = clamp(material.Metallic,  0.0f, 1.0f);
-    float roughness = clamp(material.Roughness, 0.0f, 1.0f);
+    return lerp((float3)(0.04f), Albedo, clamp(material.Metallic, 0.0f, 1.0f));
+}
 
-    float3 V = -rayDir;
-    float cosThetaV = max(dot(normal, V), 0.0f);
+inline void scatter_glass(
+    float t,
+    float3 normal,
+    CustomMaterial material,
+    float3* rayOrigin,
+    float3* rayDir,
+    float3* throughput,
+    uint* seed)
+{
+    float3 hitPos = *rayOrigin + *rayDir * t;
+    float3 V = -*rayDir;
+    float3 F0 = material_f0(material);
 
-    float3 F0 = lerp((float3)(0.04f), Albedo, metallic);
-    float3 F = fresnel_schlick_vec3(cosThetaV, F0);
+    float eta = material.IOR;
+    float3 N = normal;
 
-    float3 kd = (1.0f - F) * (1.0f - metallic);
-    float3 diffuseBRDF = kd * Albedo * (1.0f / PI);
+    bool entering = dot(V, N) > 0.0f;
+    float etaI = entering ? 1.0f : eta;
+    float etaT = entering ? eta : 1.0f;
 
-    if(material.EmissionPower > 0.0f)
-    {
-        color += throughput * Albedo * material.EmissionPower;
-        break;
-    }
+    if(!entering)
+        N = -N;
 
-    float specularChance = clamp(max(F.x, max(F.y, F.z)),0.05f,0.95f);
+    float etaRatio = etaI / etaT;
 
-    float3 newDir;
-    float pdf;
-    float3 BRDF;
+    float cosTheta = clamp(dot(V, N), 0.0f, 1.0f);
+    float sin2Theta = etaRatio * etaRatio * (1.0f - cosTheta * cosTheta);
 
-    float rand = RandomFloat(&seed);
+    float3 Fglass = fresnel_schlick_vec3(cosTheta, F0);
 
-    // GLASS
-    if(material.Translucent > 0.99f && material.Roughness < 0.001f)
+    // TOTAL INTERNAL REFLECTION
+    if(sin2Theta > 1.0f)
+    {
+        *rayDir = normalize(reflect_vec(*rayDir, N));
+        *throughput *= Fglass;
+    }
+    else
     {
-        float eta = material.IOR;
-        float3 N = normal;
-        float3 V = -rayDir;
+        float3 reflDir = reflect_vec(*rayDir, N);
+        float3 refrDir = normalize(
+            etaRatio * (-V) +
+            (etaRatio * cosTheta - sqrt(1.0f - sin2Theta)) * N
+        );
+
+        float reflectProb = clamp(
+            max(Fglass.x, max(Fglass.y, Fglass.z)),
+            0.05f,
+            0.95f
+        );
+
+        if(RandomFloat(seed) < reflectProb)
+        {
+            *rayDir = normalize(reflDir);
+            *throughput *= Fglass / reflectProb;
+        }
+        else
+        {
+          *rayDir = normalize(refrDir);
 
-        bool entering = dot(V, N) > 0.0f;
-        float etaI = entering ? 1.0f : eta;
-        float etaT = entering ? eta : 1.0f;
+          // === BEER–LAMBERT ABSORPTION ===
+          if(!entering)
+          {
+              float3 colorAbsorption = (float3){0.2f, 0.6f, 1.0f} * 50.0f; 
 
-        if(!entering)
-            N = -N;
+              *throughput *= exp(-colorAbsorption * t);
+          }
 
-        float etaRatio = etaI / etaT;
+          *throughput *= (1.0f - Fglass) / (1.0f - reflectProb);
+        }
+    }
 
-        float cosTheta = clamp(dot(V, N), 0.0f, 1.0f);
-        float sin2Theta = etaRatio * etaRatio * (1.0f - cosTheta * cosTheta);
+    *rayOrigin = hitPos + *rayDir * 0.0001f;
+}
 
-        float3 Fglass = fresnel_schlick_vec3(cosTheta, F0);
+inline void scatter_mirror(
+    float t,
+    float3 normal,
+    CustomMaterial material,
+    float3* rayOrigin,
+    float3* rayDir,
+    float3* throughput)
+{
+    float3 hitPos = *rayOrigin + *rayDir * t;
+    float cosThetaV = max(dot(normal, -*rayDir), 0.0f);
 
-        // TOTAL INTERNAL REFLECTION
-        if(sin2Theta > 1.0f)
-        {
-            rayDir = normalize(reflect_vec(rayDir, N));
-            throughput *= Fglass;
-        }
-        else
-        {
-            float3 reflDir = reflect_vec(rayDir, N);
-            float3 refrDir = normalize(
-                etaRatio * (-V) +
-                (etaRatio * cosTheta - sqrt(1.0f - sin2Theta)) * N
-            );
-
-            float reflectProb = clamp(
-                max(Fglass.x, max(Fglass.y, Fglass.z)),
-                0.05f,
-                0.95f
-            );
-
-            if(RandomFloat(&seed) < reflectProb)
-            {
-                rayDir = normalize(reflDir);
-                throughput *= Fglass / reflectProb;
-            }
-            else
-            {
-              rayDir = normalize(refrDir);
+    *throughput *= fresnel_schlick_vec3(cosThetaV, material_f0(material));
 
-              // === BEER–LAMBERT ABSORPTION ===
-              if(!entering)
-              {
-                  float distance = hitDistance;
+    *rayOrigin = hitPos + normal * 0.0001f;
+    *rayDir    = normalize(reflect_vec(*rayDir, normal));
+}
 
-                  float3 colorAbsorption = (float3){0.2f, 0.6f, 1.0f} * 50.0f; 
+// GGX specular or diffuse, picked per path by the Fresnel weight
+inline void scatter_surface(
+    float t,
+    float3 normal,
+    CustomMaterial material,
+    float3* rayOrigin,
+    float3* rayDir,
+    float3* throughput,
+    uint* seed)
+{
+    float3 hitPos = *rayOrigin + *rayDir * t;
 
-                  float3 absorption =
-                      exp(-colorAbsorption * distance);
+    float3 Albedo = (float3){material.Albedo.x,material.Albedo.y,material.Albedo.z};
+    float metallic  = clamp(material.Metallic,  0.0f, 1.0f);
+    float roughness = clamp(material.Roughness, 0.0f, 1.0f);
 
-                  throughput *= absorption;
-              }
+    float3 V = -*rayDir;
+    float cosThetaV = max(dot(normal, V), 0.0f);
 
-              throughput *= (1.0f - Fglass) / (1.0f - reflectProb);
-            }
-        }
+    float3 F = fresnel_schlick_vec3(cosThetaV, material_f0(material));
 
-        rayOrigin = hitPos + rayDir * 0.0001f;
-        continue;
-    }
+    float3 kd = (1.0f - F) * (1.0f - metallic);
+    float3 diffuseBRDF = kd * Albedo * (1.0f / PI);
 
-    // MIRROR
-    if(material.Roughness < 0.001f && metallic > 0.99f)
-    {
-      newDir = reflect_vec(rayDir, normal);
+    float specularChance = clamp(max(F.x, max(F.y, F.z)),0.05f,0.95f);
 
-      throughput *= F;
+    float3 newDir;
+    float pdf;
+    float3 BRDF;
 
-      rayOrigin = hitPos + normal * 0.0001f;
-      rayDir    = normalize(newDir);
-      continue;
-    }
     // SPECULAR
-    if(rand < specularChance)
+    if(RandomFloat(seed) < specularChance)
     {
-      newDir = SampleGGX(normal, roughness, &seed,rayDir);
+      newDir = SampleGGX(normal, roughness, seed, *rayDir);
 
       float cosThetaL = max(dot(normal, newDir), 0.0f);
 
@@ -399,12 +830,12 @@ __kernel void fragment_kernel(
 
       BRDF = specularBRDF;
 
-      pdf = specularChance * GGX_PDF(normal, newDir, roughness,rayDir);
+      pdf = specularChance * GGX_PDF(normal, newDir, roughness, *rayDir);
     }
     // DIFFUSE
     else
     {
-      newDir = SampleCosineHemisphere(normal, &seed);
+      newDir = SampleCosineHemisphere(normal, seed);
 
       float cosThetaL = max(dot(normal, newDir), 0.0f);
 
@@ -414,15 +845,223 @@ __kernel void fragment_kernel(
     }
 
     float cosOut = max(dot(normal, newDir), 0.0f);
-    throughput *= BRDF * cosOut / max(pdf, 0.001f);
+    *throughput *= BRDF * cosOut / max(pdf, 0.001f);
 
     // NEXT RAY
-    rayOrigin = hitPos + normal * 0.0001f;
-    rayDir    = normalize(newDir);
+    *rayOrigin = hitPos + normal * 0.0001f;
+    *rayDir    = normalize(newDir);
+}
+
+// Ends paths that miss or hit a light and sorts the rest into one queue per
+// material class, so each shade kernel below runs a single BSDF. Counts live
+// after the two path queues: queueCounts[2 + class].
+__kernel void classify_kernel(
+    __global const PathState* paths,
+    __global const PathHit* hits,
+    __global int* queueCounts,
+    int queue,
+    __global SurfaceHit* surfaces,
+    __global int* materialQueues,
+    int queueStride,
+    __global float4* radiance,
+    uint bounce,
+    uint maxBounces,
+    __global Sphere* spheres,
+    __global Triangle* tris,
+    __global MeshInstance* instances,
+    __global Color* textures)
+{
+  int gid = get_global_id(0);
+  int lid = get_local_id(0);
+  int count = queueCounts[queue];
+
+  // uniform per group, so no barrier below is skipped by part of a group
+  if (get_group_id(0) * get_local_size(0) >= count) return;
+
+  __local int localCount[MATERIAL_CLASSES];
+  __local int localBase[MATERIAL_CLASSES];
+  if (lid < MATERIAL_CLASSES) localCount[lid] = 0;
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  int materialClass = -1;
+
+  if (gid < count)
+  {
+    PathState path = paths[gid];
+    PathHit hit = hits[gid];
+
+    float3 rayOrigin = path.origin.xyz;
+    float3 rayDir = path.direction.xyz;
+    float3 throughput = path.throughput.xyz;
+
+    if (hit.sphere < 0 && hit.mesh.instance < 0)
+    {
+      radiance[path.pixel] = (float4)((float3)(0.6f, 0.7f, 0.9f) * throughput, 1.0f);
+    }
+    else
+    {
+      float3 normal;
+      CustomMaterial material;
+
+      if (hit.mesh.instance >= 0)
+      {
+        shade_mesh_hit(hit.mesh, instances, tris, textures, rayDir, &normal, &material);
+      }
+      else
+      {
+        Sphere s = spheres[hit.sphere];
+        float3 hitPos = rayOrigin + rayDir * hit.t;
+        normal = normalize(hitPos - (float3)(s.pos.x, s.pos.y, s.pos.z));
+        material = s.material;
+      }
+
+      if (material.EmissionPower > 0.0f)
+      {
+        float3 Albedo = (float3)(material.Albedo.x, material.Albedo.y, material.Albedo.z);
+        radiance[path.pixel] = (float4)(throughput * Albedo * material.EmissionPower, 1.0f);
+      }
+      // paths still going after the last bounce are dropped, contributing nothing
+      else if (bounce + 1 < maxBounces)
+      {
+        surfaces[gid] = (SurfaceHit){ (float4)(normal, 0.0f), material };
+        materialClass = material_class(material);
+      }
+    }
+  }
+
+  int localSlot = materialClass >= 0 ? atomic_inc(&localCount[materialClass]) : 0;
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  if (lid < MATERIAL_CLASSES)
+    localBase[lid] = atomic_add(&queueCounts[2 + lid], localCount[lid]);
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  if (materialClass >= 0)
+    materialQueues[materialClass * queueStride + localBase[materialClass] + localSlot] = gid;
+}
+
+// Scatters one material queue. Every entry survives, so each work-group
+// appends its whole live range to the next path queue with one atomic.
+// materialClass is a literal at every call site and folds away.
+inline void shade_queue(
+    int materialClass,
+    __global const PathState* pathsIn,
+    __global const PathHit* hits,
+    __global const SurfaceHit* surfaces,
+    __global const int* materialQueues,
+    int queueStride,
+    __global int* queueCounts,
+    int queue,
+    __global PathState* pathsOut,
+    uint bounce,
+    __local int* groupBase)
+{
+  int gid = get_global_id(0);
+  int lid = get_local_id(0);
+  int count = queueCounts[2 + materialClass];
+  int groupStart = get_group_id(0) * get_local_size(0);
+
+  if (groupStart >= count) return;
+
+  PathState path;
+
+  if (gid < count)
+  {
+    int slot = materialQueues[materialClass * queueStride + gid];
+    path = pathsIn[slot];
+    float t = hits[slot].t;
+    float3 normal = surfaces[slot].normal.xyz;
+    CustomMaterial material = surfaces[slot].material;
+
+    float3 rayOrigin = path.origin.xyz;
+    float3 rayDir = path.direction.xyz;
+    float3 throughput = path.throughput.xyz;
+    uint seed = path.seed + bounce;
+
+    if (materialClass == MATERIAL_GLASS)
+      scatter_glass(t, normal, material, &rayOrigin, &rayDir, &throughput, &seed);
+    else if (materialClass == MATERIAL_MIRROR)
+      scatter_mirror(t, normal, material, &rayOrigin, &rayDir, &throughput);
+    else
+      scatter_surface(t, normal, material, &rayOrigin, &rayDir, &throughput, &seed);
+
+    path.origin = (float4)(rayOrigin, 0.0f);
+    path.direction = (float4)(rayDir, 0.0f);
+    path.throughput = (float4)(throughput, 0.0f);
+    path.seed = seed;
   }
 
+  if (lid == 0)
+    *groupBase = atomic_add(&queueCounts[1 - queue], min((int)get_local_size(0), count - groupStart));
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  if (gid < count) pathsOut[*groupBase + lid] = path;
+}
+
+__kernel void shade_glass_kernel(
+    __global const PathState* pathsIn,
+    __global const PathHit* hits,
+    __global const SurfaceHit* surfaces,
+    __global const int* materialQueues,
+    int queueStride,
+    __global int* queueCounts,
+    int queue,
+    __global PathState* pathsOut,
+    uint bounce)
+{
+  __local int groupBase;
+  shade_queue(MATERIAL_GLASS, pathsIn, hits, surfaces, materialQueues, queueStride,
+              queueCounts, queue, pathsOut, bounce, &groupBase);
+}
+
+__kernel void shade_mirror_kernel(
+    __global const PathState* pathsIn,
+    __global const PathHit* hits,
+    __global const SurfaceHit* surfaces,
+    __global const int* materialQueues,
+    int queueStride,
+    __global int* queueCounts,
+    int queue,
+    __global PathState* pathsOut,
+    uint bounce)
+{
+  __local int groupBase;
+  shade_queue(MATERIAL_MIRROR, pathsIn, hits, surfaces, materialQueues, queueStride,
+              queueCounts, queue, pathsOut, bounce, &groupBase);
+}
+
+__kernel void shade_surface_kernel(
+    __global const PathState* pathsIn,
+    __global const PathHit* hits,
+    __global const SurfaceHit* surfaces,
+    __global const int* materialQueues,
+    int queueStride,
+    __global int* queueCounts,
+    int queue,
+    __global PathState* pathsOut,
+    uint bounce)
+{
+  __local int groupBase;
+  shade_queue(MATERIAL_SURFACE, pathsIn, hits, surfaces, materialQueues, queueStride,
+              queueCounts, queue, pathsOut, bounce, &groupBase);
+}
+
+__kernel void accumulate_kernel(
+    __global const float4* radiance,
+    __global float4* accumulationBuffer,
+    __global Color* frameBuffer,
+    int width,
+    int height,
+    uint frameIndex)
+{
+  int x = get_global_id(0);
+  int y = get_global_id(1);
+  if (x >= width || y >= height) return;
+
+  uint idx = y * width + x;
+
   // PATH TRACING
-  accumulationBuffer[idx] += (float4){color.xyz,1.0};
+  accumulationBuffer[idx] += (float4){radiance[idx].xyz,1.0};
   float4 accumulatedColor = accumulationBuffer[idx];
   accumulatedColor /= (float)frameIndex;
 